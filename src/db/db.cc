@@ -20,9 +20,17 @@ int DB::Open(const Options& options, zlog::Log *log,
 int DB::Open(const Options& options, zlog::Log *log,
     bool create_if_empty, DB **db,
     std::shared_ptr<spdlog::logger> logger)
+{
+  return Open(options, log, nullptr, create_if_empty, db, logger);
+}
+
+int DB::Open(const Options& options, zlog::Log *log,
+    zlog::Log *ai_log, bool create_if_empty, DB **db,
+    std::shared_ptr<spdlog::logger> logger)
 {
   auto entry_service = std::unique_ptr<EntryService>(
-      new EntryService(options, options.statistics.get(), log));
+      new EntryService(options, options.statistics.get(), log, ai_log));
+  const bool separate = entry_service->SeparateAfterImageLog();
 
   uint64_t tail = entry_service->CheckTail();
   if (tail == 0) {
@@ -30,6 +38,10 @@ int DB::Open(const Options& options, zlog::Log *log,
       return -EINVAL;
     }
 
+    if (separate && entry_service->CheckAfterImageTail() != 0) {
+      return -EINVAL;
+    }
+
     // TODO: get even more defensive and add a fatal error if position 0 is ever
     // accessed in the I/O layer.
     entry_service->Fill(0);
@@ -48,11 +60,18 @@ int DB::Open(const Options& options, zlog::Log *log,
 
     std::vector<SharedNodeRef> delta;
     cruzdb_proto::AfterImage after_image;
+    tree->UpdateSubtreeStats();
     tree->SerializeAfterImage(after_image, 1, delta);
     assert(after_image.intention() == 1);
 
-    pos = entry_service->Append(after_image);
-    assert(pos == 2);
+    if (separate) {
+      entry_service->FillAfterImageLog(0);
+      pos = entry_service->Append(after_image);
+      assert(pos == 1);
+    } else {
+      pos = entry_service->Append(after_image);
+      assert(pos == 2);
+    }
   }
 
   DBImpl::RestorePoint point;
@@ -65,7 +84,39 @@ int DB::Open(const Options& options, zlog::Log *log,
       std::move(entry_service), logger);
 
   // if there is stuff to roll forward
-  impl->WaitOnIntention(latest_intention);
+  impl->RollForward(latest_intention);
+
+  *db = impl;
+
+  return 0;
+}
+
+int DB::OpenReadOnly(const Options& options, zlog::Log *log, DB **db,
+    std::shared_ptr<spdlog::logger> logger)
+{
+  return OpenReadOnly(options, log, nullptr, db, logger);
+}
+
+int DB::OpenReadOnly(const Options& options, zlog::Log *log,
+    zlog::Log *ai_log, DB **db,
+    std::shared_ptr<spdlog::logger> logger)
+{
+  auto entry_service = std::unique_ptr<EntryService>(
+      new EntryService(options, options.statistics.get(), log, ai_log));
+
+  // holes are left for the primary to fill
+  DBImpl::RestorePoint point;
+  uint64_t latest_intention;
+  int ret = DBImpl::FindRestorePoint(entry_service.get(),
+      point, latest_intention, false);
+  if (ret) {
+    return ret;
+  }
+
+  DBImpl *impl = new DBImpl(options, log, point,
+      std::move(entry_service), logger, true);
+
+  impl->RollForward(latest_intention);
 
   *db = impl;
 
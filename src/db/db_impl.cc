@@ -1,6 +1,9 @@
 #include "db_impl.h"
 #include <unistd.h>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
 #include <iomanip>
 #include <boost/lexical_cast.hpp>
 #include <spdlog/spdlog.h>
@@ -10,27 +13,36 @@ namespace cruzdb {
 DBImpl::DBImpl(const Options& options, zlog::Log *log,
     const RestorePoint& point,
     std::unique_ptr<EntryService> entry_service,
-    std::shared_ptr<spdlog::logger> logger) :
+    std::shared_ptr<spdlog::logger> logger,
+    bool read_only) :
   cache_(options, log, this),
   stop_(false),
   entry_service_(std::move(entry_service)),
   intention_iterator_(entry_service_->NewIntentionIterator(point.replay_start_pos)),
   in_flight_txn_rid_(-1),
   root_(Node::Nil(), this),
+  committed_root_(nullptr),
 #if 0
   metrics_http_server_({"listening_ports", "0.0.0.0:8080", "num_threads", "1"}),
 #endif
   metrics_handler_(this),
+  transactions_started_(0),
+  snapshots_open_(0),
+  iterators_open_(0),
+  iterator_pinned_bytes_(0),
   logger_(logger),
   options_(options),
-  stats_(options.statistics.get())
+  stats_(options.statistics.get()),
+  read_only_(read_only),
+  caught_up_(std::chrono::steady_clock::now())
 {
-  entry_service_->Start(point.replay_start_pos);
+  // the after image at the restore point has already been matched
+  entry_service_->Start(point.replay_start_pos, point.after_image_pos + 1);
 
   auto root = cache_.CacheAfterImage(*point.after_image, point.after_image_pos);
-  root_ = root;
+  set_root_locked(root, point.after_image->intention());
+  cache_.PinRoot(root_.ref_notrace(), root_.Address());
 
-  root_snapshot_ = point.after_image->intention();
   last_intention_processed_ = root_snapshot_;
 
   if (logger_)
@@ -41,6 +53,11 @@ DBImpl::DBImpl(const Options& options, zlog::Log *log,
   afterimage_finalizer_thread_ = std::thread(&DBImpl::AfterImageFinalizerEntry, this);
 
   janitor_thread_ = std::thread(&DBImpl::JanitorEntry, this);
+  reclaimer_thread_ = std::thread(&DBImpl::ReclaimerEntry, this);
+
+  if (!options_.hot_set_path.empty()) {
+    warmup_thread_ = std::thread(&DBImpl::WarmupEntry, this);
+  }
 
 #if 0
   metrics_http_server_.addHandler("/metrics", &metrics_handler_);
@@ -57,6 +74,14 @@ DBImpl::~DBImpl()
   janitor_cond_.notify_one();
   janitor_thread_.join();
 
+  if (warmup_thread_.joinable()) {
+    warmup_thread_.join();
+  }
+
+  if (!options_.hot_set_path.empty()) {
+    PersistHotSet();
+  }
+
   entry_service_->Stop();
 
   lcs_trees_cond_.notify_one();
@@ -66,30 +91,349 @@ DBImpl::~DBImpl()
   afterimage_finalizer_thread_.join();
 
   cache_.Stop();
+
+  reclaimer_cond_.notify_one();
+  reclaimer_thread_.join();
+
+  // no readers remain
+  delete committed_root_.exchange(nullptr);
+
+  // drop the remaining references to nodes and trees, which retires them, and
+  // then free everything retired. freeing a node may retire its children, so
+  // keep going until a pass frees nothing.
+  finished_txns_.Clean();
+  lcs_trees_.clear();
+  cache_.Clear();
+  entry_service_.reset();
+
+  size_t reclaimed = 0;
+  while (const auto count = Epoch::Reclaim()) {
+    reclaimed += count;
+  }
+  RecordTick(stats_, EPOCH_OBJECTS_RECLAIMED, reclaimed);
+  SetTickerCount(stats_, EPOCH_OBJECTS_PENDING, Epoch::Pending());
 #if 0
   metrics_http_server_.removeHandler("/metrics");
   metrics_http_server_.close();
 #endif
 }
 
+void DBImpl::set_root_locked(const NodePtr& root, uint64_t snapshot)
+{
+  root_ = root;
+  root_snapshot_ = snapshot;
+
+  auto committed = new CommittedRoot{root_.ref_notrace(), root_.Address(),
+    snapshot};
+  auto prev = committed_root_.exchange(committed);
+  if (prev) {
+    Epoch::Retire(prev);
+  }
+}
+
+NodePtr DBImpl::committed_root(uint64_t *snapshot)
+{
+  Epoch::Guard guard;
+  const auto committed = committed_root_.load();
+  NodePtr root(committed->node, this);
+  if (committed->address) {
+    root.SetAddress(committed->address);
+  }
+  if (snapshot) {
+    *snapshot = committed->snapshot;
+  }
+  return root;
+}
+
 Snapshot *DBImpl::GetSnapshot()
 {
-  std::lock_guard<std::mutex> l(lock_);
-  return new Snapshot(this, root_);
+  BoundStaleness();
+  return NewSnapshot(committed_root());
+}
+
+// the committed state at an intention is the root of the intention's after
+// image. the root is resolved through the intention to after image mapping, and
+// the tree is read lazily through the node cache like any other snapshot.
+Snapshot *DBImpl::GetSnapshotAt(uint64_t intention_pos)
+{
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    if (intention_pos > last_intention_processed_) {
+      return nullptr;
+    }
+  }
+
+  uint64_t snapshot;
+  auto root = committed_root(&snapshot);
+  if (intention_pos == snapshot) {
+    return NewSnapshot(root);
+  }
+
+  // only committed intentions have an after image
+  std::stringstream ci_key;
+  ci_key << std::setw(20) << std::setfill('0') << intention_pos;
+  if (!LookupPath(root, prefix_string(PREFIX_COMMITTED_INTENTION,
+          ci_key.str()))) {
+    return nullptr;
+  }
+
+  const boost::optional<NodeAddress> address =
+    NodeAddress(intention_pos, 0, false);
+  const auto ai_pos = cache_.findAfterImagePosition(address);
+
+  // a stale or wrong mapping must not produce a snapshot of another state
+  auto after_image = entry_service_->ReadAfterImage(ai_pos);
+  if (after_image->intention() != intention_pos) {
+    if (logger_)
+      logger_->error("after image {} is for intention {} not {}", ai_pos,
+          after_image->intention(), intention_pos);
+    return nullptr;
+  }
+
+  // the root is the last node in the after image
+  const bool empty = after_image->tree_size() == 0;
+  NodePtr snapshot_root(empty ? Node::Nil() : nullptr, this);
+  if (!empty) {
+    snapshot_root.SetAfterImageAddress(ai_pos,
+        after_image->tree_size() - 1);
+  }
+
+  return NewSnapshot(snapshot_root);
+}
+
+Snapshot *DBImpl::NewSnapshot(const NodePtr& root)
+{
+  SetTickerCount(stats_, SNAPSHOTS_OPEN, ++snapshots_open_);
+  return new Snapshot(this, root);
 }
 
 void DBImpl::ReleaseSnapshot(Snapshot *snapshot)
 {
-  delete snapshot;
+  if (snapshot->Unref()) {
+    delete snapshot;
+    SetTickerCount(stats_, SNAPSHOTS_OPEN, --snapshots_open_);
+  }
+}
+
+Iterator *DBImpl::NewIterator(const ReadOptions& options,
+    Snapshot *snapshot)
+{
+  return new FilteredPrefixIteratorImpl(PREFIX_USER, snapshot, options);
+}
+
+Iterator *DBImpl::NewIterator(const ReadOptions& options)
+{
+  if (options.snapshot) {
+    return NewIterator(options, options.snapshot);
+  }
+
+  auto snapshot = GetSnapshot();
+  auto it = NewIterator(options, snapshot);
+  ReleaseSnapshot(snapshot);
+  return it;
+}
+
+// the keys in the upper levels of the tree divide it into subtrees of roughly
+// equal size, because the tree is balanced. the levels are sampled until there
+// are a few keys per partition, and the split points are chosen evenly from
+// the samples.
+std::vector<Iterator*> DBImpl::NewPartitionedIterators(
+    const ReadOptions& options, size_t partitions)
+{
+  auto snapshot = options.snapshot ? options.snapshot : GetSnapshot();
+
+  std::string lower, upper;
+  user_key_range(options, &lower, &upper);
+
+  std::vector<NodeAddress> trace;
+  std::vector<std::string> samples;
+  std::vector<NodePtr> level{snapshot->root};
+  while (partitions > 1 && !level.empty() &&
+      samples.size() < 4 * partitions) {
+    std::vector<NodePtr> next;
+    for (auto& ptr : level) {
+      auto node = ptr.ref(trace, options.fill_cache);
+      if (node == Node::Nil()) {
+        continue;
+      }
+      const auto key = node->key();
+      const bool above_lower = key.compare(lower) >= 0;
+      const bool below_upper = key.compare(upper) < 0;
+      if (above_lower) {
+        next.push_back(node->left);
+      }
+      if (below_upper) {
+        next.push_back(node->right);
+      }
+      if (above_lower && below_upper) {
+        samples.emplace_back(key.data() + PREFIX_USER.size() + 1,
+            key.size() - PREFIX_USER.size() - 1);
+      }
+    }
+    level.swap(next);
+  }
+  std::sort(samples.begin(), samples.end());
+
+  if (options.fill_cache) {
+    UpdateLRU(trace);
+  }
+
+  // partition i covers [bounds[i], bounds[i+1]). the first and last are the
+  // bounds of the iteration, if any.
+  std::vector<std::string> splits;
+  for (size_t i = 1; i < partitions && !samples.empty(); i++) {
+    const auto& key = samples[(i * samples.size()) / partitions];
+    if (options.iterate_lower_bound &&
+        zlog::Slice(key).compare(*options.iterate_lower_bound) <= 0) {
+      continue;
+    }
+    if (splits.empty() || splits.back() < key) {
+      splits.push_back(key);
+    }
+  }
+
+  std::vector<Iterator*> iterators;
+  for (size_t i = 0; i <= splits.size(); i++) {
+    ReadOptions partition_options = options;
+    zlog::Slice partition_lower, partition_upper;
+    if (i > 0) {
+      partition_lower = zlog::Slice(splits[i - 1]);
+      partition_options.iterate_lower_bound = &partition_lower;
+    }
+    if (i < splits.size()) {
+      partition_upper = zlog::Slice(splits[i]);
+      partition_options.iterate_upper_bound = &partition_upper;
+    }
+    iterators.push_back(new FilteredPrefixIteratorImpl(PREFIX_USER, snapshot,
+          partition_options));
+  }
+
+  if (!options.snapshot) {
+    ReleaseSnapshot(snapshot);
+  }
+
+  return iterators;
+}
+
+void DBImpl::user_key_range(const ReadOptions& options, std::string *lower,
+    std::string *upper)
+{
+  *lower = prefix_string(PREFIX_USER, options.iterate_lower_bound ?
+      options.iterate_lower_bound->ToString() : "");
+  *upper = options.iterate_upper_bound ?
+    prefix_string(PREFIX_USER, options.iterate_upper_bound->ToString()) :
+    PREFIX_USER + '\1';
+}
+
+boost::optional<std::pair<uint64_t, uint64_t>> DBImpl::KeyRank(
+    NodePtr root, const std::string& prefixed_key, bool fill_cache)
+{
+  std::vector<NodeAddress> trace;
+  const zlog::Slice pkey(prefixed_key);
+  boost::optional<std::pair<uint64_t, uint64_t>> rank =
+    std::pair<uint64_t, uint64_t>(0, 0);
+
+  {
+    Epoch::Guard guard;
+    auto cur = root.get(trace, fill_cache);
+    while (cur != Node::Nil().get()) {
+      int cmp = pkey.compare(zlog::Slice(cur->key().data(),
+            cur->key().size()));
+      auto left = cur->left.get(trace, fill_cache);
+      if (cmp <= 0) {
+        cur = left;
+        continue;
+      }
+      if (!left->has_subtree_stats()) {
+        rank = boost::none;
+        break;
+      }
+      rank->first += left->subtree_count() + 1;
+      rank->second += left->subtree_bytes() + cur->key().size() +
+        cur->val().size();
+      cur = cur->right.get(trace, fill_cache);
+    }
+  }
+
+  if (fill_cache) {
+    UpdateLRU(trace);
+  }
+
+  return rank;
+}
+
+std::pair<uint64_t, uint64_t> DBImpl::RangeStats(const ReadOptions& options)
+{
+  if (!options.snapshot) {
+    BoundStaleness();
+  }
+
+  std::string lower, upper;
+  user_key_range(options, &lower, &upper);
+
+  auto root = options.snapshot ? options.snapshot->root : committed_root();
+  const auto lower_rank = KeyRank(root, lower, options.fill_cache);
+  const auto upper_rank = KeyRank(root, upper, options.fill_cache);
+  if (lower_rank && upper_rank) {
+    return std::make_pair(upper_rank->first - lower_rank->first,
+        upper_rank->second - lower_rank->second);
+  }
+
+  // the tree predates subtree statistics
+  std::pair<uint64_t, uint64_t> stats(0, 0);
+  Snapshot snapshot(this, root);
+  PrefixRawIteratorImpl it(PREFIX_USER, &snapshot, options);
+  for (it.SeekToFirst(); it.Valid(); it.Next()) {
+    stats.first++;
+    stats.second += it.key().size() + it.value().size();
+  }
+  return stats;
+}
+
+uint64_t DBImpl::Count(const ReadOptions& options)
+{
+  return RangeStats(options).first;
+}
+
+uint64_t DBImpl::GetApproximateSize(const ReadOptions& options)
+{
+  return RangeStats(options).second;
+}
+
+void DBImpl::IteratorOpened()
+{
+  SetTickerCount(stats_, ITERATORS_OPEN, ++iterators_open_);
+}
+
+void DBImpl::IteratorClosed()
+{
+  SetTickerCount(stats_, ITERATORS_OPEN, --iterators_open_);
+}
+
+std::future<std::pair<size_t, size_t>> DBImpl::ReadAheadAfterImages(
+    std::vector<uint64_t> positions)
+{
+  auto result = std::make_shared<std::promise<std::pair<size_t, size_t>>>();
+  auto future = result->get_future();
+  entry_service_->PrefetchAfterImagesAsync(std::move(positions),
+      [this, result](std::pair<size_t, size_t> res) {
+        RecordTick(stats_, ITERATOR_READAHEAD_AFTER_IMAGES, res.first);
+        RecordTick(stats_, ITERATOR_READAHEAD_BYTES, res.second);
+        result->set_value(res);
+      });
+  return future;
 }
 
-Iterator *DBImpl::NewIterator(Snapshot *snapshot)
+void DBImpl::UpdateIteratorPinnedBytes(int64_t delta)
 {
-  return new FilteredPrefixIteratorImpl(PREFIX_USER, snapshot);
+  if (delta != 0) {
+    SetTickerCount(stats_, ITERATOR_PINNED_BYTES,
+        iterator_pinned_bytes_ += delta);
+  }
 }
 
 int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
-    uint64_t& latest_intention)
+    uint64_t& latest_intention, bool fill)
 {
   // the true parameter tells the entry service to set max_pos according to the
   // tail returned. this is important, because if this is a new log then tail
@@ -102,15 +446,58 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
     return -EINVAL;
   }
 
+  // the latest after image is a valid restore point. the intention log is
+  // only scanned for the latest intention.
+  if (entry_service->SeparateAfterImageLog()) {
+    auto latest = entry_service->LatestAfterImage(fill);
+    if (!latest) {
+      return -EINVAL;
+    }
+
+    auto it = entry_service->NewReverseIterator(tail, "find_restore_point");
+    while (true) {
+      auto entry = it.NextEntry(fill);
+      if (!entry) {
+        return -EINVAL;
+      }
+      if (entry->second.type == EntryService::CacheEntry::EntryType::INTENTION) {
+        latest_intention = entry->first;
+        break;
+      }
+    }
+
+    point.replay_start_pos = latest->second->intention() + 1;
+    point.after_image_pos = latest->first;
+    point.after_image = latest->second;
+    assert(point.replay_start_pos <= latest_intention + 1);
+    return 0;
+  }
+
   // intention_pos -> earliest (ai_pos, ai_blob)
   std::unordered_map<uint64_t,
     std::pair<uint64_t, std::shared_ptr<cruzdb_proto::AfterImage>>> after_images;
 
   bool set_latest_intention = false;
 
+  // the newest checkpoint is used as soon as the latest intention is known.
+  // checkpoints are written periodically, so the scan is bounded by the
+  // checkpoint interval rather than by how far after images lag behind.
+  std::shared_ptr<cruzdb_proto::Checkpoint> checkpoint;
+  auto restore_checkpoint = [&] {
+    point.replay_start_pos = checkpoint->intention() + 1;
+    point.after_image_pos = checkpoint->after_image();
+    point.after_image = entry_service->ReadAfterImage(
+        checkpoint->after_image());
+    assert(point.after_image->intention() == checkpoint->intention());
+    assert(!checkpoint->has_root_offset() ||
+        (int)checkpoint->root_offset() == point.after_image->tree_size() - 1);
+    assert(checkpoint->intention() <= latest_intention);
+    return 0;
+  };
+
   auto it = entry_service->NewReverseIterator(tail, "find_restore_point");
   while (true) {
-    auto entry = it.NextEntry(true);
+    auto entry = it.NextEntry(fill);
     // if hole, skip. see github issue #33
 
     if (!entry)
@@ -124,6 +511,10 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
            set_latest_intention = true;
          }
 
+         if (checkpoint) {
+           return restore_checkpoint();
+         }
+
          auto it = after_images.find(entry->first);
          if (it != after_images.end()) {
            // found a starting point, but still need to guarantee that the
@@ -155,6 +546,15 @@ int DBImpl::FindRestorePoint(EntryService *entry_service, RestorePoint& point,
       case EntryService::CacheEntry::EntryType::FILLED:
         break;
 
+      case EntryService::CacheEntry::EntryType::CHECKPOINT:
+        if (!checkpoint) {
+          checkpoint = entry->second.checkpoint;
+          if (set_latest_intention) {
+            return restore_checkpoint();
+          }
+        }
+        break;
+
       default:
         assert(0);
         exit(1);
@@ -198,7 +598,7 @@ int DBImpl::Validate(const SharedNodeRef root)
 
 void DBImpl::Validate()
 {
-  auto snapshot = root_;
+  auto snapshot = committed_root();
   bool valid = Validate(snapshot.ref_notrace()) != 0;
   assert(valid);
 }
@@ -214,49 +614,89 @@ boost::optional<uint64_t> DBImpl::IntentionToAfterImage(uint64_t intention_pos)
 }
 
 SharedNodeRef DBImpl::fetch(std::vector<NodeAddress>& trace,
-    boost::optional<NodeAddress>& address)
+    boost::optional<NodeAddress>& address, bool fill_cache)
+{
+  return cache_.fetch(trace, address, fill_cache);
+}
+
+int DBImpl::Get(const ReadOptions& options, const zlog::Slice& key,
+    std::string *value)
+{
+  return Get(options, key, value, nullptr);
+}
+
+int DBImpl::Get(const ReadOptions& options, const zlog::Slice& key,
+    PinnableSlice *value)
 {
-  return cache_.fetch(trace, address);
+  return Get(options, key, nullptr, value);
 }
 
-int DBImpl::Get(const zlog::Slice& key, std::string *value)
+int DBImpl::Get(const ReadOptions& options, const zlog::Slice& key,
+    std::string *value, PinnableSlice *pinned)
 {
+  if (!options.snapshot) {
+    BoundStaleness();
+  }
+
   std::vector<NodeAddress> trace;
-  auto snap = GetSnapshot();
-  auto root = snap->root;
+  auto root = options.snapshot ? options.snapshot->root : committed_root();
 
   // FIXME: this string/slice/prefix append conversion can be more efficient.
   // probably a lot more efficient.
   auto pskey = prefix_string(PREFIX_USER, key.ToString());
   const zlog::Slice pkey(pskey);
 
-  auto cur = root.ref(trace);
-  while (cur != Node::Nil()) {
-    int cmp = pkey.compare(zlog::Slice(cur->key().data(),
-          cur->key().size()));
-    if (cmp == 0) {
-      value->assign(cur->val().data(), cur->val().size());
-      UpdateLRU(trace);
-      return 0;
+  {
+    Epoch::Guard guard;
+    // a node read without filling the cache is only referenced by fetched, so
+    // it is kept for pinning rather than read again.
+    SharedNodeRef fetched;
+    auto fetched_ptr = pinned ? &fetched : nullptr;
+    NodePtr *link = &root;
+    auto cur = link->get(trace, options.fill_cache, fetched_ptr);
+    while (cur != Node::Nil().get()) {
+      int cmp = pkey.compare(zlog::Slice(cur->key().data(),
+            cur->key().size()));
+      if (cmp == 0) {
+        if (value) {
+          value->assign(cur->val().data(), cur->val().size());
+        } else {
+          // only the node holding the value takes a reference
+          auto node = fetched.get() == cur ? fetched :
+            link->pin(options.fill_cache);
+          pinned->PinSlice(node->val(), node);
+        }
+        if (options.fill_cache) {
+          UpdateLRU(trace);
+        }
+        return 0;
+      }
+      link = cmp < 0 ? &cur->left : &cur->right;
+      cur = link->get(trace, options.fill_cache, fetched_ptr);
     }
-    cur = cmp < 0 ? cur->left.ref(trace) :
-      cur->right.ref(trace);
   }
-  UpdateLRU(trace);
+  if (options.fill_cache) {
+    UpdateLRU(trace);
+  }
   return -ENOENT;
 }
 
 Transaction *DBImpl::BeginTransaction()
 {
-  std::lock_guard<std::mutex> lk(lock_);
-  db_stats_.transactions_started++;
+  if (read_only_) {
+    return nullptr;
+  }
+
+  transactions_started_++;
+  uint64_t snapshot;
+  auto root = committed_root(&snapshot);
   auto txn = new TransactionImpl(this,
-      root_,
-      root_snapshot_,
+      root,
+      snapshot,
       in_flight_txn_rid_--,
       txn_finder_.NewToken());
   if (logger_)
-    logger_->info("begin-txn snap {}", root_snapshot_);
+    logger_->info("begin-txn snap {}", snapshot);
   return txn;
 }
 
@@ -272,6 +712,232 @@ void DBImpl::WaitOnIntention(uint64_t pos)
   cond.wait(lk, [&] { return done; });
 }
 
+void DBImpl::RollForward(uint64_t latest_intention)
+{
+  uint64_t start;
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    start = last_intention_processed_;
+  }
+
+  if (latest_intention <= start) {
+    return;
+  }
+
+  const auto total = latest_intention - start;
+  SetTickerCount(stats_, RECOVERY_POSITIONS_TOTAL, total);
+  SetTickerCount(stats_, RECOVERY_POSITIONS_DONE, 0);
+
+  entry_service_->SetReadaheadWindow(options_.recovery_readahead_window);
+
+  std::atomic<uint64_t> next(start + 1);
+  std::vector<std::thread> prefetchers;
+  for (size_t i = 0; i < options_.recovery_prefetch_threads; i++) {
+    prefetchers.emplace_back(&DBImpl::RecoveryPrefetchEntry, this,
+        &next, latest_intention);
+  }
+
+  // same as WaitOnIntention, but wakes up periodically to report progress
+  const auto began = std::chrono::steady_clock::now();
+  bool done = false;
+  std::condition_variable cond;
+  std::unique_lock<std::mutex> lk(lock_);
+  if (latest_intention > last_intention_processed_) {
+    waiting_on_log_entry_.emplace(latest_intention,
+        std::make_pair(&cond, &done));
+    while (!cond.wait_for(lk, std::chrono::seconds(1), [&] { return done; })) {
+      const auto processed = last_intention_processed_ - start;
+      SetTickerCount(stats_, RECOVERY_POSITIONS_DONE, processed);
+      if (logger_) {
+        const auto secs = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - began).count();
+        logger_->info("recovery: {}/{} positions ({:.0f}/s)",
+            processed, total, processed / secs);
+      }
+    }
+  }
+  lk.unlock();
+
+  SetTickerCount(stats_, RECOVERY_POSITIONS_DONE, total);
+
+  // prefetchers block on the processor, which is now past the end
+  for (auto& thread : prefetchers) {
+    thread.join();
+  }
+
+  entry_service_->SetReadaheadWindow(options_.log_readahead_window);
+
+  if (logger_) {
+    const auto secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - began).count();
+    logger_->info("recovery: replayed {} positions in {:.2f}s", total, secs);
+  }
+}
+
+// claims log positions in order and reads the intentions found there ahead of
+// the transaction processor. the keys an intention modifies are looked up in
+// the latest committed tree, which pulls the after images that replay will
+// traverse into the node cache.
+void DBImpl::RecoveryPrefetchEntry(std::atomic<uint64_t> *next, uint64_t end)
+{
+  const auto window = std::max(options_.recovery_readahead_window, (size_t)1);
+
+  while (true) {
+    const auto pos = next->fetch_add(1);
+    if (pos > end) {
+      break;
+    }
+
+    // don't get too far ahead of the processor, or prefetched entries will be
+    // evicted before they are used.
+    if (pos > window) {
+      WaitOnIntention(pos - window);
+    }
+
+    auto entry = entry_service_->Read(pos);
+    if (!entry || entry->type != EntryService::CacheEntry::EntryType::INTENTION) {
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      if (last_intention_processed_ >= pos) {
+        continue;
+      }
+    }
+    auto root = committed_root();
+
+    for (const auto& op : *entry->intention) {
+      switch (op.op()) {
+        case cruzdb_proto::TransactionOp::PUT:
+        case cruzdb_proto::TransactionOp::COPY:
+          LookupPath(root, op.key());
+          break;
+
+        case cruzdb_proto::TransactionOp::DELETE:
+          LookupPath(root, prefix_string(PREFIX_USER, op.key()));
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    RecordTick(stats_, RECOVERY_INTENTIONS_PREFETCHED);
+  }
+}
+
+// walk the tree to a key, which also caches the nodes along the path. returns
+// true if the key exists.
+bool DBImpl::LookupPath(NodePtr root, const std::string& prefixed_key)
+{
+  std::vector<NodeAddress> trace;
+  const zlog::Slice pkey(prefixed_key);
+  bool found;
+
+  {
+    Epoch::Guard guard;
+    auto cur = root.get(trace);
+    while (cur != Node::Nil().get()) {
+      int cmp = pkey.compare(zlog::Slice(cur->key().data(),
+            cur->key().size()));
+      if (cmp == 0) {
+        break;
+      }
+      cur = cmp < 0 ? cur->left.get(trace) :
+        cur->right.get(trace);
+    }
+    found = cur != Node::Nil().get();
+  }
+  UpdateLRU(trace);
+  return found;
+}
+
+void DBImpl::BoundStaleness()
+{
+  if (!read_only_ || (options_.max_staleness_positions == 0 &&
+        options_.max_staleness_ms == 0)) {
+    return;
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+
+  uint64_t processed;
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    if (options_.max_staleness_ms > 0 && (now - caught_up_) <=
+        std::chrono::milliseconds(options_.max_staleness_ms)) {
+      return;
+    }
+    processed = last_intention_processed_;
+  }
+
+  // the time bound is only restarted by seeing the current tail, but the
+  // position bound is checked against the tail last seen by the log reader,
+  // which keeps checking it, so that it costs nothing while it holds.
+  const bool check_time = options_.max_staleness_ms > 0;
+  const auto tail = check_time ? entry_service_->CheckTail() :
+    entry_service_->ObservedTail();
+  if (tail == 0) {
+    return;
+  }
+
+  // the newest intention at or before pos that hasn't been processed, or zero
+  // if there is none. these entries are read by the log reader anyway, so
+  // they are usually cached.
+  bool stopped = false;
+  auto newest_intention = [&](uint64_t pos) -> uint64_t {
+    for (; pos > processed; pos--) {
+      auto entry = entry_service_->Read(pos);
+      if (!entry) {
+        stopped = true; // shutting down
+        return 0;
+      }
+      if (entry->type == EntryService::CacheEntry::EntryType::INTENTION) {
+        return pos;
+      }
+    }
+    return 0;
+  };
+
+  // the time bound restarts whenever the instance is seen to have caught up
+  // with the tail, whether or not the read had to wait for it.
+  auto restart_time_bound = [&](uint64_t latest) {
+    std::lock_guard<std::mutex> lk(lock_);
+    if (last_intention_processed_ >= latest) {
+      caught_up_ = now;
+    }
+  };
+
+  const auto positions = options_.max_staleness_positions;
+  if (positions > 0 && tail - 1 <= processed + positions) {
+    // within the position bound. the time bound can still be restarted if
+    // the log reader has reached the tail, since that doesn't wait.
+    if (check_time && entry_service_->Readable(tail - 1)) {
+      const auto latest = newest_intention(tail - 1);
+      if (!stopped) {
+        restart_time_bound(latest);
+      }
+    }
+    return;
+  }
+
+  // wait for the instance to reach the position bound, or the tail
+  const auto bound = positions > 0 ? tail - 1 - positions : tail - 1;
+  const auto target = newest_intention(bound);
+  if (stopped) {
+    return;
+  }
+
+  if (target > 0) {
+    WaitOnIntention(target);
+  }
+
+  if (bound == tail - 1) {
+    restart_time_bound(target);
+  }
+}
+
 void DBImpl::NotifyIntention(uint64_t pos)
 {
   auto first = waiting_on_log_entry_.begin();
@@ -384,6 +1050,14 @@ void DBImpl::TransactionProcessorEntry()
     if (logger_)
       logger_->info("txn-proc: ipos {}", intention_pos);
 
+    if (options_.adopt_after_images) {
+      auto ai_pos = entry_service_->ai_matcher.adopt(intention_pos);
+      if (ai_pos) {
+        AdoptAfterImage(*intention, *ai_pos);
+        continue;
+      }
+    }
+
     // serial intention? a flush intention is also treated like serial in that
     // it has no conflicts. be careful that serial doesn't examine anything in
     // the flush intention that might not be set given the flush intention's
@@ -467,8 +1141,7 @@ void DBImpl::TransactionProcessorEntry()
 
     std::unique_lock<std::mutex> lk(lock_);
 
-    root_ = root;
-    root_snapshot_ = intention_pos;
+    set_root_locked(root, intention_pos);
 
     assert(last_intention_processed_ < intention_pos);
     last_intention_processed_ = intention_pos;
@@ -480,6 +1153,46 @@ void DBImpl::TransactionProcessorEntry()
   }
 }
 
+// the committed tree is taken from an after image of the intention that is
+// already in the log, which implies that the intention committed. the after
+// image is already the primary, so it doesn't go through the writer or the
+// finalizer.
+void DBImpl::AdoptAfterImage(const Intention& intention, uint64_t ai_pos)
+{
+  const auto intention_pos = intention.Position();
+
+  // the matcher indexes after images by the intention they name, so a
+  // mismatch means the log or the index is corrupt
+  auto after_image = entry_service_->ReadAfterImage(ai_pos);
+  if (after_image->intention() != intention_pos) {
+    std::cerr << "after image " << ai_pos << " is for intention "
+      << after_image->intention() << " not " << intention_pos << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  auto root = cache_.CacheAfterImage(*after_image, ai_pos);
+  cache_.SetIntentionMapping(intention_pos, ai_pos);
+  cache_.PinRoot(root.ref_notrace(), root.Address());
+
+  // the local transaction's tree, if any, is replaced by the after image
+  finished_txns_.Find(intention_pos);
+
+  committed_intentions_.push(intention_pos);
+
+  std::lock_guard<std::mutex> lk(lock_);
+
+  assert(root_snapshot_ < intention_pos);
+  set_root_locked(root, intention_pos);
+
+  assert(last_intention_processed_ < intention_pos);
+  last_intention_processed_ = intention_pos;
+
+  NotifyTransaction(intention.Token(), intention_pos, true);
+
+  RecordTick(stats_, AFTER_IMAGES_ADOPTED);
+}
+
 // asynchronously dispatch after image serializations to the log
 // TODO:
 //  - throttle
@@ -507,14 +1220,21 @@ void DBImpl::AfterImageWriterEntry()
       tree->SerializeAfterImage(after_image, intention_pos, delta);
       assert(after_image.intention() == intention_pos);
 
-      entry_service_->ai_matcher.watch(std::move(delta), std::move(tree));
+      // an after image written by a previous instance may have already been
+      // read from the log, which is common when rolling forward.
+      if (entry_service_->ai_matcher.watch(std::move(delta), std::move(tree))) {
+        RecordTick(stats_, AFTER_IMAGE_APPENDS_SKIPPED);
+        continue;
+      }
+
+      // a read-only instance waits for the primary to write the after image
+      if (read_only_) {
+        continue;
+      }
 
-      // in its current form, this isn't actually async because there is very
-      // little, if any, benefit from actual AIO with the LMDB/RAM backends. for
-      // for other backends the benefit is huge. other optimizations like not
-      // writing the after image if we already know about it by looking at the
-      // dedup index.
-      entry_service_->Append(after_image);
+      // the after image is matched with the tree when it is read back from
+      // the log, so there is no need to wait for the append to complete.
+      entry_service_->AppendAsync(after_image);
     }
 
     lk.lock();
@@ -537,10 +1257,28 @@ void DBImpl::AfterImageFinalizerEntry()
     if (logger_)
       logger_->info("ai-fini: ai_pos {}", ai_pos);
 
-    assert(ipos < ai_pos);
+    assert(entry_service_->SeparateAfterImageLog() || ipos < ai_pos);
     tree->SetDeltaPosition(delta, ai_pos);
     cache_.SetIntentionMapping(ipos, ai_pos);
     cache_.ApplyAfterImageDelta(delta, ai_pos);
+    RecordTick(stats_, AFTER_IMAGES_FINALIZED);
+
+    // the after image was matched after being read back from the log, so it
+    // is safe to restore from. the separate after image log is searched
+    // directly for the latest after image, and doesn't need checkpoints.
+    if (options_.checkpoint_interval > 0 && !read_only_ &&
+        !entry_service_->SeparateAfterImageLog() &&
+        ++finalized_since_checkpoint_ >= options_.checkpoint_interval) {
+      finalized_since_checkpoint_ = 0;
+      cruzdb_proto::Checkpoint checkpoint;
+      checkpoint.set_intention(ipos);
+      checkpoint.set_after_image(ai_pos);
+      if (!delta.empty()) {
+        checkpoint.set_root_offset(delta.size() - 1);
+      }
+      entry_service_->AppendAsync(checkpoint);
+      RecordTick(stats_, LOG_CHECKPOINTS);
+    }
 
     std::unique_lock<std::mutex> lk(lock_);
     if (stop_)
@@ -555,13 +1293,20 @@ bool DBImpl::CompleteTransaction(TransactionImpl *txn)
   TransactionFinder::WaiterHandle waiter;
   txn_finder_.AddTokenWaiter(waiter, token);
 
-  // MOVE txn's intention to the append io service
-  auto pos = entry_service_->Append(std::move(txn->GetIntention()));
-
-  // MOVE txn's tree into index for txn processor
+  // MOVE txn's intention to the append io service. txn's tree is moved into
+  // the index for the txn processor as soon as the append completes, which
+  // happens on the append completion thread.
   auto tree = std::move(txn->Tree());
-  tree->SetIntention(pos);
-  finished_txns_.Insert(pos, std::move(tree));
+  auto appended = std::make_shared<std::promise<uint64_t>>();
+  auto appended_pos = appended->get_future();
+  entry_service_->AppendAsync(std::move(txn->GetIntention()),
+      [this, &tree, appended](uint64_t pos) {
+    tree->SetIntention(pos);
+    finished_txns_.Insert(pos, std::move(tree));
+    appended->set_value(pos);
+  });
+
+  const auto pos = appended_pos.get();
 
   bool committed = txn_finder_.WaitOnTransaction(waiter, pos);
 
@@ -571,7 +1316,7 @@ bool DBImpl::CompleteTransaction(TransactionImpl *txn)
 std::map<uint64_t, std::pair<uint64_t, uint64_t>>
 DBImpl::reachable_node_stats()
 {
-  auto node = root_.ref_notrace();
+  auto node = committed_root().ref_notrace();
 
   // build a list of all node addresses that are reachable
   std::map<NodeAddress, std::string> addrs;
@@ -629,7 +1374,7 @@ DBImpl::reachable_node_stats()
 // node copies where the children are further back in the log...
 void DBImpl::gc()
 {
-  auto node = root_.ref_notrace();
+  auto node = committed_root().ref_notrace();
 
   std::map<NodeAddress, std::string> addrs;
   std::stack<SharedNodeRef> stack;
@@ -811,18 +1556,25 @@ void DBImpl::FinishedTransactions::Insert(uint64_t ipos,
 
 void DBImpl::FinishedTransactions::Clean(uint64_t last_ipos)
 {
-  std::vector<std::unique_ptr<PersistentTree>> unused_trees;
-  std::lock_guard<std::mutex> lk(lock_);
-  auto it = txns_.begin();
-  while (it != txns_.end()) {
-    if (it->first <= last_ipos) {
-      unused_trees.emplace_back(std::move(it->second));
-      it = txns_.erase(it);
-    } else {
-      it++;
+  std::unique_ptr<std::vector<std::unique_ptr<PersistentTree>>> unused_trees(
+      new std::vector<std::unique_ptr<PersistentTree>>);
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    auto it = txns_.begin();
+    while (it != txns_.end()) {
+      if (it->first <= last_ipos) {
+        unused_trees->emplace_back(std::move(it->second));
+        it = txns_.erase(it);
+      } else {
+        it++;
+      }
     }
   }
-  // unused_trees destructor called after lock is released
+
+  // the trees are destroyed by the reclaimer rather than the caller
+  if (!unused_trees->empty()) {
+    Epoch::Retire(unused_trees.release());
+  }
 }
 
 void DBImpl::CommittedIntentionIndex::push(uint64_t pos)
@@ -868,13 +1620,117 @@ DBImpl::CommittedIntentionIndex::range(uint64_t first, uint64_t last) const
 
 void DBImpl::JanitorEntry()
 {
+  const auto hot_set_interval =
+    std::chrono::seconds(options_.hot_set_persist_interval_secs);
+  auto hot_set_persisted = std::chrono::steady_clock::now();
+
   while (!stop_) {
     std::unique_lock<std::mutex> lk(lock_);
     janitor_cond_.wait_for(lk, std::chrono::seconds(1));
     lk.unlock();
 
     finished_txns_.Clean(last_intention_processed_);
+
+    if (!options_.hot_set_path.empty()) {
+      const auto now = std::chrono::steady_clock::now();
+      if ((now - hot_set_persisted) >= hot_set_interval) {
+        PersistHotSet();
+        hot_set_persisted = now;
+      }
+    }
+  }
+}
+
+void DBImpl::ReclaimerEntry()
+{
+  const auto batch_size = std::max(options_.reclaim_batch_size, size_t(1));
+
+  while (true) {
+    const auto reclaimed = Epoch::Reclaim(batch_size);
+    RecordTick(stats_, EPOCH_OBJECTS_RECLAIMED, reclaimed);
+    SetTickerCount(stats_, EPOCH_OBJECTS_PENDING, Epoch::Pending());
+
+    std::unique_lock<std::mutex> lk(lock_);
+    if (stop_) {
+      break;
+    }
+
+    // keep going while there is a backlog, yielding between batches
+    if (reclaimed < batch_size) {
+      reclaimer_cond_.wait_for(lk, std::chrono::milliseconds(10));
+    } else {
+      lk.unlock();
+      std::this_thread::yield();
+    }
+  }
+}
+
+// write the after image positions backing the node cache, one per line. the
+// file is replaced atomically so a crash never leaves a partial hot set.
+void DBImpl::PersistHotSet()
+{
+  const auto positions = cache_.HotAfterImages(
+      options_.hot_set_max_positions);
+
+  const auto tmp_path = options_.hot_set_path + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::trunc);
+    for (const auto pos : positions) {
+      out << pos << "\n";
+    }
+    out.flush();
+    if (!out) {
+      if (logger_)
+        logger_->warn("failed to write hot set {}", tmp_path);
+      std::remove(tmp_path.c_str());
+      return;
+    }
+  }
+
+  if (std::rename(tmp_path.c_str(), options_.hot_set_path.c_str())) {
+    if (logger_)
+      logger_->warn("failed to rename hot set {}", tmp_path);
+    std::remove(tmp_path.c_str());
+  }
+}
+
+// read the after images listed in the hot set back into the node cache. reads
+// are issued in batches of asynchronous log reads, and positions that are no
+// longer readable are skipped. this runs concurrently with normal operation.
+void DBImpl::WarmupEntry()
+{
+  std::vector<uint64_t> positions;
+  {
+    std::ifstream in(options_.hot_set_path);
+    uint64_t pos;
+    while (positions.size() < options_.hot_set_max_positions &&
+        (in >> pos)) {
+      positions.emplace_back(pos);
+    }
+  }
+
+  SetTickerCount(stats_, NODE_CACHE_WARMUP_TOTAL, positions.size());
+
+  const size_t batch_size = 64;
+  size_t loaded = 0;
+  for (size_t i = 0; i < positions.size() && !stop_; i += batch_size) {
+    const auto end = std::min(i + batch_size, positions.size());
+    const std::vector<uint64_t> batch(positions.begin() + i,
+        positions.begin() + end);
+
+    auto after_images = entry_service_->TryReadAfterImages(batch);
+    for (const auto& ai : after_images) {
+      cache_.CacheAfterImage(*ai.second, ai.first);
+    }
+
+    loaded += after_images.size();
+    RecordTick(stats_, NODE_CACHE_WARMUP_PROGRESS, batch.size());
+    RecordTick(stats_, NODE_CACHE_WARMUP_LOADED, after_images.size());
   }
+
+  if (logger_)
+    logger_->info("node cache warmup loaded {} of {} after images",
+        loaded, positions.size());
 }
 
 }
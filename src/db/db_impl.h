@@ -1,8 +1,12 @@
 #pragma once
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <random>
 #include <cstring>
@@ -26,6 +30,7 @@
 #include "transaction_impl.h"
 #include "cruzdb/db.h"
 #include "db/entry_service.h"
+#include "db/epoch.h"
 
 namespace cruzdb {
 
@@ -44,27 +49,65 @@ class DBImpl : public DB {
 
   // find the latest point in the log that can be used to restore a database
   // instance. the returned RestorePoint can be passed to the DBImpl
-  // constructor. then use WaitOnIntention to wait until the database has rolled
-  // the log forward.
+  // constructor. then use RollForward to wait until the database has rolled
+  // the log forward. holes are filled unless fill is false, in which case
+  // they are waited out.
   static int FindRestorePoint(EntryService *entry_service, RestorePoint& point,
-      uint64_t& latest_intention);
+      uint64_t& latest_intention, bool fill = true);
 
+  // a read-only instance follows the log without writing to it. after images
+  // are matched with those written by the primary instance, and transactions
+  // are not supported.
   DBImpl(const Options& options, zlog::Log *log,
       const RestorePoint& point,
       std::unique_ptr<EntryService> entry_service,
-      std::shared_ptr<spdlog::logger> logger);
+      std::shared_ptr<spdlog::logger> logger,
+      bool read_only = false);
 
   ~DBImpl();
 
   void WaitOnIntention(uint64_t pos);
 
+  // wait until the intention has been processed, prefetching the intentions
+  // and after images needed to get there. used after opening the database.
+  void RollForward(uint64_t latest_intention);
+
   // exported DB interface
  public:
   Transaction *BeginTransaction() override;
   Snapshot *GetSnapshot() override;
+  Snapshot *GetSnapshotAt(uint64_t intention_pos) override;
   void ReleaseSnapshot(Snapshot *snapshot) override;
-  Iterator *NewIterator(Snapshot *snapshot) override;
-  int Get(const zlog::Slice& key, std::string *value) override;
+  using DB::NewIterator;
+  Iterator *NewIterator(const ReadOptions& options,
+      Snapshot *snapshot) override;
+  Iterator *NewIterator(const ReadOptions& options) override;
+  std::vector<Iterator*> NewPartitionedIterators(
+      const ReadOptions& options, size_t partitions) override;
+  uint64_t Count(const ReadOptions& options) override;
+  uint64_t GetApproximateSize(const ReadOptions& options) override;
+
+  // the number of keys less than the prefixed key, and the size of those
+  // keys and their values. none if part of the path was restored from an
+  // after image without subtree statistics.
+  boost::optional<std::pair<uint64_t, uint64_t>> KeyRank(NodePtr root,
+      const std::string& prefixed_key, bool fill_cache);
+
+  // open iterators report changes to the number of bytes of tree nodes they
+  // pin, for the iterator memory statistics.
+  void IteratorOpened();
+  void IteratorClosed();
+  void UpdateIteratorPinnedBytes(int64_t delta);
+
+  // iterator read-ahead, run in the background. the result is the number of
+  // after images read and their size in bytes.
+  std::future<std::pair<size_t, size_t>> ReadAheadAfterImages(
+      std::vector<uint64_t> positions);
+  using DB::Get;
+  int Get(const ReadOptions& options, const zlog::Slice& key,
+      std::string *value) override;
+  int Get(const ReadOptions& options, const zlog::Slice& key,
+      PinnableSlice *value) override;
 
   // this is harder than it seems. any existing references might keep some
   // entries in the cache alive, like the txn processor looking at the root,
@@ -74,6 +117,8 @@ class DBImpl : public DB {
   // one might also want to consider waiting on the transaction processor and
   // various flushing threads that handle after images to reach a new state
   // since they also may be pinning nodes in memory.
+  //
+  // nodes in the node cache's pinned region are not dropped.
   void ClearCaches() {
     // Add some sort of flush interface TODO
     finished_txns_.Clean();
@@ -93,7 +138,7 @@ class DBImpl : public DB {
   void UpdateLRU(std::vector<NodeAddress>& trace);
   boost::optional<uint64_t> IntentionToAfterImage(uint64_t intention_pos);
   SharedNodeRef fetch(std::vector<NodeAddress>& trace,
-      boost::optional<NodeAddress>& address);
+      boost::optional<NodeAddress>& address, bool fill_cache = true);
 
  public:
   void gc();
@@ -202,9 +247,14 @@ class DBImpl : public DB {
     return out;
   }
 
+  // a lookup for either Get. the value is copied into value if it is set, and
+  // otherwise pinned.
+  int Get(const ReadOptions& options, const zlog::Slice& key,
+      std::string *value, PinnableSlice *pinned);
+
   mutable std::mutex lock_;
   NodeCache cache_;
-  bool stop_;
+  std::atomic<bool> stop_;
 
  public:
   std::unique_ptr<EntryService> entry_service_;
@@ -214,10 +264,11 @@ class DBImpl : public DB {
   std::condition_variable lcs_trees_cond_;
 
   TransactionFinder txn_finder_;
-  std::map<uint64_t, std::pair<std::condition_variable*, bool*>> waiting_on_log_entry_;
+  // several readers may wait on the same position
+  std::multimap<uint64_t, std::pair<std::condition_variable*, bool*>> waiting_on_log_entry_;
   EntryService::IntentionIterator intention_iterator_;
   uint64_t last_intention_processed_;
-  int64_t in_flight_txn_rid_;
+  std::atomic<int64_t> in_flight_txn_rid_;
 
  private:
   class MetricsHandler : public CivetHandler {
@@ -274,37 +325,96 @@ class DBImpl : public DB {
   };
 
   DBStats stats() const {
-    std::lock_guard<std::mutex> lk(lock_);
-    return db_stats_;
+    DBStats stats;
+    stats.transactions_started = transactions_started_;
+    return stats;
   }
 
   FinishedTransactions finished_txns_;
 
+  // the latest committed state as seen by the transaction processor. it is
+  // only written by the processor, and other threads read the published copy
+  // in committed_root_.
   NodePtr root_;
   uint64_t root_snapshot_;
 
+  // the latest committed state, published for readers that don't take lock_.
+  // replaced objects are reclaimed through Epoch, so they must be read inside
+  // an Epoch::Guard.
+  struct CommittedRoot {
+    SharedNodeRef node;
+    boost::optional<NodeAddress> address;
+    uint64_t snapshot;
+  };
+  std::atomic<CommittedRoot*> committed_root_;
+
+  // set root_ and root_snapshot_ and publish them. requires lock_.
+  void set_root_locked(const NodePtr& root, uint64_t snapshot);
+
+  // a pointer to the latest committed root, and optionally its intention
+  NodePtr committed_root(uint64_t *snapshot = nullptr);
+
   void TransactionProcessorEntry();
   std::thread transaction_processor_thread_;
 
   void AfterImageWriterEntry();
   std::thread afterimage_writer_thread_;
 
+  void AdoptAfterImage(const Intention& intention, uint64_t ai_pos);
+  void RecoveryPrefetchEntry(std::atomic<uint64_t> *next, uint64_t end);
+  bool LookupPath(NodePtr root, const std::string& prefixed_key);
+
   void AfterImageFinalizerEntry();
   std::thread afterimage_finalizer_thread_;
+  // only accessed by the finalizer thread
+  size_t finalized_since_checkpoint_ = 0;
 
   void JanitorEntry();
   std::condition_variable janitor_cond_;
   std::thread janitor_thread_;
 
+  // frees retired nodes, so foreground threads and the transaction processor
+  // don't pay for destroying old tree versions
+  void ReclaimerEntry();
+  std::condition_variable reclaimer_cond_;
+  std::thread reclaimer_thread_;
+
+  // the node cache working set is saved by the janitor and restored by the
+  // warmup thread when the database is opened
+  void PersistHotSet();
+  void WarmupEntry();
+  std::thread warmup_thread_;
+
 #if 0
   CivetServer metrics_http_server_;
 #endif
   MetricsHandler metrics_handler_;
-  struct DBStats db_stats_;
+  std::atomic<uint64_t> transactions_started_;
+
+  // snapshots and iterators that are open, and the bytes of tree nodes that
+  // the iterators pin. nodes pinned by an iterator may also be in the node
+  // cache, but are otherwise held outside of its budget.
+  Snapshot *NewSnapshot(const NodePtr& root);
+
+  // the prefixed keys bounding an iteration over user keys
+  static void user_key_range(const ReadOptions& options, std::string *lower,
+      std::string *upper);
+  std::pair<uint64_t, uint64_t> RangeStats(const ReadOptions& options);
+  std::atomic<int64_t> snapshots_open_;
+  std::atomic<int64_t> iterators_open_;
+  std::atomic<int64_t> iterator_pinned_bytes_;
 
   std::shared_ptr<spdlog::logger> logger_;
   Options options_;
   Statistics *stats_;
+
+  // wait until the latest committed state is within the staleness bounds
+  // of a read-only instance
+  void BoundStaleness();
+
+  const bool read_only_;
+  // when the read-only instance last caught up with the log tail
+  std::chrono::steady_clock::time_point caught_up_;
 };
 
 }
@@ -0,0 +1,126 @@
+#include "db/entry_cache.h"
+#include <mutex>
+#include <zlog/log.h>
+#include "db/intention.h"
+
+namespace cruzdb {
+
+EntryCache::EntryCache(size_t intention_bytes, size_t after_image_bytes) :
+  num_shards_(16),
+  intention_bytes_(intention_bytes / num_shards_),
+  after_image_bytes_(after_image_bytes / num_shards_)
+{
+  for (size_t i = 0; i < num_shards_; i++) {
+    shards_.push_back(std::unique_ptr<Shard>(new Shard));
+  }
+}
+
+size_t EntryCache::entry_bytes(const Entry& entry)
+{
+  size_t bytes = sizeof(Slot);
+  switch (entry.type) {
+    case Entry::EntryType::INTENTION:
+      bytes += entry.intention->SpaceUsed();
+      break;
+    case Entry::EntryType::AFTERIMAGE:
+      bytes += entry.after_image->SpaceUsedLong();
+      break;
+    case Entry::EntryType::FILLED:
+      break;
+    case Entry::EntryType::CHECKPOINT:
+      bytes += entry.checkpoint->SpaceUsedLong();
+      break;
+  }
+  return bytes;
+}
+
+boost::optional<EntryCache::Entry> EntryCache::Find(uint64_t pos) const
+{
+  auto& shard = *shards_[pos % num_shards_];
+  std::shared_lock<std::shared_mutex> lk(shard.lock);
+
+  auto it = shard.slots.find(pos);
+  if (it == shard.slots.end()) {
+    return boost::none;
+  }
+
+  auto& slot = it->second;
+  if (!slot.referenced.load(std::memory_order_relaxed)) {
+    slot.referenced.store(true, std::memory_order_relaxed);
+  }
+
+  return slot.entry;
+}
+
+bool EntryCache::Contains(uint64_t pos) const
+{
+  auto& shard = *shards_[pos % num_shards_];
+  std::shared_lock<std::shared_mutex> lk(shard.lock);
+  return shard.slots.find(pos) != shard.slots.end();
+}
+
+EntryCache::Entry EntryCache::Insert(uint64_t pos, const Entry& entry)
+{
+  // size the entry before taking the lock
+  const auto bytes = entry_bytes(entry);
+
+  auto& shard = *shards_[pos % num_shards_];
+  std::unique_lock<std::shared_mutex> lk(shard.lock);
+
+  auto res = shard.slots.emplace(std::piecewise_construct,
+      std::forward_as_tuple(pos),
+      std::forward_as_tuple(entry, bytes));
+  if (!res.second) {
+    return res.first->second.entry;
+  }
+
+  auto& clock = entry.type == Entry::EntryType::AFTERIMAGE ?
+    shard.after_images : shard.intentions;
+  const auto budget = entry.type == Entry::EntryType::AFTERIMAGE ?
+    after_image_bytes_ : intention_bytes_;
+
+  // new entries go just behind the hand, so they are the last visited
+  clock.positions.insert(clock.hand, pos);
+  clock.bytes += bytes;
+  evict_locked(shard, clock, budget);
+
+  return entry;
+}
+
+void EntryCache::evict_locked(Shard& shard, Clock& clock, size_t budget)
+{
+  while (clock.bytes > budget && !clock.positions.empty()) {
+    if (clock.hand == clock.positions.end()) {
+      clock.hand = clock.positions.begin();
+    }
+
+    auto it = shard.slots.find(*clock.hand);
+    assert(it != shard.slots.end());
+    auto& slot = it->second;
+
+    if (slot.referenced.load(std::memory_order_relaxed)) {
+      slot.referenced.store(false, std::memory_order_relaxed);
+      ++clock.hand;
+      continue;
+    }
+
+    clock.bytes -= slot.bytes;
+    clock.hand = clock.positions.erase(clock.hand);
+    shard.slots.erase(it);
+  }
+}
+
+void EntryCache::Clear()
+{
+  for (auto& shard : shards_) {
+    std::unique_lock<std::shared_mutex> lk(shard->lock);
+    shard->slots.clear();
+    for (auto clock : {&shard->intentions, &shard->after_images}) {
+      clock->positions.clear();
+      clock->hand = clock->positions.end();
+      clock->bytes = 0;
+    }
+  }
+}
+
+}
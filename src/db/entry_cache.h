@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <list>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/optional.hpp>
+#include "db/cruzdb.pb.h"
+
+namespace cruzdb {
+
+class Intention;
+
+// A cache of parsed log entries, sharded by log position and bounded in bytes.
+//
+// Intentions (along with filled positions and checkpoints) and after images
+// have separate budgets, so that large after images read at random by node
+// cache misses can't push out the intentions that the transaction processor
+// consumes in log order and re-reads when checking conflicts against recent
+// history. Both use the CLOCK policy: a hit only sets a reference bit, and
+// eviction gives referenced entries a second chance. New entries are inserted
+// just behind the hand, so an intention survives a full sweep of the clock
+// before it can be evicted, and intentions that are re-read while checking
+// conflicts are kept ahead of those that aren't.
+//
+// Lookups take a shard's lock in shared mode and don't modify the shard, so
+// the log reader, the transaction processor, and node cache misses only
+// contend with each other when inserting.
+class EntryCache {
+ public:
+  class Entry {
+   public:
+    enum EntryType {
+      INTENTION,
+      AFTERIMAGE,
+      FILLED,
+      CHECKPOINT
+    };
+
+    EntryType type;
+    std::shared_ptr<Intention> intention;
+    std::shared_ptr<cruzdb_proto::AfterImage> after_image;
+    std::shared_ptr<cruzdb_proto::Checkpoint> checkpoint;
+  };
+
+  EntryCache(size_t intention_bytes, size_t after_image_bytes);
+
+  EntryCache(const EntryCache& other) = delete;
+  EntryCache& operator=(const EntryCache& other) = delete;
+
+  boost::optional<Entry> Find(uint64_t pos) const;
+
+  // true if the position is cached. unlike Find this isn't counted as an
+  // access.
+  bool Contains(uint64_t pos) const;
+
+  // add an entry to the cache. if an entry already exists at the position it
+  // is not replaced, and the existing entry is returned.
+  Entry Insert(uint64_t pos, const Entry& entry);
+
+  void Clear();
+
+ private:
+  struct Slot {
+    Slot(const Entry& entry, size_t bytes) :
+      entry(entry), bytes(bytes), referenced(false)
+    {}
+
+    const Entry entry;
+    const size_t bytes;
+    mutable std::atomic<bool> referenced;
+  };
+
+  // positions visited by a clock hand
+  struct Clock {
+    std::list<uint64_t> positions;
+    std::list<uint64_t>::iterator hand = positions.end();
+    size_t bytes = 0;
+  };
+
+  struct Shard {
+    mutable std::shared_mutex lock;
+    std::unordered_map<uint64_t, Slot> slots;
+    Clock intentions; // and filled positions and checkpoints
+    Clock after_images;
+  };
+
+  static size_t entry_bytes(const Entry& entry);
+
+  // requires the shard lock to be held exclusively
+  void evict_locked(Shard& shard, Clock& clock, size_t budget);
+
+  const size_t num_shards_;
+  const size_t intention_bytes_;   // per shard
+  const size_t after_image_bytes_; // per shard
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}
@@ -1,27 +1,201 @@
 #include "db/entry_service.h"
 #include <iostream>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 #include "db/cruzdb.pb.h"
 
 namespace cruzdb {
 
+using google::protobuf::internal::WireFormatLite;
+
+bool EntryService::PeekEntryType(const std::string& data,
+    cruzdb_proto::LogEntry::EntryType *type)
+{
+  google::protobuf::io::CodedInputStream in(
+      reinterpret_cast<const uint8_t*>(data.data()), data.size());
+
+  // the type is normally the first field, so this rarely skips anything
+  while (true) {
+    const auto tag = in.ReadTag();
+    if (tag == 0) {
+      return false;
+    }
+
+    if (WireFormatLite::GetTagFieldNumber(tag) ==
+          cruzdb_proto::LogEntry::kTypeFieldNumber &&
+        WireFormatLite::GetTagWireType(tag) ==
+          WireFormatLite::WIRETYPE_VARINT) {
+      uint32_t value;
+      if (!in.ReadVarint32(&value) ||
+          !cruzdb_proto::LogEntry::EntryType_IsValid(value)) {
+        return false;
+      }
+      *type = static_cast<cruzdb_proto::LogEntry::EntryType>(value);
+      return true;
+    }
+
+    if (!WireFormatLite::SkipField(&in, tag)) {
+      return false;
+    }
+  }
+}
+
+// the after image is parsed into an arena sized for the entry, and the
+// returned pointer shares ownership of the arena. nothing is copied out of
+// the parsed entry, and the whole message is freed at once.
+std::shared_ptr<cruzdb_proto::AfterImage>
+EntryService::parse_after_image(const std::string& data)
+{
+  google::protobuf::ArenaOptions options;
+  options.start_block_size = std::max(data.size(), (size_t)256);
+  options.max_block_size = std::max(options.start_block_size,
+      options.max_block_size);
+
+  auto arena = std::make_shared<google::protobuf::Arena>(options);
+  auto entry = google::protobuf::Arena::CreateMessage<
+    cruzdb_proto::LogEntry>(arena.get());
+
+  if (!entry->ParseFromString(data) ||
+      entry->type() != cruzdb_proto::LogEntry::AFTER_IMAGE ||
+      !entry->has_after_image()) {
+    return nullptr;
+  }
+
+  return std::shared_ptr<cruzdb_proto::AfterImage>(arena,
+      entry->mutable_after_image());
+}
+
+// intentions are parsed on the heap so that the intention can be moved out of
+// the entry without copying it.
+std::shared_ptr<Intention>
+EntryService::parse_intention(const std::string& data, uint64_t pos)
+{
+  cruzdb_proto::LogEntry entry;
+  if (!entry.ParseFromString(data) ||
+      entry.type() != cruzdb_proto::LogEntry::INTENTION ||
+      !entry.has_intention()) {
+    return nullptr;
+  }
+
+  return std::make_shared<Intention>(
+      std::move(*entry.mutable_intention()), pos);
+}
+
+bool EntryService::decode_log_entry(const std::string& data, uint64_t pos,
+    CacheEntry *cache_entry)
+{
+  cruzdb_proto::LogEntry::EntryType type;
+  if (!PeekEntryType(data, &type)) {
+    return false;
+  }
+
+  switch (type) {
+    case cruzdb_proto::LogEntry::AFTER_IMAGE:
+      cache_entry->type = CacheEntry::EntryType::AFTERIMAGE;
+      cache_entry->after_image = parse_after_image(data);
+      return cache_entry->after_image != nullptr;
+
+    case cruzdb_proto::LogEntry::INTENTION:
+      cache_entry->type = CacheEntry::EntryType::INTENTION;
+      cache_entry->intention = parse_intention(data, pos);
+      return cache_entry->intention != nullptr;
+
+    case cruzdb_proto::LogEntry::CHECKPOINT:
+      {
+        cruzdb_proto::LogEntry entry;
+        if (!entry.ParseFromString(data) || !entry.has_checkpoint()) {
+          return false;
+        }
+        cache_entry->type = CacheEntry::EntryType::CHECKPOINT;
+        cache_entry->checkpoint = std::make_shared<cruzdb_proto::Checkpoint>();
+        cache_entry->checkpoint->Swap(entry.mutable_checkpoint());
+        return true;
+      }
+
+    default:
+      return false;
+  }
+}
+
 EntryService::EntryService(const Options& options,
-    Statistics *statistics, zlog::Log *log) :
+    Statistics *statistics, zlog::Log *log, zlog::Log *ai_log) :
   stats_(statistics),
+  entry_cache_(options.entry_cache_size ? options.entry_cache_size :
+      options.entry_cache_intention_size,
+      options.entry_cache_after_image_size),
+  ai_entry_cache_(&entry_cache_),
   log_(log),
+  ai_log_(ai_log ? ai_log : log),
   stop_(false),
   max_pos_(0),
-  cache_size_(options.entry_cache_size)
+  observed_tail_(0),
+  readahead_window_(std::max(options.log_readahead_window, (size_t)1)),
+  parse_threads_(options.log_parse_threads),
+  max_inflight_appends_(options.log_max_inflight_appends),
+  append_stop_(true),
+  prefetch_stop_(true)
 {
+  SetTickerCount(stats_, LOG_READAHEAD_WINDOW, readahead_window_);
+
+  if (!options.secondary_cache_path.empty()) {
+    secondary_cache_.reset(new SecondaryCache(
+          options.secondary_cache_path,
+          options.secondary_cache_size,
+          options.secondary_cache_segment_size,
+          statistics));
+  }
+
+  if (SeparateAfterImageLog()) {
+    separate_ai_entry_cache_.reset(
+        new EntryCache(0, options.entry_cache_after_image_size));
+    ai_entry_cache_ = separate_ai_entry_cache_.get();
+  }
 }
 
-void EntryService::Start(uint64_t pos)
+void EntryService::Start(uint64_t pos, uint64_t after_image_pos)
 {
-  pos_ = pos;
-  io_thread_ = std::thread(&EntryService::IOEntry, this);
+  tailer_.reset(new LogTailer(log_, &entry_cache_, true));
+  tailer_->pos = pos;
+  tailer_->thread = std::thread(&EntryService::IOEntry, this, tailer_.get());
+
+  if (SeparateAfterImageLog()) {
+    ai_tailer_.reset(new LogTailer(ai_log_, ai_entry_cache_, false));
+    ai_tailer_->pos = after_image_pos;
+    ai_tailer_->thread = std::thread(&EntryService::IOEntry, this,
+        ai_tailer_.get());
+  }
+
+  append_stop_ = false;
+  append_thread_ = std::thread(&EntryService::AppendCompletionEntry, this);
+
+  prefetch_stop_ = false;
+  prefetch_thread_ = std::thread(&EntryService::PrefetchEntry, this);
 }
 
 void EntryService::Stop()
 {
+  // queued prefetches are dropped
+  {
+    std::lock_guard<std::mutex> l(prefetch_lock_);
+    prefetch_stop_ = true;
+  }
+  prefetch_cond_.notify_one();
+  if (prefetch_thread_.joinable()) {
+    prefetch_thread_.join();
+  }
+
+  // complete outstanding appends. any later appends are synchronous.
+  {
+    std::lock_guard<std::mutex> l(append_lock_);
+    append_stop_ = true;
+  }
+  append_cond_.notify_one();
+  append_space_cond_.notify_all();
+  if (append_thread_.joinable()) {
+    append_thread_.join();
+  }
+
   {
     std::lock_guard<std::mutex> l(lock_);
     stop_ = true;
@@ -31,24 +205,162 @@ void EntryService::Stop()
 
   {
     std::lock_guard<std::mutex> l(lock_);
-    for (auto& cond : tail_waiters_) {
-      cond->notify_one();
+    for (auto& waiter : tail_waiters_) {
+      waiter.second->notify_one();
+    }
+  }
+
+  tail_cond_.notify_all();
+  if (tailer_) {
+    tailer_->thread.join();
+  }
+  if (ai_tailer_) {
+    ai_tailer_->thread.join();
+  }
+}
+
+// decode a log entry read by the log reader. runs on the parser threads.
+void EntryService::decode_entry(PendingRead *read) const
+{
+  auto& cache_entry = read->cache_entry;
+
+  if (read->ret == -ENODATA) {
+    cache_entry.type = CacheEntry::EntryType::FILLED;
+    return;
+  } else if (read->ret) {
+    return;
+  }
+
+  if (!decode_log_entry(read->data, read->pos, &cache_entry)) {
+    std::cerr << "invalid log entry at pos " << read->pos << std::endl;
+    assert(0);
+    exit(1);
+  }
+}
+
+// parser threads wait for read-ahead i/o to complete in the order it was
+// issued, and decode the entries so that the log reader only has to publish
+// them.
+void EntryService::ParserEntry(LogTailer *tailer)
+{
+  while (true) {
+    std::unique_lock<std::mutex> lk(tailer->lock);
+    tailer->readahead_cond.wait(lk, [&] {
+      return !tailer->parse_queue.empty() || tailer->parse_stop;
+    });
+
+    if (tailer->parse_queue.empty()) {
+      assert(tailer->parse_stop);
+      break;
     }
+
+    auto read = tailer->parse_queue.front();
+    tailer->parse_queue.pop_front();
+    lk.unlock();
+
+    read->c->WaitForComplete();
+    read->ret = read->c->ReturnValue();
+    delete read->c;
+    read->c = nullptr;
+
+    decode_entry(read);
+
+    lk.lock();
+    read->ready = true;
+    lk.unlock();
+    tailer->ready_cond.notify_one();
   }
+}
 
-  io_thread_.join();
+void EntryService::issue_read(LogTailer *tailer, PendingRead *read)
+{
+  read->ready = false;
+  read->data.clear();
+  read->c = zlog::Log::aio_create_completion();
+  int ret = tailer->log->AioRead(read->pos, read->c, &read->data);
+  if (ret) {
+    std::cerr << "failed to issue read pos " << read->pos
+      << " ret " << ret << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(tailer->lock);
+    tailer->parse_queue.push_back(read);
+  }
+  tailer->readahead_cond.notify_one();
 }
 
-void EntryService::entry_cache_gc()
+// add a decoded entry to the cache and wake up anyone waiting on it. entries
+// are published in log order, which the after image matcher depends on.
+//
+// entries that were already cached (e.g. after images read by a node cache
+// miss ahead of the reader) aren't read again, but every after image is
+// still passed to the matcher.
+void EntryService::publish_read(LogTailer *tailer, PendingRead *read)
 {
-  while (entry_cache_.size() > cache_size_) {
-    entry_cache_.erase(entry_cache_.begin());
+  if (read->cached) {
+    if (read->cache_entry.type == CacheEntry::EntryType::AFTERIMAGE) {
+      ai_matcher.push(read->cache_entry.after_image->intention(), read->pos);
+    }
+    return;
+  }
+
+  if (read->ret == 0) {
+    RecordTick(stats_, LOG_READS);
+    RecordTick(stats_, BYTES_READ, read->data.size());
+    if (read->cache_entry.type == CacheEntry::EntryType::AFTERIMAGE) {
+      ai_matcher.push(read->cache_entry.after_image->intention(), read->pos);
+    }
+  } else if (read->ret == -ENODATA) {
+    RecordTick(stats_, LOG_READS_FILLED);
+  } else {
+    std::cerr << "failed to read pos " << read->pos
+      << " ret " << read->ret << std::endl;
+    assert(0);
+    exit(1);
+  }
+
+  tailer->cache->Insert(read->pos, read->cache_entry);
+
+  if (tailer->intentions) {
+    std::lock_guard<std::mutex> lk(lock_);
+    update_max_pos_locked(read->pos);
   }
 }
 
-void EntryService::IOEntry()
+// waiters are ordered by target position, so only those whose position is now
+// available are woken up.
+void EntryService::update_max_pos_locked(uint64_t pos)
 {
-  uint64_t next = pos_;
+  if (pos <= max_pos_) {
+    return;
+  }
+
+  max_pos_ = pos;
+
+  const auto end = tail_waiters_.upper_bound(max_pos_);
+  for (auto it = tail_waiters_.begin(); it != end; ++it) {
+    it->second->notify_one();
+  }
+}
+
+// the log reader keeps a window of asynchronous reads outstanding in log
+// order. the parser threads decode entries as their reads complete, and the
+// reader publishes them in order. at the tail it polls aggressively at first
+// and then backs off, and local appends cut the wait short.
+void EntryService::IOEntry(LogTailer *tailer)
+{
+  std::vector<std::thread> parsers;
+  for (size_t i = 0; i < std::max(parse_threads_, (size_t)1); i++) {
+    parsers.emplace_back(&EntryService::ParserEntry, this, tailer);
+  }
+
+  std::deque<std::unique_ptr<PendingRead>> window;
+  uint64_t next = tailer->pos;
+  uint64_t tail = next;
+  unsigned idle = 0;
 
   while (true) {
     {
@@ -56,82 +368,87 @@ void EntryService::IOEntry()
       if (stop_)
         break;
     }
-    auto tail = CheckTail();
-    assert(next <= tail);
+
     if (next == tail) {
-      std::this_thread::sleep_for(std::chrono::microseconds(1000));
-      continue;
+      tail = check_tail(tailer->log);
+      assert(next <= tail);
+      if (tailer->intentions) {
+        update_observed_tail(tail);
+      }
     }
-    while (next < tail) {
-      std::unique_lock<std::mutex> lk(lock_);
-      auto it = entry_cache_.find(next);
-      if (it == entry_cache_.end()) {
-        lk.unlock();
-        std::string data;
-        int ret = log_->Read(next, &data);
-        if (ret) {
-          if (ret == -ENOENT) {
-            // we aren't going to spin on the tail, but we haven't yet implemented
-            // a fill policy, and really we shouldn't have holes in our
-            // single-node setup, so we just spin on the hole for now...
-            continue;
-          } else if (ret == -ENODATA) {
-            break;
-          }
-          assert(0);
-        }
 
-        CacheEntry cache_entry;
+    while (next < tail && window.size() < readahead_window_) {
+      auto read = std::unique_ptr<PendingRead>(new PendingRead(next));
+      auto cached = tailer->cache->Find(next);
+      if (cached) {
+        read->cached = true;
+        read->ready = true;
+        read->cache_entry = *cached;
+      } else {
+        issue_read(tailer, read.get());
+      }
+      window.emplace_back(std::move(read));
+      next++;
+    }
 
-        if (ret == 0) {
-          RecordTick(stats_, LOG_READS);
-          RecordTick(stats_, BYTES_READ, data.size());
-
-          cruzdb_proto::LogEntry entry;
-          assert(entry.ParseFromString(data));
-          assert(entry.IsInitialized());
-
-          switch (entry.type()) {
-            case cruzdb_proto::LogEntry::AFTER_IMAGE:
-              cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
-              cache_entry.after_image =
-                std::make_shared<cruzdb_proto::AfterImage>(
-                    std::move(entry.after_image()));
-              ai_matcher.push(entry.after_image(), next);
-              break;
-
-            case cruzdb_proto::LogEntry::INTENTION:
-              cache_entry.type = CacheEntry::EntryType::INTENTION;
-              cache_entry.intention = std::make_shared<Intention>(
-                  entry.intention(), next);
-              break;
-
-            default:
-              assert(0);
-              exit(1);
-          }
-        } else if (ret == -ENODATA) {
-          cache_entry.type = CacheEntry::EntryType::FILLED;
-          RecordTick(stats_, LOG_READS_FILLED);
-        } else {
-          std::cout << "terrible" << std::endl;
-          assert(0);
-          exit(1);
+    if (window.empty()) {
+      if (idle < 64) {
+        std::this_thread::yield();
+      } else {
+        const auto delay = std::chrono::microseconds(
+            std::min(10u << std::min(idle - 64, 7u), 1000u));
+        std::unique_lock<std::mutex> lk(lock_);
+        if (!stop_) {
+          tail_cond_.wait_for(lk, delay);
         }
+      }
+      idle++;
+      continue;
+    }
 
-        lk.lock();
-        entry_cache_.emplace(next, cache_entry);
-        entry_cache_gc();
-        max_pos_ = std::max(max_pos_, next);
-        for (auto& cond : tail_waiters_) {
-          cond->notify_one();
-        }
-        lk.unlock();
+    idle = 0;
+
+    // publish the prefix of the window that has been decoded
+    size_t ready = 0;
+    {
+      std::unique_lock<std::mutex> lk(tailer->lock);
+      tailer->ready_cond.wait(lk, [&] { return window.front()->ready; });
+      while (ready < window.size() && window[ready]->ready) {
+        ready++;
       }
+    }
 
-      next++;
+    for (size_t i = 0; i < ready; i++) {
+      auto read = window.front().get();
+      if (read->ret == -ENOENT) {
+        // a hole below the tail that should be filled in shortly. we haven't
+        // implemented a fill policy, so retry the read until it appears.
+        RecordTick(stats_, LOG_READS_UNWRITTEN);
+        issue_read(tailer, read);
+        break;
+      }
+      publish_read(tailer, read);
+      window.pop_front();
     }
   }
+
+  // wait for outstanding i/o before stopping the parsers
+  {
+    std::unique_lock<std::mutex> lk(tailer->lock);
+    tailer->ready_cond.wait(lk, [&] {
+      for (const auto& read : window) {
+        if (!read->ready)
+          return false;
+      }
+      return true;
+    });
+    tailer->parse_stop = true;
+  }
+  tailer->readahead_cond.notify_all();
+
+  for (auto& parser : parsers) {
+    parser.join();
+  }
 }
 
 EntryService::Iterator::Iterator(
@@ -241,29 +558,34 @@ EntryService::NewAfterImageIterator(uint64_t pos)
 
 boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool fill)
 {
-  std::unique_lock<std::mutex> lk(lock_);
-
   // check cache for target position
-  auto it = entry_cache_.find(pos);
-  if (it != entry_cache_.end()) {
+  auto cached = entry_cache_.Find(pos);
+  if (cached) {
     RecordTick(stats_, LOG_READ_CACHE_HIT);
-    return it->second;
+    return cached;
   }
 
   // if position is larger than any added to the cache so far, wait to be
   // notified when the position has been read by the log scanner.
+  std::unique_lock<std::mutex> lk(lock_);
   if (pos > max_pos_) {
     std::condition_variable cond;
-    tail_waiters_.emplace_back(&cond);
-    auto cit = tail_waiters_.end();
-    cit--;
+    auto cit = tail_waiters_.emplace(pos, &cond);
     cond.wait(lk, [&] { return pos <= max_pos_ || stop_; });
     tail_waiters_.erase(cit);
     if (stop_)
       return boost::none;
-  }
 
-  lk.unlock();
+    lk.unlock();
+
+    cached = entry_cache_.Find(pos);
+    if (cached) {
+      RecordTick(stats_, LOG_READ_CACHE_HIT);
+      return cached;
+    }
+  } else {
+    lk.unlock();
+  }
 
   // mm... still we see an occasional hole that should be temporary in the
   // current setups. this tight loop is bad. we'll be moving to a different way
@@ -276,10 +598,7 @@ boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool
         CacheEntry cache_entry;
         cache_entry.type = CacheEntry::EntryType::FILLED;
         RecordTick(stats_, LOG_READS_FILLED);
-        lk.lock();
-        auto p = entry_cache_.emplace(pos, cache_entry);
-        entry_cache_gc();
-        return p.first->second;
+        return entry_cache_.Insert(pos, cache_entry);
       } else if (ret == -ENOENT) {
         RecordTick(stats_, LOG_READS_UNWRITTEN);
         if (fill) {
@@ -298,36 +617,152 @@ boost::optional<EntryService::CacheEntry> EntryService::Read(uint64_t pos, bool
 
   RecordTick(stats_, BYTES_READ, data.size());
 
-  cruzdb_proto::LogEntry entry;
-  assert(entry.ParseFromString(data));
-  assert(entry.IsInitialized());
-
   CacheEntry cache_entry;
+  if (!decode_log_entry(data, pos, &cache_entry)) {
+    std::cerr << "invalid log entry at pos " << pos << std::endl;
+    assert(0);
+    exit(1);
+  }
 
-  switch (entry.type()) {
-    case cruzdb_proto::LogEntry::AFTER_IMAGE:
-      cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
-      cache_entry.after_image =
-        std::make_shared<cruzdb_proto::AfterImage>(
-            std::move(entry.after_image()));
-      break;
+  return entry_cache_.Insert(pos, cache_entry);
+}
 
-    case cruzdb_proto::LogEntry::INTENTION:
-      cache_entry.type = CacheEntry::EntryType::INTENTION;
-      cache_entry.intention = std::make_shared<Intention>(
-          entry.intention(), pos);
-      break;
+EntryService::CacheEntry
+EntryService::read_after_image_log(uint64_t pos, bool fill)
+{
+  auto cached = ai_entry_cache_->Find(pos);
+  if (cached) {
+    RecordTick(stats_, LOG_READ_CACHE_HIT);
+    return *cached;
+  }
 
-    default:
+  std::string data;
+  while (true) {
+    int ret = ai_log_->Read(pos, &data);
+    if (ret) {
+      if (ret == -ENODATA) {
+        RecordTick(stats_, LOG_READS_FILLED);
+        CacheEntry cache_entry;
+        cache_entry.type = CacheEntry::EntryType::FILLED;
+        return cache_entry;
+      } else if (ret == -ENOENT) {
+        RecordTick(stats_, LOG_READS_UNWRITTEN);
+        if (fill) {
+          ret = ai_log_->Fill(pos);
+          assert(ret == 0 || ret == -EROFS);
+        } else {
+          std::this_thread::yield();
+        }
+        continue;
+      }
+      std::cerr << "read log failed " << ret << std::endl;
       assert(0);
       exit(1);
+    }
+    RecordTick(stats_, LOG_READS);
+    break;
+  }
+
+  RecordTick(stats_, BYTES_READ, data.size());
+
+  CacheEntry cache_entry;
+  cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
+  cache_entry.after_image = parse_after_image(data);
+  if (!cache_entry.after_image) {
+    std::cerr << "invalid after image log entry at pos " << pos << std::endl;
+    assert(0);
+    exit(1);
   }
 
-  lk.lock();
+  return ai_entry_cache_->Insert(pos, cache_entry);
+}
+
+// the after image writer appends after images in intention order, so within
+// the lifetime of a database instance the after image log is sorted by
+// intention. a binary search locates the neighborhood of the target, and
+// positions before it are scanned in case instances overlapped. if that
+// fails the whole log is scanned, and then new entries are waited for.
+uint64_t EntryService::FindAfterImage(uint64_t intention_pos)
+{
+  assert(SeparateAfterImageLog());
+
+  const uint64_t slack = 64;
+
+  // the first position in [lo, hi) holding an after image, or hi
+  auto next_after_image = [this](uint64_t lo, uint64_t hi,
+      std::shared_ptr<cruzdb_proto::AfterImage> *after_image) {
+    for (; lo < hi; lo++) {
+      auto entry = read_after_image_log(lo);
+      if (entry.type == CacheEntry::EntryType::AFTERIMAGE) {
+        *after_image = entry.after_image;
+        break;
+      }
+    }
+    return lo;
+  };
+
+  uint64_t tail = CheckAfterImageTail();
+
+  uint64_t lo = 0, hi = tail;
+  while (lo < hi) {
+    const uint64_t mid = lo + (hi - lo) / 2;
+    std::shared_ptr<cruzdb_proto::AfterImage> after_image;
+    const auto pos = next_after_image(mid, hi, &after_image);
+    if (pos == hi) {
+      hi = mid;
+    } else if (after_image->intention() < intention_pos) {
+      lo = pos + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  auto find = [&](uint64_t lo, uint64_t hi) -> boost::optional<uint64_t> {
+    for (auto pos = lo; pos < hi; pos++) {
+      auto entry = read_after_image_log(pos);
+      if (entry.type == CacheEntry::EntryType::AFTERIMAGE &&
+          entry.after_image->intention() == intention_pos) {
+        return pos;
+      }
+    }
+    return boost::none;
+  };
+
+  const uint64_t start = lo > slack ? lo - slack : 0;
+  auto pos = find(start, tail);
+  if (!pos) {
+    pos = find(0, start);
+  }
+
+  // not written yet
+  int delay = 1;
+  while (!pos) {
+    const auto new_tail = CheckAfterImageTail();
+    if (new_tail == tail) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+      delay = std::min(delay*2, 100);
+      continue;
+    }
+    pos = find(tail, new_tail);
+    tail = new_tail;
+  }
 
-  auto p = entry_cache_.emplace(pos, cache_entry);
-  entry_cache_gc();
-  return p.first->second;
+  return *pos;
+}
+
+boost::optional<std::pair<uint64_t,
+  std::shared_ptr<cruzdb_proto::AfterImage>>> EntryService::LatestAfterImage(
+    bool fill)
+{
+  auto pos = CheckAfterImageTail();
+  while (pos > 0) {
+    pos--;
+    auto entry = read_after_image_log(pos, fill);
+    if (entry.type == CacheEntry::EntryType::AFTERIMAGE) {
+      return std::make_pair(pos, entry.after_image);
+    }
+  }
+  return boost::none;
 }
 
 EntryService::PrimaryAfterImageMatcher::PrimaryAfterImageMatcher() :
@@ -336,7 +771,7 @@ EntryService::PrimaryAfterImageMatcher::PrimaryAfterImageMatcher() :
 {
 }
 
-void EntryService::PrimaryAfterImageMatcher::watch(
+bool EntryService::PrimaryAfterImageMatcher::watch(
     std::vector<SharedNodeRef> delta,
     std::unique_ptr<PersistentTree> intention)
 {
@@ -350,6 +785,8 @@ void EntryService::PrimaryAfterImageMatcher::watch(
         PrimaryAfterImage{boost::none,
         std::move(intention),
         std::move(delta)});
+    gc();
+    return false;
   } else {
     assert(it->second.pos);
     assert(!it->second.tree);
@@ -358,17 +795,16 @@ void EntryService::PrimaryAfterImageMatcher::watch(
     matched_.emplace_back(std::make_pair(std::move(delta),
         std::move(intention)));
     cond_.notify_one();
+    gc();
+    return true;
   }
-
-  gc();
 }
 
 void EntryService::PrimaryAfterImageMatcher::push(
-    const cruzdb_proto::AfterImage& ai, uint64_t pos)
+    uint64_t ipos, uint64_t pos)
 {
   std::lock_guard<std::mutex> lk(lock_);
 
-  const auto ipos = ai.intention();
   if (ipos <= matched_watermark_) {
     return;
   }
@@ -387,6 +823,25 @@ void EntryService::PrimaryAfterImageMatcher::push(
   gc();
 }
 
+boost::optional<uint64_t>
+EntryService::PrimaryAfterImageMatcher::adopt(uint64_t ipos)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+
+  auto it = afterimages_.find(ipos);
+  if (it == afterimages_.end() || !it->second.pos) {
+    return boost::none;
+  }
+
+  assert(!it->second.tree);
+  const auto pos = it->second.pos;
+  it->second.pos = boost::none;
+
+  gc();
+
+  return pos;
+}
+
 std::pair<std::vector<SharedNodeRef>,
   std::unique_ptr<PersistentTree>>
 EntryService::PrimaryAfterImageMatcher::match()
@@ -433,30 +888,49 @@ void EntryService::PrimaryAfterImageMatcher::gc()
   }
 }
 
-uint64_t EntryService::CheckTail(bool update_max_pos)
+uint64_t EntryService::check_tail(zlog::Log *log) const
 {
   uint64_t pos;
-  int ret = log_->CheckTail(&pos);
+  int ret = log->CheckTail(&pos);
   if (ret) {
     std::cerr << "failed to check tail" << std::endl;
     assert(0);
     exit(1);
   }
+  return pos;
+}
+
+uint64_t EntryService::CheckAfterImageTail() const
+{
+  return check_tail(ai_log_);
+}
+
+uint64_t EntryService::CheckTail(bool update_max_pos)
+{
+  const auto pos = check_tail(log_);
+  update_observed_tail(pos);
   if (update_max_pos) {
     std::lock_guard<std::mutex> lk(lock_);
-    max_pos_ = std::max(max_pos_, pos);
-    for (auto& cond : tail_waiters_) {
-      cond->notify_one();
-    }
+    update_max_pos_locked(pos);
   }
   return pos;
 }
 
 void EntryService::Fill(uint64_t pos) const
+{
+  fill(log_, pos);
+}
+
+void EntryService::FillAfterImageLog(uint64_t pos) const
+{
+  fill(ai_log_, pos);
+}
+
+void EntryService::fill(zlog::Log *log, uint64_t pos) const
 {
   int delay = 1;
   while (true) {
-    int ret = log_->Fill(pos);
+    int ret = log->Fill(pos);
     if (ret == 0) {
       return;
     }
@@ -472,14 +946,21 @@ void EntryService::Fill(uint64_t pos) const
 }
 
 uint64_t EntryService::Append(const std::string& data) const
+{
+  return Append(log_, data);
+}
+
+uint64_t EntryService::Append(zlog::Log *log, const std::string& data) const
 {
   int delay = 1;
   while (true) {
     uint64_t pos;
-    int ret = log_->Append(data, &pos);
+    int ret = log->Append(data, &pos);
     if (ret == 0) {
       RecordTick(stats_, LOG_APPENDS);
       RecordTick(stats_, BYTES_WRITTEN, data.size());
+      // the log reader may be backing off at the tail
+      tail_cond_.notify_one();
       return pos;
     }
     std::cerr << "failed to append ret " << ret << std::endl;
@@ -496,13 +977,18 @@ uint64_t EntryService::Append(cruzdb_proto::Intention& intention) const
   assert(entry.IsInitialized());
 
   std::string blob;
-  assert(entry.SerializeToString(&blob));
+  if (!entry.SerializeToString(&blob)) {
+    std::cerr << "failed to serialize log entry" << std::endl;
+    assert(0);
+    exit(1);
+  }
   entry.release_intention();
 
   return Append(blob);
 }
 
-uint64_t EntryService::Append(cruzdb_proto::AfterImage& after_image) const
+std::string EntryService::serialize_after_image(
+    cruzdb_proto::AfterImage& after_image)
 {
   cruzdb_proto::LogEntry entry;
   entry.set_type(cruzdb_proto::LogEntry::AFTER_IMAGE);
@@ -510,10 +996,19 @@ uint64_t EntryService::Append(cruzdb_proto::AfterImage& after_image) const
   assert(entry.IsInitialized());
 
   std::string blob;
-  assert(entry.SerializeToString(&blob));
+  if (!entry.SerializeToString(&blob)) {
+    std::cerr << "failed to serialize log entry" << std::endl;
+    assert(0);
+    exit(1);
+  }
   entry.release_after_image();
 
-  return Append(blob);
+  return blob;
+}
+
+uint64_t EntryService::Append(cruzdb_proto::AfterImage& after_image) const
+{
+  return Append(ai_log_, serialize_after_image(after_image));
 }
 
 uint64_t EntryService::Append(std::unique_ptr<Intention> intention)
@@ -521,43 +1016,194 @@ uint64_t EntryService::Append(std::unique_ptr<Intention> intention)
   const auto blob = intention->Serialize();
 
   const auto pos = Append(blob);
+  cache_appended_intention(std::move(intention), pos);
+
+  return pos;
+}
+
+// a locally appended intention is cached so that the transaction processor
+// doesn't need to read it back from the log.
+void EntryService::cache_appended_intention(
+    std::shared_ptr<Intention> intention, uint64_t pos)
+{
   intention->SetPosition(pos);
 
   CacheEntry cache_entry;
   cache_entry.type = CacheEntry::EntryType::INTENTION;
   cache_entry.intention = std::move(intention);
 
+  entry_cache_.Insert(pos, cache_entry);
+
   std::lock_guard<std::mutex> lk(lock_);
-  entry_cache_.emplace(pos, cache_entry);
-  entry_cache_gc();
-  max_pos_ = std::max(max_pos_, pos);
-  for (auto& cond : tail_waiters_) {
-    cond->notify_one();
+  update_max_pos_locked(pos);
+}
+
+void EntryService::AppendAsync(std::unique_ptr<Intention> intention,
+    std::function<void(uint64_t)> callback)
+{
+  auto blob = intention->Serialize();
+  std::shared_ptr<Intention> shared_intention(std::move(intention));
+  append_async(log_, std::move(blob),
+      [this, shared_intention, callback](uint64_t pos) {
+    cache_appended_intention(shared_intention, pos);
+    if (callback) {
+      callback(pos);
+    }
+  });
+}
+
+void EntryService::AppendAsync(cruzdb_proto::AfterImage& after_image,
+    std::function<void(uint64_t)> callback)
+{
+  append_async(ai_log_, serialize_after_image(after_image),
+      std::move(callback));
+}
+
+void EntryService::AppendAsync(cruzdb_proto::Checkpoint& checkpoint)
+{
+  cruzdb_proto::LogEntry entry;
+  entry.set_type(cruzdb_proto::LogEntry::CHECKPOINT);
+  entry.set_allocated_checkpoint(&checkpoint);
+  assert(entry.IsInitialized());
+
+  std::string blob;
+  if (!entry.SerializeToString(&blob)) {
+    std::cerr << "failed to serialize log entry" << std::endl;
+    assert(0);
+    exit(1);
   }
+  entry.release_checkpoint();
 
-  return pos;
+  append_async(log_, std::move(blob), nullptr);
 }
 
-std::shared_ptr<cruzdb_proto::AfterImage>
-EntryService::ReadAfterImage(const uint64_t pos)
+void EntryService::append_async(zlog::Log *log, std::string data,
+    std::function<void(uint64_t)> callback)
 {
-  std::unique_lock<std::mutex> lk(lock_);
+  std::unique_lock<std::mutex> lk(append_lock_);
+
+  if (!append_stop_ && max_inflight_appends_ > 0) {
+    append_space_cond_.wait(lk, [&] {
+      return appends_.size() < max_inflight_appends_ || append_stop_;
+    });
+  }
+
+  if (append_stop_ || max_inflight_appends_ == 0) {
+    lk.unlock();
+    const auto pos = Append(log, data);
+    if (callback) {
+      callback(pos);
+    }
+    return;
+  }
+
+  // the append is issued while holding the lock so that the queue order
+  // matches the order in which appends are submitted to the log
+  auto append = std::unique_ptr<PendingAppend>(new PendingAppend);
+  append->log = log;
+  append->data = std::move(data);
+  append->callback = std::move(callback);
+  append->c = zlog::Log::aio_create_completion();
+  int ret = log->AioAppend(append->c, append->data, &append->pos);
+  if (ret) {
+    // the completion thread will fall back to a synchronous append
+    delete append->c;
+    append->c = nullptr;
+  }
+
+  appends_.emplace_back(std::move(append));
+  lk.unlock();
+  append_cond_.notify_one();
+}
+
+// completes asynchronous appends in submission order. an append stays in the
+// queue until its callback returns, so the queue length is the number of
+// appends in flight.
+void EntryService::AppendCompletionEntry()
+{
+  std::unique_lock<std::mutex> lk(append_lock_);
+  while (true) {
+    append_cond_.wait(lk, [&] {
+      return !appends_.empty() || append_stop_;
+    });
+
+    if (appends_.empty()) {
+      assert(append_stop_);
+      break;
+    }
+
+    auto append = appends_.front().get();
+    lk.unlock();
+
+    int ret = -EIO;
+    if (append->c) {
+      append->c->WaitForComplete();
+      ret = append->c->ReturnValue();
+      delete append->c;
+      append->c = nullptr;
+    }
+
+    if (ret == 0) {
+      RecordTick(stats_, LOG_APPENDS);
+      RecordTick(stats_, BYTES_WRITTEN, append->data.size());
+      tail_cond_.notify_one();
+    } else {
+      append->pos = Append(append->log, append->data);
+    }
+
+    if (append->callback) {
+      append->callback(append->pos);
+    }
+
+    lk.lock();
+    appends_.pop_front();
+    append_space_cond_.notify_one();
+  }
+}
 
+std::shared_ptr<cruzdb_proto::AfterImage>
+EntryService::ReadAfterImage(const uint64_t pos, bool fill_cache)
+{
   // check for afterimage in the cache
-  auto it = entry_cache_.find(pos);
-  if (it != entry_cache_.end()) {
-    assert(it->second.type ==
-        CacheEntry::EntryType::AFTERIMAGE);
+  auto cached = ai_entry_cache_->Find(pos);
+  if (cached) {
+    assert(cached->type == CacheEntry::EntryType::AFTERIMAGE);
     RecordTick(stats_, LOG_READ_CACHE_HIT);
-    return it->second.after_image;
+    return cached->after_image;
   }
 
-  lk.unlock();
+  // concurrent misses on the same position share one read. reads that don't
+  // fill the cache are coalesced separately, so that a reader that fills the
+  // cache never waits on one that doesn't.
+  auto& reads = fill_cache ? after_image_reads_ : uncached_after_image_reads_;
+  bool shared;
+  auto after_image = reads.Do(pos, [this, pos, fill_cache] {
+    return read_after_image(pos, fill_cache);
+  }, &shared);
+
+  if (shared) {
+    RecordTick(stats_, LOG_READS_COALESCED);
+  }
+
+  return after_image;
+}
+
+std::shared_ptr<cruzdb_proto::AfterImage>
+EntryService::read_after_image(const uint64_t pos, bool fill_cache)
+{
+  // a read that completed after the caller checked the cache
+  auto cached = ai_entry_cache_->Find(pos);
+  if (cached) {
+    RecordTick(stats_, LOG_READ_CACHE_HIT);
+    return cached->after_image;
+  }
+
+  std::string data;
+  bool local = secondary_cache_ && secondary_cache_->Lookup(pos, &data);
 
   int delay = 1;
   while (true) {
-    std::string data;
-    int ret = log_->Read(pos, &data);
+    int ret = local ? 0 : ai_log_->Read(pos, &data);
     if (ret) {
       if (ret == -ENODATA) {
         RecordTick(stats_, LOG_READS_FILLED);
@@ -573,36 +1219,32 @@ EntryService::ReadAfterImage(const uint64_t pos)
       continue;
     }
 
-    RecordTick(stats_, LOG_READS);
-    RecordTick(stats_, BYTES_READ, data.size());
-
-    cruzdb_proto::LogEntry entry;
-    assert(entry.ParseFromString(data));
-    assert(entry.IsInitialized());
+    if (!local) {
+      RecordTick(stats_, LOG_READS);
+      RecordTick(stats_, BYTES_READ, data.size());
+    }
 
     CacheEntry cache_entry;
-    switch (entry.type()) {
-      case cruzdb_proto::LogEntry::AFTER_IMAGE:
-        cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
-        cache_entry.after_image =
-          std::make_shared<cruzdb_proto::AfterImage>(
-              std::move(entry.after_image()));
-        break;
+    cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
+    cache_entry.after_image = parse_after_image(data);
+    if (!cache_entry.after_image) {
+      std::cerr << "unexpected log entry" << std::endl;
+      assert(0);
+      exit(1);
+    }
 
-      case cruzdb_proto::LogEntry::INTENTION:
-      default:
-        std::cerr << "unexpected log entry" << std::endl;
-        assert(0);
-        exit(1);
+    if (!fill_cache) {
+      return cache_entry.after_image;
+    }
+
+    if (secondary_cache_ && !local) {
+      secondary_cache_->Insert(pos, data);
     }
 
     // insert entry into the cache
-    lk.lock();
-    auto p = entry_cache_.emplace(pos, cache_entry);
-    entry_cache_gc();
-    assert(p.first->second.type ==
-        CacheEntry::EntryType::AFTERIMAGE);
-    return p.first->second.after_image;
+    auto inserted = ai_entry_cache_->Insert(pos, cache_entry);
+    assert(inserted.type == CacheEntry::EntryType::AFTERIMAGE);
+    return inserted.after_image;
   }
 }
 
@@ -613,18 +1255,16 @@ EntryService::ReadIntentions(const std::vector<uint64_t>& positions)
   std::vector<uint64_t> missing_positions;
 
   // check cache
-  std::unique_lock<std::mutex> lk(lock_);
   for (const auto pos : positions) {
-    auto it = entry_cache_.find(pos);
-    if (it != entry_cache_.end()) {
-      assert(it->second.type == CacheEntry::EntryType::INTENTION);
+    auto cached = entry_cache_.Find(pos);
+    if (cached) {
+      assert(cached->type == CacheEntry::EntryType::INTENTION);
       RecordTick(stats_, LOG_READ_CACHE_HIT);
-      intentions.emplace_back(it->second.intention);
+      intentions.emplace_back(cached->intention);
     } else {
       missing_positions.emplace_back(pos);
     }
   }
-  lk.unlock();
 
   // dispatch async reads. we'll want to throttle this later in some way to deal
   // with large requests for now the sizes seem reasonable.
@@ -680,29 +1320,164 @@ EntryService::ReadIntentions(const std::vector<uint64_t>& positions)
   }
 
   for (size_t i = 0; i < blobs.size(); i++) {
-    cruzdb_proto::LogEntry entry;
-    assert(entry.ParseFromString(blobs[i]));
-    assert(entry.IsInitialized());
-    assert(entry.type() == cruzdb_proto::LogEntry::INTENTION);
-
-    // more efficient to use the interface in c++17 that doesn't construct the
-    // element being inserted into the cache unless it is being inserted.
-    auto intention = std::make_shared<Intention>(
-        entry.intention(), missing_positions[i]);
+    auto intention = parse_intention(blobs[i], missing_positions[i]);
+    if (!intention) {
+      std::cerr << "unexpected log entry" << std::endl;
+      assert(0);
+      exit(1);
+    }
 
     CacheEntry cache_entry;
     cache_entry.type = CacheEntry::EntryType::INTENTION;
     cache_entry.intention = intention;
 
-    lk.lock();
-    auto p = entry_cache_.emplace(missing_positions[i], cache_entry);
-    entry_cache_gc();
-    intentions.emplace_back(p.first->second.intention);
-    lk.unlock();
+    auto inserted = entry_cache_.Insert(missing_positions[i], cache_entry);
+    intentions.emplace_back(inserted.intention);
   }
 
   assert(intentions.size() == positions.size());
   return std::move(intentions);
 }
 
+std::vector<std::pair<uint64_t, std::shared_ptr<cruzdb_proto::AfterImage>>>
+EntryService::TryReadAfterImages(const std::vector<uint64_t>& positions)
+{
+  std::vector<std::pair<uint64_t,
+    std::shared_ptr<cruzdb_proto::AfterImage>>> after_images;
+  std::vector<uint64_t> missing_positions;
+
+  for (const auto pos : positions) {
+    auto cached = ai_entry_cache_->Find(pos);
+    if (cached) {
+      if (cached->type == CacheEntry::EntryType::AFTERIMAGE) {
+        RecordTick(stats_, LOG_READ_CACHE_HIT);
+        after_images.emplace_back(pos, cached->after_image);
+      }
+    } else {
+      missing_positions.emplace_back(pos);
+    }
+  }
+
+  std::vector<std::string> blobs(missing_positions.size());
+  std::vector<bool> cached(missing_positions.size(), false);
+  std::vector<zlog::AioCompletion*> ios(missing_positions.size(), nullptr);
+  for (size_t i = 0; i < missing_positions.size(); i++) {
+    if (secondary_cache_ &&
+        secondary_cache_->Lookup(missing_positions[i], &blobs[i])) {
+      cached[i] = true;
+      continue;
+    }
+    auto *c = zlog::Log::aio_create_completion();
+    int ret = ai_log_->AioRead(missing_positions[i], c, &blobs[i]);
+    if (ret) {
+      delete c;
+      continue;
+    }
+    ios[i] = c;
+  }
+
+  for (size_t i = 0; i < missing_positions.size(); i++) {
+    auto c = ios[i];
+    if (c) {
+      c->WaitForComplete();
+      int ioret = c->ReturnValue();
+      delete c;
+      if (ioret) {
+        if (ioret == -ENODATA)
+          RecordTick(stats_, LOG_READS_FILLED);
+        continue;
+      }
+      RecordTick(stats_, LOG_READS);
+      RecordTick(stats_, BYTES_READ, blobs[i].size());
+    } else if (!cached[i]) {
+      continue;
+    }
+
+    cruzdb_proto::LogEntry::EntryType type;
+    if (!PeekEntryType(blobs[i], &type) ||
+        type != cruzdb_proto::LogEntry::AFTER_IMAGE) {
+      continue;
+    }
+
+    auto after_image = parse_after_image(blobs[i]);
+    if (!after_image) {
+      continue;
+    }
+
+    if (secondary_cache_ && !cached[i]) {
+      secondary_cache_->Insert(missing_positions[i], blobs[i]);
+    }
+
+    after_images.emplace_back(missing_positions[i], after_image);
+  }
+
+  return after_images;
+}
+
+std::pair<size_t, size_t>
+EntryService::PrefetchAfterImages(const std::vector<uint64_t>& positions)
+{
+  std::vector<uint64_t> missing_positions;
+  for (const auto pos : positions) {
+    if (!ai_entry_cache_->Contains(pos)) {
+      missing_positions.emplace_back(pos);
+    }
+  }
+
+  size_t bytes = 0;
+  const auto after_images = TryReadAfterImages(missing_positions);
+  for (const auto& ai : after_images) {
+    CacheEntry cache_entry;
+    cache_entry.type = CacheEntry::EntryType::AFTERIMAGE;
+    cache_entry.after_image = ai.second;
+    ai_entry_cache_->Insert(ai.first, cache_entry);
+    bytes += ai.second->ByteSizeLong();
+  }
+
+  return std::make_pair(after_images.size(), bytes);
+}
+
+void EntryService::PrefetchAfterImagesAsync(std::vector<uint64_t> positions,
+    std::function<void(std::pair<size_t, size_t>)> done)
+{
+  {
+    std::lock_guard<std::mutex> l(prefetch_lock_);
+    if (!prefetch_stop_ && prefetches_.size() < max_queued_prefetches_) {
+      prefetches_.push_back(PendingPrefetch{std::move(positions), done});
+      prefetch_cond_.notify_one();
+      return;
+    }
+  }
+  done(std::make_pair(0, 0));
+}
+
+// a single thread serves read-ahead for every iterator. the reads of each
+// request are issued in parallel, so the thread is mostly waiting on the log.
+void EntryService::PrefetchEntry()
+{
+  std::unique_lock<std::mutex> lk(prefetch_lock_);
+  while (true) {
+    prefetch_cond_.wait(lk, [&] {
+      return !prefetches_.empty() || prefetch_stop_;
+    });
+
+    if (prefetch_stop_) {
+      break;
+    }
+
+    auto prefetch = std::move(prefetches_.front());
+    prefetches_.pop_front();
+    lk.unlock();
+
+    prefetch.done(PrefetchAfterImages(prefetch.positions));
+
+    lk.lock();
+  }
+
+  for (auto& prefetch : prefetches_) {
+    prefetch.done(std::make_pair(0, 0));
+  }
+  prefetches_.clear();
+}
+
 }
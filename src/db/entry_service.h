@@ -1,28 +1,43 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <list>
+#include <map>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 #include <boost/optional.hpp>
 #include <zlog/log.h>
 #include "cruzdb/options.h"
 #include "db/persistent_tree.h"
 #include "db/intention.h"
+#include "db/entry_cache.h"
+#include "db/secondary_cache.h"
+#include "db/single_flight.h"
 #include "monitoring/statistics.h"
 
 namespace cruzdb {
 
 class EntryService {
  public:
-  EntryService(const Options& options, Statistics *statistics, zlog::Log *log);
+  // after images are written to ai_log when it is provided, and otherwise
+  // share the log with intentions.
+  EntryService(const Options& options, Statistics *statistics, zlog::Log *log,
+      zlog::Log *ai_log = nullptr);
 
   // TODO: add a safety mechanism to ensure parts of the interface are not used
   // unless it has been started. Or actually make part of the service static
   // interfaces, and then create a constructor that requires the starting
   // position to be specified.
-  void Start(uint64_t pos);
+  //
+  // pos is the first intention log position to read. when after images are
+  // stored in their own log, after_image_pos is the first position read from
+  // that log.
+  void Start(uint64_t pos, uint64_t after_image_pos = 0);
   void Stop();
 
  public:
@@ -44,11 +59,21 @@ class EntryService {
     // the GC process know that no new intention watches will be added. since we
     // are adding the intentions in strict log order, then for any point in the
     // index we know that below that point the index is complete.
-    void watch(std::vector<SharedNodeRef> delta,
+    //
+    // returns true if an after image for the intention had already been read
+    // from the log, in which case the tree is matched immediately.
+    bool watch(std::vector<SharedNodeRef> delta,
         std::unique_ptr<PersistentTree> intention);
 
-    // add an afterimage from the log
-    void push(const cruzdb_proto::AfterImage& ai, uint64_t pos);
+    // add an afterimage from the log. ipos is the position of the intention
+    // that produced the after image at pos.
+    void push(uint64_t ipos, uint64_t pos);
+
+    // claim the after image of an intention instead of watching it, when the
+    // database adopts the after image rather than replaying the intention.
+    // returns none if no after image for the intention has been read from the
+    // log. like watch, this must be called in intention log order.
+    boost::optional<uint64_t> adopt(uint64_t ipos);
 
     // get intention/afterimage match
     std::pair<
@@ -87,18 +112,7 @@ class EntryService {
 
   PrimaryAfterImageMatcher ai_matcher;
 
-  class CacheEntry {
-   public:
-    enum EntryType {
-      INTENTION,
-      AFTERIMAGE,
-      FILLED
-    };
-
-    EntryType type;
-    std::shared_ptr<Intention> intention;
-    std::shared_ptr<cruzdb_proto::AfterImage> after_image;
-  };
+  typedef EntryCache::Entry CacheEntry;
 
   class Iterator {
    public:
@@ -155,49 +169,259 @@ class EntryService {
   uint64_t Append(cruzdb_proto::AfterImage& after_image) const;
   uint64_t Append(std::unique_ptr<Intention> intention);
 
+  // Append without waiting for the log. The callback is invoked with the
+  // position of the new entry from the append completion thread, in the
+  // order that appends were submitted. At most log_max_inflight_appends
+  // appends are outstanding, and callers block while the limit is reached.
+  // Failed asynchronous appends are retried synchronously, and appends made
+  // before Start() or after Stop() are synchronous.
+  void AppendAsync(std::unique_ptr<Intention> intention,
+      std::function<void(uint64_t)> callback);
+  void AppendAsync(cruzdb_proto::AfterImage& after_image,
+      std::function<void(uint64_t)> callback = nullptr);
+  void AppendAsync(cruzdb_proto::Checkpoint& checkpoint);
+
+  // Determine the type of a serialized log entry without parsing the rest of
+  // the entry. Returns false if the entry is malformed.
+  static bool PeekEntryType(const std::string& data,
+      cruzdb_proto::LogEntry::EntryType *type);
+
   // Read an afterimage at the provided position. It is a fatal error if the log
-  // does not contain an afterimage at the position.
+  // does not contain an afterimage at the position. When fill_cache is false
+  // an after image that isn't cached is read without being added to the entry
+  // cache or the secondary cache.
   std::shared_ptr<cruzdb_proto::AfterImage>
-    ReadAfterImage(const uint64_t pos);
+    ReadAfterImage(const uint64_t pos, bool fill_cache = true);
 
   // Read intentions at the provided positions. It is a fatal error if any
   // position does not contain an intention.
   std::vector<std::shared_ptr<Intention>> ReadIntentions(
       const std::vector<uint64_t>& positions);
 
+  // Read after images at the provided positions for cache warm-up. Unlike
+  // ReadAfterImage, positions that can't be read or do not contain an after
+  // image are skipped, and results are not added to the entry cache.
+  std::vector<std::pair<uint64_t, std::shared_ptr<cruzdb_proto::AfterImage>>>
+    TryReadAfterImages(const std::vector<uint64_t>& positions);
+
+  // Read after images that are about to be needed into the entry cache, in
+  // parallel. Positions that are already cached are skipped. Returns the
+  // number of after images read and their size in bytes.
+  std::pair<size_t, size_t> PrefetchAfterImages(
+      const std::vector<uint64_t>& positions);
+
+  // Run PrefetchAfterImages on the background prefetch thread, and invoke done
+  // with the result from that thread. When too many prefetches are queued, or
+  // the service isn't running, the request is dropped and done is invoked
+  // immediately with nothing read.
+  void PrefetchAfterImagesAsync(std::vector<uint64_t> positions,
+      std::function<void(std::pair<size_t, size_t>)> done);
+
   boost::optional<CacheEntry> Read(uint64_t pos, bool fill = false);
 
   uint64_t CheckTail(bool update_max_pos = false);
 
+  // the newest intention log tail seen by the log reader or CheckTail, without
+  // asking the log. the reader checks the tail whenever it has caught up.
+  uint64_t ObservedTail() const {
+    return observed_tail_;
+  }
+
+  // true if Read(pos) returns without waiting for the log reader
+  bool Readable(uint64_t pos) {
+    std::lock_guard<std::mutex> lk(lock_);
+    return pos <= max_pos_;
+  }
+
+  // change the number of reads kept in flight ahead of the log readers
+  void SetReadaheadWindow(size_t window) {
+    readahead_window_ = std::max(window, (size_t)1);
+    SetTickerCount(stats_, LOG_READAHEAD_WINDOW, readahead_window_);
+  }
+
   void Fill(uint64_t pos) const;
 
+  // True when after images are stored in their own log. After image addresses
+  // (NodeAddress::IsAfterImage) then refer to positions in that log, and all
+  // other positions refer to the intention log.
+  bool SeparateAfterImageLog() const {
+    return ai_log_ != log_;
+  }
+
+  // Tail and fill of the after image log. These are the same as CheckTail and
+  // Fill when after images share the intention log.
+  uint64_t CheckAfterImageTail() const;
+  void FillAfterImageLog(uint64_t pos) const;
+
+  // Position of an after image in the separate after image log that was
+  // produced by the intention. Replay is deterministic, so any after image of
+  // the intention is equivalent. Blocks until the after image is written.
+  uint64_t FindAfterImage(uint64_t intention_pos);
+
+  // The last after image in the separate after image log, if any. Holes at
+  // the tail are filled, or waited out if fill is false.
+  boost::optional<std::pair<uint64_t,
+    std::shared_ptr<cruzdb_proto::AfterImage>>> LatestAfterImage(
+        bool fill = true);
+
   void ClearCaches() {
-    std::unique_lock<std::mutex> lk(lock_);
-    entry_cache_.clear();
+    entry_cache_.Clear();
+    if (separate_ai_entry_cache_) {
+      separate_ai_entry_cache_->Clear();
+    }
   }
 
  private:
   Statistics *stats_;
 
-  void IOEntry();
   uint64_t Append(const std::string& data) const;
+  uint64_t Append(zlog::Log *log, const std::string& data) const;
+  uint64_t check_tail(zlog::Log *log) const;
+  void fill(zlog::Log *log, uint64_t pos) const;
+
+  static std::string serialize_after_image(
+      cruzdb_proto::AfterImage& after_image);
+  void cache_appended_intention(std::shared_ptr<Intention> intention,
+      uint64_t pos);
+
+  // decoding of serialized log entries. these return null (or false) if the
+  // entry is malformed or of a different type.
+  static std::shared_ptr<cruzdb_proto::AfterImage>
+    parse_after_image(const std::string& data);
+  static std::shared_ptr<Intention>
+    parse_intention(const std::string& data, uint64_t pos);
+  static bool decode_log_entry(const std::string& data, uint64_t pos,
+      CacheEntry *cache_entry);
+
+  EntryCache entry_cache_;
+
+  // cache for after images. this is entry_cache_ unless after images are
+  // stored in their own log, whose positions overlap with the intention log.
+  EntryCache *ai_entry_cache_;
+  std::unique_ptr<EntryCache> separate_ai_entry_cache_;
+
+  // read an entry of the separate after image log. holes are waited out, or
+  // filled when fill is true.
+  CacheEntry read_after_image_log(uint64_t pos, bool fill = false);
+
+  // reads an after image from the secondary cache or the log, and adds it to
+  // the caches if fill_cache is true. called by one thread at a time per
+  // position and value of fill_cache.
+  std::shared_ptr<cruzdb_proto::AfterImage>
+    read_after_image(const uint64_t pos, bool fill_cache);
+  SingleFlight<uint64_t,
+    std::shared_ptr<cruzdb_proto::AfterImage>> after_image_reads_;
+  SingleFlight<uint64_t,
+    std::shared_ptr<cruzdb_proto::AfterImage>> uncached_after_image_reads_;
 
-  // this still needs a lot of work. we are just removing older log entries, but
-  // this doesn't necessarily correspond to any sort of real lru policy just as
-  // an exmaple.
-  std::map<uint64_t, CacheEntry> entry_cache_;
-  void entry_cache_gc();
+  // after images on local storage. null when disabled.
+  std::unique_ptr<SecondaryCache> secondary_cache_;
 
   zlog::Log *log_;
-  uint64_t pos_;
+  zlog::Log *ai_log_;
   bool stop_;
   std::mutex lock_;
 
+  // readers waiting for a position beyond max_pos_, keyed by that position
   uint64_t max_pos_;
-  std::list<std::condition_variable*> tail_waiters_;
 
-  std::thread io_thread_;
-  const size_t cache_size_;
+  std::atomic<uint64_t> observed_tail_;
+  void update_observed_tail(uint64_t tail) {
+    auto cur = observed_tail_.load();
+    while (cur < tail && !observed_tail_.compare_exchange_weak(cur, tail)) {}
+  }
+  std::multimap<uint64_t, std::condition_variable*> tail_waiters_;
+  void update_max_pos_locked(uint64_t pos);
+
+  // signaled on local appends to wake the log readers when they are backing
+  // off at the tail
+  mutable std::condition_variable tail_cond_;
+
+  // log read-ahead. each log reader owns a window of pending reads and hands
+  // them to its parser threads in log order.
+  struct PendingRead {
+    explicit PendingRead(uint64_t pos) :
+      pos(pos), cached(false), c(nullptr), ret(0), ready(false)
+    {}
+
+    const uint64_t pos;
+    bool cached; // already in the entry cache (cache_entry), so nothing is read
+    zlog::AioCompletion *c;
+    std::string data;
+    int ret;
+    bool ready; // protected by the reader's lock
+    CacheEntry cache_entry;
+  };
+
+  // a log reader follows the intention log, and a second reader follows the
+  // after image log when it is separate. only the intention log reader
+  // advances max_pos_.
+  struct LogTailer {
+    LogTailer(zlog::Log *log, EntryCache *cache, bool intentions) :
+      log(log), cache(cache), intentions(intentions), pos(0),
+      parse_stop(false)
+    {}
+
+    zlog::Log * const log;
+    EntryCache * const cache;
+    const bool intentions;
+    uint64_t pos;
+
+    std::mutex lock;
+    std::condition_variable readahead_cond;
+    std::condition_variable ready_cond;
+    std::deque<PendingRead*> parse_queue;
+    bool parse_stop;
+
+    std::thread thread;
+  };
+
+  void IOEntry(LogTailer *tailer);
+  void ParserEntry(LogTailer *tailer);
+  void issue_read(LogTailer *tailer, PendingRead *read);
+  void decode_entry(PendingRead *read) const;
+  void publish_read(LogTailer *tailer, PendingRead *read);
+
+  std::atomic<size_t> readahead_window_;
+  const size_t parse_threads_;
+  std::unique_ptr<LogTailer> tailer_;
+  std::unique_ptr<LogTailer> ai_tailer_;
+
+  // asynchronous appends, oldest first
+  struct PendingAppend {
+    zlog::Log *log = nullptr;
+    std::string data;
+    zlog::AioCompletion *c = nullptr; // null if the aio couldn't be issued
+    uint64_t pos = 0;
+    std::function<void(uint64_t)> callback;
+  };
+
+  void append_async(zlog::Log *log, std::string data,
+      std::function<void(uint64_t)> callback);
+  void AppendCompletionEntry();
+
+  const size_t max_inflight_appends_;
+  std::mutex append_lock_;
+  std::condition_variable append_cond_;
+  std::condition_variable append_space_cond_;
+  std::deque<std::unique_ptr<PendingAppend>> appends_;
+  bool append_stop_;
+  std::thread append_thread_;
+
+  // queued prefetches, oldest first
+  struct PendingPrefetch {
+    std::vector<uint64_t> positions;
+    std::function<void(std::pair<size_t, size_t>)> done;
+  };
+
+  void PrefetchEntry();
+
+  const size_t max_queued_prefetches_ = 64;
+  std::mutex prefetch_lock_;
+  std::condition_variable prefetch_cond_;
+  std::deque<PendingPrefetch> prefetches_;
+  bool prefetch_stop_;
+  std::thread prefetch_thread_;
 };
 
 }
@@ -0,0 +1,164 @@
+#include "db/epoch.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace cruzdb {
+
+namespace {
+
+const uint64_t IDLE = std::numeric_limits<uint64_t>::max();
+
+// retiring threads help reclaim once this many objects are waiting, which
+// bounds memory if the background reclaimer falls behind.
+const size_t BACKLOG_LIMIT = 1 << 16;
+const size_t BACKLOG_BATCH = 64;
+
+// objects retired by a thread are published in batches of this size
+const size_t RETIRE_BATCH = 64;
+
+struct Retired {
+  void *object;
+  void (*deleter)(void*);
+};
+
+// a thread's announced epoch. slots are never freed, and are reused by new
+// threads once the owning thread exits.
+struct alignas(64) Slot {
+  std::atomic<uint64_t> epoch{IDLE};
+  std::atomic<bool> in_use{true};
+  Slot *next = nullptr;
+};
+
+std::atomic<Slot*> slots{nullptr};
+std::atomic<uint64_t> global_epoch{1};
+
+std::mutex retired_lock;
+std::deque<std::pair<uint64_t, Retired>> retired;
+
+Slot *acquire_slot()
+{
+  for (auto slot = slots.load(); slot; slot = slot->next) {
+    bool in_use = false;
+    if (!slot->in_use.load(std::memory_order_relaxed) &&
+        slot->in_use.compare_exchange_strong(in_use, true)) {
+      return slot;
+    }
+  }
+
+  auto slot = new Slot;
+  slot->next = slots.load();
+  while (!slots.compare_exchange_weak(slot->next, slot));
+  return slot;
+}
+
+// an object unlinked before the global epoch is advanced past e can only be
+// referenced by critical sections that entered in epoch e or earlier. every
+// object in a batch was unlinked before it is published, so the whole batch
+// is retired in the epoch it is published in. returns the number of objects
+// waiting to be reclaimed.
+size_t publish(std::vector<Retired>& batch)
+{
+  std::lock_guard<std::mutex> lk(retired_lock);
+  if (!batch.empty()) {
+    const auto epoch = global_epoch.fetch_add(1);
+    for (const auto& object : batch) {
+      retired.emplace_back(epoch, object);
+    }
+    batch.clear();
+  }
+  return retired.size();
+}
+
+struct ThreadState {
+  ~ThreadState() {
+    publish(batch);
+    if (slot) {
+      slot->epoch.store(IDLE);
+      slot->in_use.store(false);
+    }
+  }
+
+  Slot *slot = nullptr;
+  unsigned depth = 0;
+  std::vector<Retired> batch;
+};
+
+thread_local ThreadState thread_state;
+
+}
+
+Epoch::Guard::Guard()
+{
+  auto& state = thread_state;
+  if (state.depth++ == 0) {
+    if (!state.slot) {
+      state.slot = acquire_slot();
+    }
+    // sequentially consistent, so that shared pointers loaded inside the
+    // critical section are loaded after the epoch is visible to reclaimers.
+    state.slot->epoch.store(global_epoch.load());
+  }
+}
+
+Epoch::Guard::~Guard()
+{
+  auto& state = thread_state;
+  if (--state.depth == 0) {
+    state.slot->epoch.store(IDLE, std::memory_order_release);
+  }
+}
+
+void Epoch::retire(void *object, void (*deleter)(void*))
+{
+  auto& batch = thread_state.batch;
+  batch.push_back(Retired{object, deleter});
+  if (batch.size() < RETIRE_BATCH) {
+    return;
+  }
+
+  if (publish(batch) >= BACKLOG_LIMIT) {
+    Reclaim(BACKLOG_BATCH);
+  }
+}
+
+size_t Epoch::Reclaim(size_t max)
+{
+  publish(thread_state.batch);
+
+  uint64_t min_epoch = IDLE;
+  for (auto slot = slots.load(); slot; slot = slot->next) {
+    min_epoch = std::min(min_epoch, slot->epoch.load());
+  }
+
+  // retired objects are ordered by epoch
+  std::vector<Retired> objects;
+  {
+    std::lock_guard<std::mutex> lk(retired_lock);
+    while (!retired.empty() && retired.front().first < min_epoch &&
+        objects.size() < max) {
+      objects.emplace_back(retired.front().second);
+      retired.pop_front();
+    }
+  }
+
+  // deleting an object may retire others into this thread's batch
+  for (const auto& object : objects) {
+    object.deleter(object.object);
+  }
+
+  return objects.size();
+}
+
+size_t Epoch::Pending()
+{
+  std::lock_guard<std::mutex> lk(retired_lock);
+  return retired.size();
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <limits>
+
+namespace cruzdb {
+
+// Epoch-based reclamation of objects shared with lock-free readers.
+//
+// Readers access shared objects inside a critical section, delimited by the
+// lifetime of a Guard. A writer that unlinks an object retires it instead of
+// freeing it, and the object is freed once every critical section that could
+// have observed it has ended. Critical sections are cheap: each thread
+// announces the epoch it entered in its own cache line, so entering and
+// leaving doesn't write to any state shared with other readers. Guards may be
+// nested.
+//
+// There is a single epoch domain for the process, shared by all databases.
+class Epoch {
+ public:
+  class Guard {
+   public:
+    Guard();
+    ~Guard();
+
+    Guard(const Guard& other) = delete;
+    Guard& operator=(const Guard& other) = delete;
+  };
+
+  // delete the object once no critical section can still reference it.
+  // objects are normally deleted by a background thread calling Reclaim. if
+  // the backlog grows too large the retiring thread also runs a bounded batch.
+  //
+  // retired objects are collected in a batch owned by the retiring thread,
+  // which is published for reclamation once it is full, when the thread calls
+  // Reclaim, or when the thread exits.
+  template <typename T>
+  static void Retire(T *object) {
+    retire(object, [](void *object) { delete static_cast<T*>(object); });
+  }
+
+  // delete at most max retired objects that are no longer reachable, and
+  // return the number deleted. the calling thread's batch is published first.
+  static size_t Reclaim(size_t max = std::numeric_limits<size_t>::max());
+
+  // number of published objects waiting to be reclaimed
+  static size_t Pending();
+
+ private:
+  static void retire(void *object, void (*deleter)(void*));
+};
+
+}
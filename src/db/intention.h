@@ -1,4 +1,7 @@
 #pragma once
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
 #include "db/cruzdb.pb.h"
 
 namespace cruzdb {
@@ -21,33 +24,41 @@ class Intention {
     assert(intention_.IsInitialized());
   }
 
+  // take ownership of a parsed intention without copying it
+  Intention(cruzdb_proto::Intention&& intention, uint64_t pos) :
+    intention_(std::move(intention)),
+    pos_(pos)
+  {
+    assert(intention_.IsInitialized());
+  }
+
   void Get(const zlog::Slice& key) {
     assert(!pos_);
     auto op = intention_.add_ops();
     op->set_op(cruzdb_proto::TransactionOp::GET);
-    op->set_key(key.ToString());
+    op->set_key(key.data(), key.size());
   }
 
   void Put(const zlog::Slice& key, const zlog::Slice& value) {
     assert(!pos_);
     auto op = intention_.add_ops();
     op->set_op(cruzdb_proto::TransactionOp::PUT);
-    op->set_key(key.ToString());
-    op->set_val(value.ToString());
+    op->set_key(key.data(), key.size());
+    op->set_val(value.data(), value.size());
   }
 
   void Delete(const zlog::Slice& key) {
     assert(!pos_);
     auto op = intention_.add_ops();
     op->set_op(cruzdb_proto::TransactionOp::DELETE);
-    op->set_key(key.ToString());
+    op->set_key(key.data(), key.size());
   }
 
   void Copy(const zlog::Slice& key) {
     assert(!pos_);
     auto op = intention_.add_ops();
     op->set_op(cruzdb_proto::TransactionOp::COPY);
-    op->set_key(key.ToString());
+    op->set_key(key.data(), key.size());
   }
 
   bool Flush() const {
@@ -98,7 +109,11 @@ class Intention {
     assert(entry.IsInitialized());
 
     std::string blob;
-    assert(entry.SerializeToString(&blob));
+    if (!entry.SerializeToString(&blob)) {
+      std::cerr << "failed to serialize log entry" << std::endl;
+      assert(0);
+      exit(1);
+    }
     entry.release_intention();
 
     return blob;
@@ -124,6 +139,11 @@ class Intention {
     pos_ = pos;
   }
 
+  // approximate memory used by the intention
+  size_t SpaceUsed() const {
+    return sizeof(*this) + intention_.SpaceUsedLong();
+  }
+
   std::set<std::string> OpKeys() const {
     std::set<std::string> keys;
     for (auto& op : intention_.ops()) {
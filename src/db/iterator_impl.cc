@@ -1,27 +1,95 @@
 #include "iterator_impl.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
 #include "db_impl.h"
 
 namespace cruzdb {
 
+// reads that don't fill the cache also don't publish their access trace, so a
+// scan has no effect on the node cache replacement policy. the after images
+// they read are kept by the iterator instead.
+// the change in bytes pinned by the iterator is also reported once the
+// operation completes, if it is large enough.
 class IteratorTraceApplier {
  public:
-  explicit IteratorTraceApplier(DBImpl *db) :
-    db_(db)
+  explicit IteratorTraceApplier(RawIteratorImpl *it) :
+    it_(it),
+    db_(it->snapshot_->db),
+    fill_cache_(it->fill_cache_),
+    scope_(fill_cache_ ? nullptr : &it->uncached_reads_)
   {}
 
   ~IteratorTraceApplier() {
-    db_->UpdateLRU(trace);
+    if (fill_cache_) {
+      db_->UpdateLRU(trace);
+    }
+    it_->report_pinned_bytes();
   }
 
   std::vector<NodeAddress> trace;
 
  private:
+  RawIteratorImpl *it_;
   DBImpl *db_;
+  const bool fill_cache_;
+  NodeCache::UncachedReads::Scope scope_;
 };
 
-RawIteratorImpl::RawIteratorImpl(Snapshot *snapshot) :
-  snapshot_(snapshot)
+RawIteratorImpl::RawIteratorImpl(Snapshot *snapshot,
+    const ReadOptions& options) :
+  snapshot_(snapshot),
+  fill_cache_(options.fill_cache),
+  rebase_interval_(options.rebase_interval),
+  steps_(0),
+  pinned_bytes_(0),
+  reported_pinned_bytes_(0),
+  readahead_size_(options.readahead_size),
+  after_image_bytes_(4096),
+  readahead_skip_(0),
+  readahead_backoff_(1)
+{
+  snapshot_->Ref();
+  snapshot_->db->IteratorOpened();
+}
+
+RawIteratorImpl::~RawIteratorImpl()
+{
+  // an outstanding read-ahead doesn't reference the iterator
+  auto db = snapshot_->db;
+  clear();
+  report_pinned_bytes(true);
+  db->ReleaseSnapshot(snapshot_);
+  db->IteratorClosed();
+}
+
+void RawIteratorImpl::push(SharedNodeRef node)
+{
+  pinned_bytes_ += node->ByteSize();
+  stack_.push_back(node);
+}
+
+void RawIteratorImpl::pop()
 {
+  pinned_bytes_ -= stack_.back()->ByteSize();
+  stack_.pop_back();
+}
+
+void RawIteratorImpl::clear()
+{
+  stack_.clear();
+  pinned_bytes_ = 0;
+}
+
+void RawIteratorImpl::report_pinned_bytes(bool force)
+{
+  const auto delta = pinned_bytes_ - reported_pinned_bytes_;
+  if (!force && std::abs(delta) < kPinnedBytesReportThreshold) {
+    return;
+  }
+  snapshot_->db->UpdateIteratorPinnedBytes(delta);
+  reported_pinned_bytes_ = pinned_bytes_;
 }
 
 bool RawIteratorImpl::Valid() const
@@ -31,131 +99,185 @@ bool RawIteratorImpl::Valid() const
 
 void RawIteratorImpl::SeekToFirst()
 {
-  IteratorTraceApplier ta(snapshot_->db);
+  IteratorTraceApplier ta(this);
 
-  // clear stack
-  std::stack<SharedNodeRef> stack;
-  stack_.swap(stack);
+  clear();
 
   // all the way to the left
-  SharedNodeRef node = snapshot_->root.ref(ta.trace);
+  SharedNodeRef node = snapshot_->root.ref(ta.trace, fill_cache_);
   while (node != Node::Nil()) {
-    stack_.push(node);
-    node = node->left.ref(ta.trace);
+    push(node);
+    node = node->left.ref(ta.trace, fill_cache_);
   }
 
   dir = Forward;
+
+  ReadAhead();
 }
 
 void RawIteratorImpl::SeekToLast()
 {
-  IteratorTraceApplier ta(snapshot_->db);
+  IteratorTraceApplier ta(this);
 
-  // clear stack
-  std::stack<SharedNodeRef> stack;
-  stack_.swap(stack);
+  clear();
 
   // all the way to the right
-  SharedNodeRef node = snapshot_->root.ref(ta.trace);
+  SharedNodeRef node = snapshot_->root.ref(ta.trace, fill_cache_);
   while (node != Node::Nil()) {
-    stack_.push(node);
-    node = node->right.ref(ta.trace);
+    push(node);
+    node = node->right.ref(ta.trace, fill_cache_);
   }
 
   dir = Reverse;
+
+  ReadAhead();
 }
 
 void RawIteratorImpl::Seek(const zlog::Slice& key)
 {
-  IteratorTraceApplier ta(snapshot_->db);
+  IteratorTraceApplier ta(this);
 
-  // clear stack
-  std::stack<SharedNodeRef> stack;
-  stack_.swap(stack);
+  clear();
 
-  SharedNodeRef node = snapshot_->root.ref(ta.trace);
+  SharedNodeRef node = snapshot_->root.ref(ta.trace, fill_cache_);
   while (node != Node::Nil()) {
     int cmp = key.compare(zlog::Slice(node->key().data(),
           node->key().size()));
     if (cmp == 0) {
-      stack_.push(node);
+      push(node);
       break;
     } else if (cmp < 0) {
-      stack_.push(node);
-      node = node->left.ref(ta.trace);
+      push(node);
+      node = node->left.ref(ta.trace, fill_cache_);
     } else
-      node = node->right.ref(ta.trace);
+      node = node->right.ref(ta.trace, fill_cache_);
   }
 
   assert(stack_.empty() ||
-      zlog::Slice(stack_.top()->key().data(),
-        stack_.top()->key().size()).compare(key) >= 0);
+      zlog::Slice(stack_.back()->key().data(),
+        stack_.back()->key().size()).compare(key) >= 0);
 
   dir = Forward;
+
+  ReadAhead();
+}
+
+void RawIteratorImpl::SeekToRank(uint64_t rank)
+{
+  SeekToRank("", "", rank);
+}
+
+// the rank is offset by the rank of the lower key, and then found by
+// descending with the subtree counts. without counts the keys are skipped one
+// at a time, stopping at the end of the range.
+void RawIteratorImpl::SeekToRank(const std::string& lower,
+    const std::string& upper, uint64_t rank)
+{
+  {
+    IteratorTraceApplier ta(this);
+
+    clear();
+
+    auto base = snapshot_->db->KeyRank(snapshot_->root, lower, fill_cache_);
+    SharedNodeRef node = base ?
+      snapshot_->root.ref(ta.trace, fill_cache_) : Node::Nil();
+    uint64_t remaining = base ? base->first + rank : 0;
+
+    while (node != Node::Nil()) {
+      auto left = node->left.ref(ta.trace, fill_cache_);
+      if (!left->has_subtree_stats()) {
+        base = boost::none;
+        break;
+      }
+      const auto left_count = left->subtree_count();
+      if (remaining < left_count) {
+        push(node);
+        node = left;
+      } else if (remaining == left_count) {
+        push(node);
+        break;
+      } else {
+        remaining -= left_count + 1;
+        node = node->right.ref(ta.trace, fill_cache_);
+      }
+    }
+
+    dir = Forward;
+
+    if (base) {
+      ReadAhead();
+      return;
+    }
+  }
+
+  const zlog::Slice end(upper);
+  RawIteratorImpl::Seek(lower);
+  for (uint64_t i = 0; i < rank && RawIteratorImpl::Valid(); i++) {
+    if (!upper.empty() && RawIteratorImpl::key().compare(end) >= 0) {
+      break;
+    }
+    RawIteratorImpl::Next();
+  }
 }
 
 void RawIteratorImpl::SeekForward(const zlog::Slice& key)
 {
-  IteratorTraceApplier ta(snapshot_->db);
+  IteratorTraceApplier ta(this);
 
-  // clear stack
-  std::stack<SharedNodeRef> stack;
-  stack_.swap(stack);
+  clear();
 
-  SharedNodeRef node = snapshot_->root.ref(ta.trace);
+  SharedNodeRef node = snapshot_->root.ref(ta.trace, fill_cache_);
   while (node != Node::Nil()) {
     int cmp = key.compare(zlog::Slice(node->key().data(),
           node->key().size()));
     if (cmp == 0) {
-      stack_.push(node);
+      push(node);
       break;
     } else if (cmp < 0) {
-      stack_.push(node);
-      node = node->left.ref(ta.trace);
+      push(node);
+      node = node->left.ref(ta.trace, fill_cache_);
     } else
-      node = node->right.ref(ta.trace);
+      node = node->right.ref(ta.trace, fill_cache_);
   }
 
   assert(stack_.empty() ||
-      zlog::Slice(stack_.top()->key().data(),
-        stack_.top()->key().size()).compare(key) == 0);
+      zlog::Slice(stack_.back()->key().data(),
+        stack_.back()->key().size()).compare(key) == 0);
 
   dir = Forward;
 }
 
 void RawIteratorImpl::SeekPrevious(const zlog::Slice& key)
 {
-  IteratorTraceApplier ta(snapshot_->db);
+  IteratorTraceApplier ta(this);
 
-  // clear stack
-  std::stack<SharedNodeRef> stack;
-  stack_.swap(stack);
+  clear();
 
-  SharedNodeRef node = snapshot_->root.ref(ta.trace);
+  SharedNodeRef node = snapshot_->root.ref(ta.trace, fill_cache_);
   while (node != Node::Nil()) {
     int cmp = key.compare(zlog::Slice(node->key().data(),
           node->key().size()));
     if (cmp == 0) {
-      stack_.push(node);
+      push(node);
       break;
     } else if (cmp < 0) {
-      node = node->left.ref(ta.trace);
+      node = node->left.ref(ta.trace, fill_cache_);
     } else {
-      stack_.push(node);
-      node = node->right.ref(ta.trace);
+      push(node);
+      node = node->right.ref(ta.trace, fill_cache_);
     }
   }
 
   assert(stack_.empty() ||
-      zlog::Slice(stack_.top()->key().data(),
-        stack_.top()->key().size()).compare(key) == 0);
+      zlog::Slice(stack_.back()->key().data(),
+        stack_.back()->key().size()).compare(key) == 0);
 
   dir = Reverse;
 }
 
 void RawIteratorImpl::Next()
 {
-  IteratorTraceApplier ta(snapshot_->db);
+  IteratorTraceApplier ta(this);
 
   assert(!stack_.empty());
   if (dir == Reverse) {
@@ -163,17 +285,19 @@ void RawIteratorImpl::Next()
     assert(dir == Forward);
   }
   assert(!stack_.empty());
-  SharedNodeRef node = stack_.top()->right.ref(ta.trace);
-  stack_.pop();
+  SharedNodeRef node = stack_.back()->right.ref(ta.trace, fill_cache_);
+  pop();
   while (node != Node::Nil()) {
-    stack_.push(node);
-    node = node->left.ref(ta.trace);
+    push(node);
+    node = node->left.ref(ta.trace, fill_cache_);
   }
+
+  Step();
 }
 
 void RawIteratorImpl::Prev()
 {
-  IteratorTraceApplier ta(snapshot_->db);
+  IteratorTraceApplier ta(this);
 
   assert(!stack_.empty());
   if (dir == Forward) {
@@ -181,26 +305,168 @@ void RawIteratorImpl::Prev()
     assert(dir == Reverse);
   }
   assert(!stack_.empty());
-  SharedNodeRef node = stack_.top()->left.ref(ta.trace);
-  stack_.pop();
+  SharedNodeRef node = stack_.back()->left.ref(ta.trace, fill_cache_);
+  pop();
   while (node != Node::Nil()) {
-    stack_.push(node);
-    node = node->right.ref(ta.trace);
+    push(node);
+    node = node->right.ref(ta.trace, fill_cache_);
+  }
+
+  Step();
+}
+
+void RawIteratorImpl::SeekForPrev(const zlog::Slice& key)
+{
+  IteratorTraceApplier ta(this);
+
+  clear();
+
+  SharedNodeRef node = snapshot_->root.ref(ta.trace, fill_cache_);
+  while (node != Node::Nil()) {
+    int cmp = key.compare(zlog::Slice(node->key().data(),
+          node->key().size()));
+    if (cmp == 0) {
+      push(node);
+      break;
+    } else if (cmp < 0) {
+      node = node->left.ref(ta.trace, fill_cache_);
+    } else {
+      push(node);
+      node = node->right.ref(ta.trace, fill_cache_);
+    }
+  }
+
+  assert(stack_.empty() ||
+      zlog::Slice(stack_.back()->key().data(),
+        stack_.back()->key().size()).compare(key) <= 0);
+
+  dir = Reverse;
+}
+
+void RawIteratorImpl::Step()
+{
+  if (rebase_interval_ > 0 && ++steps_ >= rebase_interval_ &&
+      RawIteratorImpl::Valid()) {
+    Rebase();
+  }
+
+  ReadAhead();
+}
+
+// only the nodes reachable through nodes in memory have known addresses, so
+// the subtrees visited next are searched breadth first for nodes that would
+// have to be read, which is roughly the order that they are visited.
+void RawIteratorImpl::ReadAhead()
+{
+  if (readahead_size_ == 0 || stack_.empty()) {
+    return;
+  }
+
+  if (readahead_skip_ > 0) {
+    readahead_skip_--;
+    return;
+  }
+
+  if (readahead_.valid()) {
+    if (readahead_.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+      return;
+    }
+    const auto res = readahead_.get();
+    if (res.first > 0) {
+      after_image_bytes_ = std::max(res.second / res.first, size_t(1));
+    }
+  }
+
+  auto db = snapshot_->db;
+  const auto forward = dir == Forward;
+  const auto max_positions =
+    std::max(readahead_size_ / after_image_bytes_, size_t(1));
+
+  std::vector<uint64_t> positions;
+  {
+    Epoch::Guard guard;
+
+    std::deque<NodePtr*> pending;
+    for (auto it = stack_.rbegin(); it != stack_.rend(); it++) {
+      pending.push_back(forward ? &(*it)->right : &(*it)->left);
+    }
+
+    size_t visits = 0;
+    while (!pending.empty() && positions.size() < max_positions &&
+        visits++ < 4 * max_positions) {
+      auto ptr = pending.front();
+      pending.pop_front();
+
+      boost::optional<NodeAddress> address;
+      auto node = ptr->resident(&address);
+      if (node) {
+        if (node != Node::Nil().get()) {
+          pending.push_back(forward ? &node->left : &node->right);
+          pending.push_back(forward ? &node->right : &node->left);
+        }
+        continue;
+      }
+
+      auto pos = address->IsAfterImage() ?
+        boost::optional<uint64_t>(address->Position()) :
+        db->IntentionToAfterImage(address->Position());
+      if (pos && std::find(positions.begin(), positions.end(), *pos) ==
+          positions.end()) {
+        positions.emplace_back(*pos);
+      }
+    }
+  }
+
+  // back off while the scan is running over nodes in memory
+  if (positions.empty()) {
+    readahead_skip_ = readahead_backoff_;
+    readahead_backoff_ = std::min(readahead_backoff_ * 2, size_t(64));
+    return;
+  }
+  readahead_backoff_ = 1;
+
+  readahead_ = db->ReadAheadAfterImages(std::move(positions));
+}
+
+// the current key may have been removed from the latest state, in which case
+// the iterator moves to the key that would have followed it.
+void RawIteratorImpl::Rebase()
+{
+  const auto key = RawIteratorImpl::key().ToString();
+
+  auto db = snapshot_->db;
+  auto snapshot = db->GetSnapshot();
+  db->ReleaseSnapshot(snapshot_);
+  snapshot_ = snapshot;
+  steps_ = 0;
+
+  if (dir == Forward) {
+    RawIteratorImpl::Seek(key);
+  } else {
+    SeekForPrev(key);
   }
 }
 
 zlog::Slice RawIteratorImpl::key() const
 {
   assert(!stack_.empty());
-  return zlog::Slice(stack_.top()->key().data(),
-      stack_.top()->key().size());
+  return zlog::Slice(stack_.back()->key().data(),
+      stack_.back()->key().size());
 }
 
 zlog::Slice RawIteratorImpl::value() const
 {
   assert(!stack_.empty());
-  return zlog::Slice(stack_.top()->val().data(),
-      stack_.top()->val().size());
+  return zlog::Slice(stack_.back()->val().data(),
+      stack_.back()->val().size());
+}
+
+void RawIteratorImpl::value(PinnableSlice *value) const
+{
+  assert(!stack_.empty());
+  const auto& node = stack_.back();
+  value->PinSlice(node->val(), node);
 }
 
 }
@@ -1,16 +1,24 @@
 #pragma once
 #include <cstring>
-#include <stack>
+#include <future>
+#include <utility>
+#include <vector>
 #include <zlog/slice.h>
 #include "cruzdb/iterator.h"
+#include "cruzdb/options.h"
 #include "node.h"
+#include "node_cache.h"
 #include "snapshot.h"
 
 namespace cruzdb {
 
 class RawIteratorImpl : public Iterator {
  public:
-  RawIteratorImpl(Snapshot *snapshot);
+  // the iterator holds a reference to the snapshot
+  RawIteratorImpl(Snapshot *snapshot,
+      const ReadOptions& options = ReadOptions());
+
+  ~RawIteratorImpl();
 
   // An iterator is either positioned at a key/value pair, or
   // not valid.  This method returns true iff the iterator is valid.
@@ -29,6 +37,8 @@ class RawIteratorImpl : public Iterator {
   // an entry that comes at or past target.
   void Seek(const zlog::Slice& target) override;
 
+  void SeekToRank(uint64_t rank) override;
+
   // Moves to the next entry in the source.  After this call, Valid() is
   // true iff the iterator was not positioned at the last entry in the source.
   // REQUIRES: Valid()
@@ -51,6 +61,11 @@ class RawIteratorImpl : public Iterator {
   // REQUIRES: !AtEnd() && !AtStart()
   zlog::Slice value() const override;
 
+  // Pin the value of the current entry. The current node is shared with the
+  // value, so this doesn't copy.
+  // REQUIRES: Valid()
+  void value(PinnableSlice *value) const override;
+
 #if 0
   // If an error has occurred, return it.  Else return an ok status.
   // If non-blocking IO is requested and this operation cannot be
@@ -70,6 +85,12 @@ class RawIteratorImpl : public Iterator {
   Status GetProperty(std::string prop_name, std::string* prop);
 #endif
 
+ protected:
+  // position at the key with the given rank among the keys at or after lower.
+  // the range is unbounded above when upper is empty.
+  void SeekToRank(const std::string& lower, const std::string& upper,
+      uint64_t rank);
+
  private:
   // No copying allowed
   //Iterator(const Iterator&);
@@ -80,19 +101,66 @@ class RawIteratorImpl : public Iterator {
     Reverse
   };
 
+  friend class IteratorTraceApplier;
+
   void SeekForward(const zlog::Slice& target);
   void SeekPrevious(const zlog::Slice& target);
 
-  std::stack<SharedNodeRef> stack_; // curr or unvisited parents
+  // position at the last key at or before target
+  void SeekForPrev(const zlog::Slice& target);
+
+  // move to the latest committed state, keeping the current position
+  void Rebase();
+  void Step();
+
+  // start reading ahead, unless a read-ahead is still in flight
+  void ReadAhead();
+
+  // the stack pins its nodes in memory, so it is only modified through these
+  // to keep track of the bytes pinned.
+  void push(SharedNodeRef node);
+  void pop();
+  void clear();
+
+  // the change in bytes pinned is reported once it reaches the threshold, so
+  // stepping the iterator doesn't update the shared statistic. force reports
+  // any change.
+  static const int64_t kPinnedBytesReportThreshold = 64 << 10;
+  void report_pinned_bytes(bool force = false);
+
+  std::vector<SharedNodeRef> stack_; // curr or unvisited parents
   Snapshot *snapshot_;
   Direction dir;
+  const bool fill_cache_;
+  NodeCache::UncachedReads uncached_reads_; // without fill_cache
+
+  const size_t rebase_interval_;
+  size_t steps_;
+
+  int64_t pinned_bytes_;
+  int64_t reported_pinned_bytes_;
+
+  const size_t readahead_size_;
+  std::future<std::pair<size_t, size_t>> readahead_;
+  size_t after_image_bytes_; // average seen by read-ahead
+  size_t readahead_skip_;    // moves to skip after finding nothing to read
+  size_t readahead_backoff_;
 };
 
 class PrefixRawIteratorImpl : public RawIteratorImpl {
  public:
-  PrefixRawIteratorImpl(const std::string& prefix, Snapshot *snapshot) :
-    RawIteratorImpl(snapshot),
-    prefix_(prefix)
+  // the iterator's range is the prefix, narrowed by the bounds in options.
+  // the range is computed once as bounds on prefixed keys, so checking a
+  // position is two comparisons.
+  PrefixRawIteratorImpl(const std::string& prefix, Snapshot *snapshot,
+      const ReadOptions& options = ReadOptions()) :
+    RawIteratorImpl(snapshot, options),
+    prefix_(prefix),
+    lower_(prefix_string(prefix, options.iterate_lower_bound ?
+          options.iterate_lower_bound->ToString() : "")),
+    upper_(options.iterate_upper_bound ?
+        prefix_string(prefix, options.iterate_upper_bound->ToString()) :
+        prefix + '\1')
   {}
 
   bool Valid() const override {
@@ -100,22 +168,16 @@ class PrefixRawIteratorImpl : public RawIteratorImpl {
       return false;
     }
     zlog::Slice key = RawIteratorImpl::key();
-    if (key.size() > prefix_.length() && key[prefix_.length()] == '\0') {
-      return std::memcmp(key.data(), prefix_.c_str(), prefix_.length()) == 0;
-    } else {
-      return false;
-    }
+    return key.compare(lower_) >= 0 && key.compare(upper_) < 0;
   }
 
   void SeekToFirst() override {
-    RawIteratorImpl::Seek(prefix_);
+    RawIteratorImpl::Seek(lower_);
   }
 
   void SeekToLast() override {
-    std::string past = prefix_;
-    past.push_back(1);
-    RawIteratorImpl::Seek(past);
-    if (Valid()) {
+    RawIteratorImpl::Seek(upper_);
+    if (RawIteratorImpl::Valid()) {
       Prev();
     } else {
       RawIteratorImpl::SeekToLast();
@@ -123,13 +185,21 @@ class PrefixRawIteratorImpl : public RawIteratorImpl {
   }
 
   void Seek(const zlog::Slice& target) override {
-    RawIteratorImpl::Seek(prefix_string(prefix_, target.ToString()));
+    auto key = prefix_string(prefix_, target.ToString());
+    RawIteratorImpl::Seek(key < lower_ ? lower_ : key);
+  }
+
+  void SeekToRank(uint64_t rank) override {
+    RawIteratorImpl::SeekToRank(lower_, upper_, rank);
   }
 
  protected:
   const std::string prefix_;
 
  private:
+  const std::string lower_;
+  const std::string upper_;
+
   static std::string prefix_string(const std::string& prefix,
       const std::string& value) {
     auto out = prefix;
@@ -141,8 +211,9 @@ class PrefixRawIteratorImpl : public RawIteratorImpl {
 
 class FilteredPrefixIteratorImpl : public PrefixRawIteratorImpl {
  public:
-  FilteredPrefixIteratorImpl(const std::string& prefix, Snapshot *snapshot) :
-    PrefixRawIteratorImpl(prefix, snapshot)
+  FilteredPrefixIteratorImpl(const std::string& prefix, Snapshot *snapshot,
+      const ReadOptions& options = ReadOptions()) :
+    PrefixRawIteratorImpl(prefix, snapshot, options)
   {}
 
   zlog::Slice key() const override {
@@ -5,10 +5,10 @@
 namespace cruzdb {
 
 SharedNodeRef NodePtr::fetch(boost::optional<NodeAddress>& address,
-    std::vector<NodeAddress>& trace)
+    std::vector<NodeAddress>& trace, bool fill_cache)
 {
   assert(db_);
-  return db_->fetch(trace, address);
+  return db_->fetch(trace, address, fill_cache);
 }
 
 }
@@ -7,6 +7,7 @@
 #include <vector>
 #include <boost/optional.hpp>
 #include <zlog/slice.h>
+#include "db/epoch.h"
 
 namespace cruzdb {
 
@@ -83,22 +84,36 @@ class NodePtr {
  public:
   NodePtr(SharedNodeRef ref, DBImpl *db) :
     ref_(ref),
+    raw_(ref.get()),
+    nil_(ref && is_nil(ref.get())),
     address_(boost::none),
     db_(db)
-  {}
+  {
+    remember_subtree_stats(ref.get());
+  }
 
   NodePtr(const NodePtr& other) {
     std::lock_guard<std::mutex>(other.lock_);
     ref_ = other.ref_;
+    raw_ = other.raw_;
+    nil_ = other.nil_;
     db_ = other.db_;
     address_ = other.address_;
+    has_subtree_stats_ = other.has_subtree_stats_;
+    subtree_count_ = other.subtree_count_;
+    subtree_bytes_ = other.subtree_bytes_;
   }
 
   NodePtr& operator=(const NodePtr& other) {
     std::lock_guard<std::mutex>(other.lock_);
     ref_ = other.ref_;
+    raw_ = other.raw_;
+    nil_ = other.nil_;
     db_ = other.db_;
     address_ = other.address_;
+    has_subtree_stats_ = other.has_subtree_stats_;
+    subtree_count_ = other.subtree_count_;
+    subtree_bytes_ = other.subtree_bytes_;
     return *this;
   }
 
@@ -108,8 +123,15 @@ class NodePtr {
   NodePtr(NodePtr&& other) = default;
 
   // TODO: tracing
-  inline SharedNodeRef ref(std::vector<NodeAddress>& trace) {
+  //
+  // when fill_cache is false a node that must be read from the log is returned
+  // to the caller without being added to the node cache.
+  inline SharedNodeRef ref(std::vector<NodeAddress>& trace,
+      bool fill_cache = true) {
     std::unique_lock<std::mutex> lk(lock_);
+    if (nil_) {
+      return nil_ref();
+    }
     if (address_) {
       trace.emplace_back(*address_);
     }
@@ -120,12 +142,18 @@ class NodePtr {
         assert(address_);
         auto address = address_;
         lk.unlock();
-        auto node = fetch(address, trace);
+        auto node = fetch(address, trace, fill_cache);
         lk.lock();
         if (auto ret = ref_.lock()) {
           return ret;
         } else {
+          // return the fetched node directly. it may not be held by the cache
+          // (e.g. fill_cache is false) in which case the weak reference would
+          // expire as soon as this scope ends.
           ref_ = node;
+          raw_ = node.get();
+          remember_subtree_stats(raw_);
+          return node;
         }
       }
     }
@@ -140,9 +168,65 @@ class NodePtr {
     return ref(trace);
   }
 
+  // take a reference to the node, e.g. to keep a node returned by get alive
+  // after the caller's Epoch::Guard ends. this is ref without a trace, for
+  // when the node has already been recorded in one.
+  inline SharedNodeRef pin(bool fill_cache = true) {
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      if (nil_) {
+        return nil_ref();
+      }
+      if (auto ret = ref_.lock()) {
+        return ret;
+      }
+    }
+    std::vector<NodeAddress> trace;
+    return ref(trace, fill_cache);
+  }
+
+  // dereference a node without taking a reference to it, so a traversal
+  // doesn't write to the reference counts of the nodes it visits. the
+  // returned node is only valid until the caller's Epoch::Guard ends. if the
+  // node is read and fetched is set, the reference to the new node is stored
+  // in it; without fill_cache that is the only reference keeping it alive.
+  inline Node *get(std::vector<NodeAddress>& trace, bool fill_cache = true,
+      SharedNodeRef *fetched = nullptr);
+
+  // like get, but a node that isn't in memory isn't read. null is returned
+  // instead, and address is set to the node's address.
+  inline Node *resident(boost::optional<NodeAddress> *address);
+
+  // a reference to the node if it is in memory, and null otherwise
+  inline SharedNodeRef resident_ref() {
+    std::lock_guard<std::mutex> lk(lock_);
+    if (nil_) {
+      return nil_ref();
+    }
+    return ref_.lock();
+  }
+
   inline void set_ref(SharedNodeRef ref) {
     std::lock_guard<std::mutex> l(lock_);
     ref_ = ref;
+    raw_ = ref.get();
+    nil_ = ref && is_nil(ref.get());
+    remember_subtree_stats(raw_);
+  }
+
+  // the subtree statistics of the node as of when it was last referenced
+  // through this pointer, which are available after the node has left
+  // memory. committed nodes don't change, but the statistics of a node that
+  // is still being built are computed once its tree is finished, so they are
+  // only meaningful for nodes of an earlier transaction.
+  inline bool subtree_stats(uint64_t *count, uint64_t *bytes) const {
+    std::lock_guard<std::mutex> l(lock_);
+    if (!has_subtree_stats_) {
+      return false;
+    }
+    *count = subtree_count_;
+    *bytes = subtree_bytes_;
+    return true;
   }
 
   boost::optional<NodeAddress> Address() const {
@@ -171,20 +255,32 @@ class NodePtr {
     std::lock_guard<std::mutex> l(lock_);
     assert(address_);
     assert(!address_->IsAfterImage());
-    assert(address_->Position() < position);
+    // after images stored in their own log may be at lower positions
     address_ = NodeAddress(position, address_->Offset(), true);
   }
 
  private:
   mutable std::mutex lock_;
 
+  // the nil sentinel isn't reference counted, so it can't be held by a weak
+  // reference.
   WeakNodeRef ref_;
+  Node *raw_;
+  bool nil_;
   boost::optional<NodeAddress> address_;
 
   DBImpl *db_;
 
+  bool has_subtree_stats_;
+  uint64_t subtree_count_;
+  uint64_t subtree_bytes_;
+  inline void remember_subtree_stats(const Node *node);
+
+  static inline bool is_nil(const Node *node);
+  static inline const SharedNodeRef& nil_ref();
+
   SharedNodeRef fetch(boost::optional<NodeAddress>& address,
-      std::vector<NodeAddress>& trace);
+      std::vector<NodeAddress>& trace, bool fill_cache);
 };
 
 /*
@@ -200,30 +296,53 @@ class Node {
       uint64_t rid, bool read_only, DBImpl *db) :
     left(lr, db), right(rr, db),
     key_(key.data(), key.size()), val_(val.data(), val.size()),
-    red_(red), rid_(rid), read_only_(read_only)
+    red_(red), rid_(rid), read_only_(read_only),
+    has_subtree_stats_(false), subtree_count_(0), subtree_bytes_(0)
   {}
 
+  // the sentinel has no control block, so copying a reference to it doesn't
+  // write to memory shared by every thread checking for a leaf.
   static SharedNodeRef& Nil() {
     // TODO: in a redesign, it would be nice to get rid of Nil being represented
     // like this, especially the weird min rid value.
-    static SharedNodeRef node = std::make_shared<Node>("", "",
-        false, nullptr, nullptr, std::numeric_limits<int64_t>::min(), true, nullptr);
+    static SharedNodeRef node = [] {
+      static Node nil("", "", false, nullptr, nullptr,
+          std::numeric_limits<int64_t>::min(), false, nullptr);
+      nil.set_subtree_stats(0, 0);
+      nil.set_read_only();
+      return SharedNodeRef(SharedNodeRef(), &nil);
+    }();
     return node;
   }
 
+  // nodes may be visited through raw pointers by readers inside an epoch
+  // critical section, so they are retired rather than deleted when the last
+  // reference is dropped.
+  static SharedNodeRef Create(const zlog::Slice& key, const zlog::Slice& val,
+      bool red, SharedNodeRef lr, SharedNodeRef rr, uint64_t rid,
+      bool read_only, DBImpl *db) {
+    return SharedNodeRef(
+        new Node(key, val, red, lr, rr, rid, read_only, db),
+        [](Node *node) { Epoch::Retire(node); });
+  }
+
   static SharedNodeRef Copy(SharedNodeRef src, DBImpl *db, uint64_t rid) {
     if (src == Nil())
       return Nil();
 
     // TODO: we don't need to use the version of ref() that resolves here
     // because the caller will likely only traverse down one side.
-    auto node = std::make_shared<Node>(src->key(), src->val(), src->red(),
+    auto node = Create(src->key(), src->val(), src->red(),
         src->left.ref_notrace(), src->right.ref_notrace(), rid, false, db);
 
     // TODO: move this into the constructor
     node->left.SetAddress(src->left.Address());
     node->right.SetAddress(src->right.Address());
 
+    // the copy is about to change, so its statistics are computed again
+    // before the tree is published
+    node->clear_subtree_stats();
+
 #if 0
     if (src->left.csn_is_intention_pos()) {
       assert(src->left.csn() >= 0);
@@ -333,12 +452,107 @@ class Node {
     return sizeof(*this) + key_.size() + val_.size();
   }
 
+  // the number of nodes, and the size of their keys and values, in the
+  // subtree rooted at this node. they are unknown for nodes restored from
+  // after images written before subtree statistics were recorded.
+  inline bool has_subtree_stats() const {
+    return has_subtree_stats_;
+  }
+
+  inline uint64_t subtree_count() const {
+    assert(has_subtree_stats_);
+    return subtree_count_;
+  }
+
+  inline uint64_t subtree_bytes() const {
+    assert(has_subtree_stats_);
+    return subtree_bytes_;
+  }
+
+  inline void set_subtree_stats(uint64_t count, uint64_t bytes) {
+    assert(!read_only());
+    has_subtree_stats_ = true;
+    subtree_count_ = count;
+    subtree_bytes_ = bytes;
+  }
+
+  inline void clear_subtree_stats() {
+    assert(!read_only());
+    has_subtree_stats_ = false;
+  }
+
  private:
   std::string key_;
   std::string val_;
   bool red_;
   int64_t rid_;
   bool read_only_;
+
+  bool has_subtree_stats_;
+  uint64_t subtree_count_;
+  uint64_t subtree_bytes_;
 };
 
+inline bool NodePtr::is_nil(const Node *node)
+{
+  return node == Node::Nil().get();
+}
+
+inline const SharedNodeRef& NodePtr::nil_ref()
+{
+  return Node::Nil();
+}
+
+inline void NodePtr::remember_subtree_stats(const Node *node)
+{
+  has_subtree_stats_ = node && node->has_subtree_stats();
+  if (has_subtree_stats_) {
+    subtree_count_ = node->subtree_count();
+    subtree_bytes_ = node->subtree_bytes();
+  }
+}
+
+inline Node *NodePtr::resident(boost::optional<NodeAddress> *address)
+{
+  std::lock_guard<std::mutex> lk(lock_);
+  if (nil_ || !ref_.expired()) {
+    return raw_;
+  }
+  assert(address_);
+  *address = address_;
+  return nullptr;
+}
+
+inline Node *NodePtr::get(std::vector<NodeAddress>& trace, bool fill_cache,
+    SharedNodeRef *fetched)
+{
+  std::unique_lock<std::mutex> lk(lock_);
+  if (nil_) {
+    return raw_;
+  }
+  if (address_) {
+    trace.emplace_back(*address_);
+  }
+  // a node that is still referenced can't be freed before the guard ends,
+  // even if the last reference is dropped after this check.
+  if (!ref_.expired()) {
+    return raw_;
+  }
+  assert(address_);
+  auto address = address_;
+  lk.unlock();
+  auto node = fetch(address, trace, fill_cache);
+  lk.lock();
+  if (!ref_.expired()) {
+    return raw_;
+  }
+  ref_ = node;
+  raw_ = node.get();
+  remember_subtree_stats(raw_);
+  if (fetched) {
+    *fetched = std::move(node);
+  }
+  return raw_;
+}
+
 }
@@ -2,27 +2,400 @@
 #include "db_impl.h"
 #include <time.h>
 #include <deque>
+#include <unordered_set>
 #include <condition_variable>
 
 namespace cruzdb {
 
+namespace {
+
+thread_local NodeCache::UncachedReads *uncached_reads = nullptr;
+
+}
+
+NodeCache::UncachedReads::Scope::Scope(UncachedReads *reads) :
+  prev_(uncached_reads)
+{
+  if (reads) {
+    uncached_reads = reads;
+  }
+}
+
+NodeCache::UncachedReads::Scope::~Scope()
+{
+  uncached_reads = prev_;
+}
+
+std::shared_ptr<cruzdb_proto::AfterImage>
+NodeCache::UncachedReads::find(uint64_t pos) const
+{
+  auto it = after_images_.find(pos);
+  if (it == after_images_.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+void NodeCache::UncachedReads::insert(uint64_t pos,
+    std::shared_ptr<cruzdb_proto::AfterImage> after_image)
+{
+  const size_t bytes = after_image->SpaceUsedLong();
+  if (!after_images_.emplace(pos, std::move(after_image)).second) {
+    return;
+  }
+  order_.emplace_back(pos, bytes);
+  bytes_ += bytes;
+
+  // the newest after image is kept even if it is larger than the limit
+  while (bytes_ > max_bytes_ && order_.size() > 1) {
+    after_images_.erase(order_.front().first);
+    bytes_ -= order_.front().second;
+    order_.pop_front();
+  }
+}
+
+void NodeCache::insert_locked(shard& shard,
+    const std::pair<uint64_t, int>& key, SharedNodeRef node, uint8_t hits)
+{
+  shard.lru.emplace_front(key);
+  auto iter = shard.lru.begin();
+  const auto bytes = node->ByteSize();
+  auto res = shard.nodes.insert(
+      std::make_pair(key, entry{std::move(node), iter, false, hits, false}));
+  assert(res.second);
+  (void)res;
+  used_bytes_ += bytes;
+}
+
+// move a node to the front of the segment it is in
+void NodeCache::touch_locked(shard& shard, entry& e,
+    const std::pair<uint64_t, int>& key)
+{
+  if (e.pinned) {
+    return;
+  }
+  auto& list = e.hot ? shard.hot_lru : shard.lru;
+  list.erase(e.lru_iter);
+  list.emplace_front(key);
+  e.lru_iter = list.begin();
+}
+
+// record an access from an lru trace. a node on probation is promoted once it
+// has been accessed twice, and promotions beyond the size of the protected
+// segment push the coldest protected nodes back onto probation.
+void NodeCache::access_locked(shard& shard, entry& e,
+    const std::pair<uint64_t, int>& key)
+{
+  if (e.hot || e.pinned) {
+    touch_locked(shard, e, key);
+    return;
+  }
+
+  if (e.hits < std::numeric_limits<uint8_t>::max()) {
+    e.hits++;
+  }
+
+  if (e.hits < 2) {
+    touch_locked(shard, e, key);
+    return;
+  }
+
+  shard.lru.erase(e.lru_iter);
+  shard.hot_lru.emplace_front(key);
+  e.lru_iter = shard.hot_lru.begin();
+  e.hot = true;
+  shard.hot_bytes += e.node->ByteSize();
+  RecordTick(stats_, NODE_CACHE_PROMOTE);
+
+  while (shard.hot_bytes > protected_size_ && shard.hot_lru.size() > 1) {
+    auto demote_key = shard.hot_lru.back();
+    auto nit = shard.nodes.find(demote_key);
+    assert(nit != shard.nodes.end());
+    entry& d = nit->second;
+    shard.hot_lru.pop_back();
+    shard.hot_bytes -= d.node->ByteSize();
+    shard.lru.emplace_front(demote_key);
+    d.lru_iter = shard.lru.begin();
+    d.hot = false;
+    d.hits = 0;
+  }
+}
+
+// evict at least target_bytes from the shard, probationary nodes first.
+// returns the number of bytes that were freed. pinned nodes aren't in either
+// segment, so they are never evicted.
+ssize_t NodeCache::evict_locked(shard& shard, ssize_t target_bytes)
+{
+  ssize_t freed = 0;
+  while (freed < target_bytes) {
+    const bool hot = shard.lru.empty();
+    auto& list = hot ? shard.hot_lru : shard.lru;
+    if (list.empty())
+      break;
+    auto key = list.back();
+    auto nit = shard.nodes.find(key);
+    assert(nit != shard.nodes.end());
+    const auto bytes = nit->second.node->ByteSize();
+    if (hot) {
+      shard.hot_bytes -= bytes;
+    }
+    used_bytes_ -= bytes;
+    freed += bytes;
+    shard.nodes.erase(nit);
+    list.pop_back();
+    RecordTick(stats_, NODE_CACHE_FREE);
+  }
+  return freed;
+}
+
+// visit the committed intention markers newest first, along with the nodes on
+// the paths to them. only nodes that are in memory are visited. nodes in the
+// top levels are already pinned and are skipped.
+void NodeCache::pin_markers(const pinned_node& p, size_t depth,
+    const zlog::Slice& lower, const zlog::Slice& upper, size_t& remaining,
+    std::vector<pinned_node>& pinned) const
+{
+  const auto& node = p.node;
+  if (!node || node == Node::Nil() || remaining == 0)
+    return;
+
+  if (depth >= pinned_levels_) {
+    pinned.push_back(p);
+  }
+
+  const pinned_node left{node->left.resident_ref(), node->left.Address()};
+  const pinned_node right{node->right.resident_ref(), node->right.Address()};
+
+  const auto key = node->key();
+  if (key.compare(upper) >= 0) {
+    pin_markers(left, depth + 1, lower, upper, remaining, pinned);
+  } else if (key.compare(lower) < 0) {
+    pin_markers(right, depth + 1, lower, upper, remaining, pinned);
+  } else {
+    pin_markers(right, depth + 1, lower, upper, remaining, pinned);
+    if (remaining > 0) {
+      remaining--;
+      pin_markers(left, depth + 1, lower, upper, remaining, pinned);
+    }
+  }
+}
+
+// the key of a pinned node in the cache's index, if it has been written. an
+// intention address is only resolved if the mapping is already known, so
+// that pinning never reads the log.
+boost::optional<std::pair<uint64_t, int>> NodeCache::pinned_key(
+    const boost::optional<NodeAddress>& address)
+{
+  if (!address) {
+    return boost::none;
+  }
+  if (address->IsAfterImage()) {
+    return std::make_pair(address->Position(), int(address->Offset()));
+  }
+  const auto pos = IntentionToAfterImage(address->Position());
+  if (!pos) {
+    return boost::none;
+  }
+  return std::make_pair(*pos, int(address->Offset()));
+}
+
+// nodes no longer pinned go back on probation. newly pinned nodes are taken out
+// of their segment, or added to the index if they aren't in it.
+void NodeCache::update_pinned(
+    const std::map<std::pair<uint64_t, int>, SharedNodeRef>& pinned)
+{
+  std::vector<std::vector<std::pair<uint64_t, int>>> unpin(num_slots_);
+  for (const auto& key : pinned_keys_) {
+    if (pinned.find(key) == pinned.end()) {
+      unpin[pair_hash()(key) % num_slots_].emplace_back(key);
+    }
+  }
+
+  std::vector<std::vector<std::pair<std::pair<uint64_t, int>,
+    SharedNodeRef>>> pin(num_slots_);
+  for (const auto& node : pinned) {
+    pin[pair_hash()(node.first) % num_slots_].emplace_back(node);
+  }
+
+  ssize_t delta = 0;
+  for (size_t slot = 0; slot < num_slots_; slot++) {
+    auto& shard = shards_[slot];
+    std::lock_guard<std::mutex> lk(shard->lock);
+
+    for (const auto& key : unpin[slot]) {
+      auto it = shard->nodes.find(key);
+      assert(it != shard->nodes.end());
+      entry& e = it->second;
+      assert(e.pinned);
+      shard->lru.emplace_front(key);
+      e.lru_iter = shard->lru.begin();
+      e.pinned = false;
+      e.hits = 0;
+      delta -= e.node->ByteSize();
+    }
+
+    for (const auto& node : pin[slot]) {
+      const auto& key = node.first;
+      auto it = shard->nodes.find(key);
+      if (it == shard->nodes.end()) {
+        const auto bytes = node.second->ByteSize();
+        shard->nodes.insert(std::make_pair(key,
+              entry{node.second, shard->lru.end(), false, 0, true}));
+        used_bytes_ += bytes;
+        delta += bytes;
+        continue;
+      }
+      entry& e = it->second;
+      if (e.pinned) {
+        continue;
+      }
+      if (e.hot) {
+        shard->hot_lru.erase(e.lru_iter);
+        shard->hot_bytes -= e.node->ByteSize();
+      } else {
+        shard->lru.erase(e.lru_iter);
+      }
+      e.hot = false;
+      e.pinned = true;
+      delta += e.node->ByteSize();
+    }
+  }
+
+  if (delta >= 0) {
+    pinned_bytes_ += delta;
+  } else {
+    pinned_bytes_ -= -delta;
+  }
+
+  pinned_keys_.clear();
+  for (const auto& node : pinned) {
+    pinned_keys_.emplace_back(node.first);
+  }
+}
+
+// only nodes already in memory are pinned, so refreshing never reads the log.
+// a node that isn't resident is pinned once a later refresh finds it in
+// memory.
+void NodeCache::refresh_pinned(const SharedNodeRef& root,
+    const boost::optional<NodeAddress>& address)
+{
+  std::vector<pinned_node> pinned;
+
+  // breadth-first through the top levels of the tree
+  std::vector<pinned_node> level{pinned_node{root, address}};
+  for (size_t depth = 0; depth < pinned_levels_ && !level.empty(); depth++) {
+    std::vector<pinned_node> next;
+    for (const auto& p : level) {
+      const auto& node = p.node;
+      if (!node || node == Node::Nil())
+        continue;
+      pinned.push_back(p);
+      if (depth + 1 < pinned_levels_) {
+        next.push_back(pinned_node{node->left.resident_ref(),
+            node->left.Address()});
+        next.push_back(pinned_node{node->right.resident_ref(),
+            node->right.Address()});
+      }
+    }
+    level.swap(next);
+  }
+
+  // the transaction processor scans the newest committed intention markers
+  // when checking for conflicts, so the end of that key range is pinned too.
+  std::string lower = PREFIX_COMMITTED_INTENTION;
+  lower.push_back(0);
+  std::string upper = PREFIX_COMMITTED_INTENTION;
+  upper.push_back(1);
+  size_t remaining = pinned_markers_;
+  pin_markers(pinned_node{root, address}, 0, lower, upper, remaining, pinned);
+
+  std::map<std::pair<uint64_t, int>, SharedNodeRef> indexed;
+  std::vector<SharedNodeRef> unindexed;
+  size_t pinned_bytes = 0;
+  for (const auto& p : pinned) {
+    pinned_bytes += p.node->ByteSize();
+    const auto key = pinned_key(p.address);
+    if (key) {
+      indexed.emplace(*key, p.node);
+    } else {
+      unindexed.push_back(p.node);
+    }
+  }
+
+  SetTickerCount(stats_, NODE_CACHE_PINNED_NODES, pinned.size());
+  SetTickerCount(stats_, NODE_CACHE_PINNED_BYTES, pinned_bytes);
+
+  update_pinned(indexed);
+
+  // the previous set is released when unindexed goes out of scope
+  pinned_.swap(unindexed);
+}
+
+std::vector<uint64_t> NodeCache::HotAfterImages(size_t max_positions)
+{
+  // snapshot each shard's segments in most-recently-used order
+  std::vector<std::vector<uint64_t>> hot(num_slots_);
+  std::vector<std::vector<uint64_t>> cold(num_slots_);
+  for (size_t slot = 0; slot < num_slots_; slot++) {
+    auto& shard = shards_[slot];
+    std::lock_guard<std::mutex> lk(shard->lock);
+    for (const auto& key : shard->hot_lru) {
+      hot[slot].emplace_back(key.first);
+    }
+    for (const auto& key : shard->lru) {
+      cold[slot].emplace_back(key.first);
+    }
+  }
+
+  // interleave the shards so that the ordering approximates a global lru
+  std::vector<uint64_t> positions;
+  std::unordered_set<uint64_t> seen;
+  for (auto *segment : {&hot, &cold}) {
+    for (size_t i = 0; positions.size() < max_positions; i++) {
+      bool more = false;
+      for (const auto& keys : *segment) {
+        if (i < keys.size()) {
+          more = true;
+          if (seen.insert(keys[i]).second) {
+            positions.emplace_back(keys[i]);
+            if (positions.size() == max_positions)
+              break;
+          }
+        }
+      }
+      if (!more)
+        break;
+    }
+  }
+
+  return positions;
+}
+
 void NodeCache::do_vaccum_()
 {
   while (true) {
     std::unique_lock<std::mutex> l(lock_);
 
     cond_.wait(l, [this]{
-        return !traces_.empty() || UsedBytes() > cache_size_ || stop_;
+        return !traces_.empty() || over_budget() || pin_root_ || stop_;
     });
 
     if (stop_)
       return;
 
     std::list<std::vector<NodeAddress>> traces;
-    traces_.swap(traces_);
+    traces.swap(traces_);
+
+    SharedNodeRef pin_root;
+    pin_root.swap(pin_root_);
+    const auto pin_root_address = pin_root_address_;
 
     l.unlock();
 
+    if (pin_root) {
+      refresh_pinned(pin_root, pin_root_address);
+    }
+
     // apply lru updates
     for (auto trace : traces) {
       for (auto address : trace) {
@@ -36,43 +409,22 @@ void NodeCache::do_vaccum_()
 
         auto slot = pair_hash()(key) % num_slots_;
         auto& shard = shards_[slot];
-        auto& nodes_ = shard->nodes;
-        auto& nodes_lru_ = shard->lru;
 
         std::unique_lock<std::mutex> lk(shard->lock);
 
-        auto node_it = nodes_.find(key);
-        if (node_it == nodes_.end())
+        auto node_it = shard->nodes.find(key);
+        if (node_it == shard->nodes.end())
           continue;
-        entry& e = node_it->second;
-        nodes_lru_.erase(e.lru_iter);
-        nodes_lru_.emplace_front(key);
-        e.lru_iter = nodes_lru_.begin();
+        access_locked(*shard, node_it->second, key);
       }
     }
 
-    if (UsedBytes() > cache_size_) {
+    if (over_budget()) {
       ssize_t target_bytes = (UsedBytes() - cache_size_) / num_slots_;
       for (size_t slot = 0; slot < num_slots_; slot++) {
         auto& shard = shards_[slot];
-        auto& nodes_ = shard->nodes;
-        auto& nodes_lru_ = shard->lru;
-
         std::unique_lock<std::mutex> lk(shard->lock);
-
-        ssize_t left = target_bytes;
-        while (left > 0) {
-          if (nodes_.empty())
-            break;
-          auto key = nodes_lru_.back();
-          auto nit = nodes_.find(key);
-          assert(nit != nodes_.end());
-          used_bytes_ -= nit->second.node->ByteSize();
-          left -= nit->second.node->ByteSize();
-          nodes_.erase(nit);
-          nodes_lru_.pop_back();
-          RecordTick(stats_, NODE_CACHE_FREE);
-        }
+        evict_locked(*shard, target_bytes);
       }
     }
   }
@@ -87,6 +439,8 @@ uint64_t NodeCache::findAfterImagePosition(
     auto tmp = IntentionToAfterImage(address->Position());
     if (tmp) {
       return *tmp;
+    } else if (db_->entry_service_->SeparateAfterImageLog()) {
+      return db_->entry_service_->FindAfterImage(address->Position());
     } else {
       const auto intention = address->Position();
       const auto pos = intention + 1;
@@ -118,7 +472,7 @@ uint64_t NodeCache::findAfterImagePosition(
 // created an index entry. when reading nodes from the log, pointers with
 // intentions are resolved before being allowed into memory.
 SharedNodeRef NodeCache::fetch(std::vector<NodeAddress>& trace,
-    boost::optional<NodeAddress>& address)
+    boost::optional<NodeAddress>& address, bool fill_cache)
 {
   RecordTick(stats_, NODE_CACHE_FETCHES);
 
@@ -130,28 +484,50 @@ SharedNodeRef NodeCache::fetch(std::vector<NodeAddress>& trace,
   auto slot = pair_hash()(key) % num_slots_;
   auto& shard = shards_[slot];
   auto& nodes_ = shard->nodes;
-  auto& nodes_lru_ = shard->lru;
 
   std::unique_lock<std::mutex> lk(shard->lock);
 
-  // is the node in the cache?
+  // is the node in the cache? the access itself is counted when the trace is
+  // applied, so a hit here only refreshes the node's position.
   auto it = nodes_.find(key);
   if (it != nodes_.end()) {
     RecordTick(stats_, NODE_CACHE_HIT);
     entry& e = it->second;
-    nodes_lru_.erase(e.lru_iter);
-    nodes_lru_.emplace_front(key);
-    e.lru_iter = nodes_lru_.begin();
+    if (fill_cache) {
+      touch_locked(*shard, e, key);
+    }
     return e.node;
   }
 
   // release lock for I/O
   lk.unlock();
 
+  // the node is returned without being cached, and its after image isn't
+  // added to the entry cache either. it is kept by the reader's scope, if it
+  // has one, for the other nodes in it.
+  if (!fill_cache) {
+    auto reads = uncached_reads;
+    auto ai = reads ? reads->find(afterimage) : nullptr;
+    if (!ai) {
+      ai = db_->entry_service_->ReadAfterImage(afterimage, false);
+      if (reads) {
+        reads->insert(afterimage, ai);
+      }
+    }
+    RecordTick(stats_, NODE_CACHE_NODES_READ);
+    return deserialize_node(*ai, afterimage, offset);
+  }
+
   // publish the lru traces. we are doing this here because if the log read
   // blocks or takes a long time we don't want to reduce the quality of the
   // trace by having it be outdated. how important is this? is it over
   // optimization?
+  //
+  // the last address in the trace is the node being fetched (see
+  // NodePtr::ref). that access is accounted for when the node is inserted
+  // below, so it is removed here to avoid counting it twice.
+  assert(!trace.empty());
+  trace.pop_back();
   {
     std::lock_guard<std::mutex> l(lock_);
     if (!trace.empty()) {
@@ -161,23 +537,33 @@ SharedNodeRef NodeCache::fetch(std::vector<NodeAddress>& trace,
     }
   }
 
-  auto ai = db_->entry_service_->ReadAfterImage(afterimage);
-
   // cache all the nodes in the after image then return the one we care about.
   // it's technically possible that after node is cached its removed, but lru
   // should always prevent that. in any case, we handle that expliclty.
-  CacheAfterImage(*ai, afterimage);
-
-  RecordTick(stats_, NODE_CACHE_NODES_READ, ai->tree_size());
+  //
+  // concurrent misses on nodes in the same after image wait for a single
+  // thread to read and cache it.
+  bool shared;
+  auto ai = afterimage_fetches_.Do(afterimage, [this, afterimage] {
+    auto ai = db_->entry_service_->ReadAfterImage(afterimage);
+    CacheAfterImage(*ai, afterimage);
+    RecordTick(stats_, NODE_CACHE_NODES_READ, ai->tree_size());
+    return ai;
+  }, &shared);
+
+  if (shared) {
+    RecordTick(stats_, NODE_CACHE_FETCHES_COALESCED);
+  }
 
   // its probably there now
   lk.lock();
   it = nodes_.find(key);
   if (it != nodes_.end()) {
     entry& e = it->second;
-    nodes_lru_.erase(e.lru_iter);
-    nodes_lru_.emplace_front(key);
-    e.lru_iter = nodes_lru_.begin();
+    if (!e.hot && e.hits == 0) {
+      e.hits = 1;
+    }
+    touch_locked(*shard, e, key);
     return e.node;
   }
 
@@ -190,19 +576,11 @@ SharedNodeRef NodeCache::fetch(std::vector<NodeAddress>& trace,
   it = nodes_.find(key);
   if (it != nodes_.end()) {
     entry& e = it->second;
-    nodes_lru_.erase(e.lru_iter);
-    nodes_lru_.emplace_front(key);
-    e.lru_iter = nodes_lru_.begin();
+    touch_locked(*shard, e, key);
     return e.node;
   }
 
-  nodes_lru_.emplace_front(key);
-  auto iter = nodes_lru_.begin();
-  auto res = nodes_.insert(
-      std::make_pair(key, entry{nn, iter}));
-  assert(res.second);
-
-  used_bytes_ += nn->ByteSize();
+  insert_locked(*shard, key, nn, 1);
 
   return nn;
 }
@@ -257,7 +635,6 @@ NodePtr NodeCache::CacheAfterImage(const cruzdb_proto::AfterImage& i,
     auto slot = pair_hash()(key) % num_slots_;
     auto& shard = shards_[slot];
     auto& nodes_ = shard->nodes;
-    auto& nodes_lru_ = shard->lru;
 
     std::unique_lock<std::mutex> lk(shard->lock);
 
@@ -270,13 +647,7 @@ NodePtr NodeCache::CacheAfterImage(const cruzdb_proto::AfterImage& i,
       continue;
     }
 
-    nodes_lru_.emplace_front(key);
-    auto iter = nodes_lru_.begin();
-    auto res = nodes_.insert(
-        std::make_pair(key, entry{nn, iter}));
-    assert(res.second);
-
-    used_bytes_ += nn->ByteSize();
+    insert_locked(*shard, key, nn, 0);
   }
 
   assert(nn != nullptr);
@@ -290,9 +661,13 @@ SharedNodeRef NodeCache::deserialize_node(const cruzdb_proto::AfterImage& i,
 {
   const cruzdb_proto::Node& n = i.tree(index);
 
-  auto nn = std::make_shared<Node>(n.key(), n.val(), n.red(),
+  auto nn = Node::Create(n.key(), n.val(), n.red(),
       nullptr, nullptr, i.intention(), false, db_);
 
+  if (n.has_subtree_count() && n.has_subtree_bytes()) {
+    nn->set_subtree_stats(n.subtree_count(), n.subtree_bytes());
+  }
+
   if (!n.left().nil()) {
     uint16_t offset = n.left().off();
     if (n.left().self()) {
@@ -343,24 +718,18 @@ NodePtr NodeCache::ApplyAfterImageDelta(
 
     auto slot = pair_hash()(key) % num_slots_;
     auto& shard = shards_[slot];
-    auto& nodes_ = shard->nodes;
-    auto& nodes_lru_ = shard->lru;
 
     std::unique_lock<std::mutex> lk(shard->lock);
 
-    nodes_lru_.emplace_front(key);
-    auto iter = nodes_lru_.begin();
-    auto res = nodes_.insert(
-        std::make_pair(key, entry{nn, iter}));
-    assert(res.second);
+    insert_locked(*shard, key, nn, 0);
     offset++;
-
-    used_bytes_ += nn->ByteSize();
   }
 
   auto root = delta.back();
+
   NodePtr ret(root, db_);
   ret.SetAfterImageAddress(after_image_pos, offset - 1);
+  PinRoot(root, ret.Address());
   return ret;
 }
 
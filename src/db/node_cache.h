@@ -1,16 +1,22 @@
 #pragma once
 #include <atomic>
+#include <limits>
 #include <unordered_map>
 #include <mutex>
 #include <utility>
+#include <vector>
 #include <thread>
 #include <list>
 #include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
 #include <zlog/log.h>
 #include "cruzdb/options.h"
 #include "node.h"
 #include "db/cruzdb.pb.h"
 #include "db/lru_cache.hpp"
+#include "db/single_flight.h"
 
 namespace cruzdb {
 
@@ -41,9 +47,14 @@ class NodeCache {
     log_(log),
     db_(db),
     used_bytes_(0),
+    pinned_bytes_(0),
     stop_(false),
     num_slots_(8),
     cache_size_(options.node_cache_size),
+    protected_size_(options.node_cache_size *
+        options.node_cache_protected_ratio / num_slots_),
+    pinned_levels_(options.node_cache_pinned_levels),
+    pinned_markers_(options.node_cache_pinned_markers),
     stats_(options.statistics.get()),
     imap_(options.imap_cache_size)
   {
@@ -58,11 +69,74 @@ class NodeCache {
   NodePtr ApplyAfterImageDelta(const std::vector<SharedNodeRef>& delta,
       uint64_t after_image_pos);
 
+  // replace the pinned region with the top levels of the tree rooted at root
+  // and its newest committed intention markers. the pinned nodes are collected
+  // asynchronously by the vaccum thread from those already in memory. pinned
+  // nodes stay in the cache's index and count against its size, but they are
+  // skipped by eviction and Clear() until the next root is pinned.
+  void PinRoot(SharedNodeRef root,
+      const boost::optional<NodeAddress>& address) {
+    if (pinned_levels_ == 0)
+      return;
+    std::lock_guard<std::mutex> l(lock_);
+    pin_root_ = root;
+    pin_root_address_ = address;
+    cond_.notify_one();
+  }
+
+  // positions of the after images that cached nodes were read from, ordered
+  // from most to least valuable: the protected segments first, then nodes on
+  // probation. used to persist the working set across restarts.
+  std::vector<uint64_t> HotAfterImages(size_t max_positions);
+
   uint64_t findAfterImagePosition(
       const boost::optional<NodeAddress>& address);
 
   SharedNodeRef fetch(std::vector<NodeAddress>& trace,
-      boost::optional<NodeAddress>& address);
+      boost::optional<NodeAddress>& address, bool fill_cache = true);
+
+  // reads that don't fill the cache don't keep the after images they read, so
+  // a scan would read an after image once for every node it visits in it. a
+  // reader that owns an UncachedReads and enters it with a Scope for the
+  // duration of an operation keeps up to max_bytes of the after images it has
+  // read, dropping the oldest first, and the other nodes in them are read from
+  // there. nothing is added to the caches.
+  class UncachedReads {
+   public:
+    explicit UncachedReads(size_t max_bytes = 1 << 20) :
+      max_bytes_(max_bytes),
+      bytes_(0)
+    {}
+
+    UncachedReads(const UncachedReads& other) = delete;
+    UncachedReads& operator=(const UncachedReads& other) = delete;
+
+    // uncached reads on this thread use reads until the scope ends. a null
+    // reads leaves the enclosing scope, if any, in effect.
+    class Scope {
+     public:
+      explicit Scope(UncachedReads *reads);
+      ~Scope();
+
+      Scope(const Scope& other) = delete;
+      Scope& operator=(const Scope& other) = delete;
+
+     private:
+      UncachedReads *prev_;
+    };
+
+   private:
+    friend class NodeCache;
+
+    std::shared_ptr<cruzdb_proto::AfterImage> find(uint64_t pos) const;
+    void insert(uint64_t pos,
+        std::shared_ptr<cruzdb_proto::AfterImage> after_image);
+
+    const size_t max_bytes_;
+    size_t bytes_;
+    std::map<uint64_t, std::shared_ptr<cruzdb_proto::AfterImage>> after_images_;
+    std::deque<std::pair<uint64_t, size_t>> order_; // oldest first
+  };
 
   boost::optional<uint64_t> IntentionToAfterImage(uint64_t intention_pos) {
     std::lock_guard<std::mutex> l(lock_);
@@ -81,6 +155,11 @@ class NodeCache {
     lock_.unlock();
     cond_.notify_one();
     vaccum_.join();
+
+    // release the pinned region so that Clear() empties the cache
+    pin_root_.reset();
+    update_pinned({});
+    pinned_.clear();
   }
 
   void UpdateLRU(std::vector<NodeAddress>& trace) {
@@ -103,16 +182,11 @@ class NodeCache {
     }
     for (size_t slot = 0; slot < num_slots_; slot++) {
       auto& shard = shards_[slot];
-      auto& nodes_ = shard->nodes;
-      auto& nodes_lru_ = shard->lru;
       std::unique_lock<std::mutex> lk(shard->lock);
-      while (!nodes_.empty()) {
-        auto key = nodes_lru_.back();
-        auto nit = nodes_.find(key);
-        assert(nit != nodes_.end());
-        used_bytes_ -= nit->second.node->ByteSize();
-        nodes_.erase(nit);
-        nodes_lru_.pop_back();
+      evict_locked(*shard, std::numeric_limits<ssize_t>::max());
+      for (const auto& node : shard->nodes) {
+        assert(node.second.pinned);
+        (void)node;
       }
     }
   }
@@ -122,30 +196,85 @@ class NodeCache {
   DBImpl *db_;
   std::mutex lock_;
   std::atomic_size_t used_bytes_;
+  std::atomic_size_t pinned_bytes_; // included in used_bytes_
   bool stop_;
   const size_t num_slots_;
   const size_t cache_size_;
+  const size_t protected_size_; // per shard
+  const size_t pinned_levels_;
+  const size_t pinned_markers_;
   Statistics *stats_;
 
+  struct pinned_node {
+    SharedNodeRef node;
+    boost::optional<NodeAddress> address;
+  };
+
+  // root waiting to be pinned. pinned nodes that have been written are pinned
+  // in their shard by key, and the rest are only held in memory until they
+  // are written and a later root pins them by key. both are only modified by
+  // the vaccum thread, or once it has stopped.
+  SharedNodeRef pin_root_;
+  boost::optional<NodeAddress> pin_root_address_;
+  std::vector<std::pair<uint64_t, int>> pinned_keys_;
+  std::vector<SharedNodeRef> pinned_;
+  void refresh_pinned(const SharedNodeRef& root,
+      const boost::optional<NodeAddress>& address);
+  void pin_markers(const pinned_node& node, size_t depth,
+      const zlog::Slice& lower, const zlog::Slice& upper, size_t& remaining,
+      std::vector<pinned_node>& pinned) const;
+  boost::optional<std::pair<uint64_t, int>> pinned_key(
+      const boost::optional<NodeAddress>& address);
+  void update_pinned(
+      const std::map<std::pair<uint64_t, int>, SharedNodeRef>& pinned);
+
   struct entry {
     SharedNodeRef node;
     std::list<std::pair<uint64_t, int>>::iterator lru_iter;
+    bool hot; // in the protected segment
+    uint8_t hits; // accesses seen while on probation
+    bool pinned; // in neither segment, and never evicted
   };
 
+  // each shard is a segmented lru. nodes enter the probationary segment (lru)
+  // and are promoted to the protected segment (hot_lru) on their second
+  // access. eviction drains the probationary segment first, so a single pass
+  // over a large key range can't displace nodes that are used repeatedly.
   struct shard {
     std::mutex lock;
     std::unordered_map<std::pair<uint64_t, int>, entry, pair_hash> nodes;
     std::list<std::pair<uint64_t, int>> lru;
+    std::list<std::pair<uint64_t, int>> hot_lru;
+    size_t hot_bytes = 0;
   };
 
   std::vector<std::unique_ptr<shard>> shards_;
 
+  // the following helpers require the shard lock to be held
+  void insert_locked(shard& shard, const std::pair<uint64_t, int>& key,
+      SharedNodeRef node, uint8_t hits);
+  void touch_locked(shard& shard, entry& e,
+      const std::pair<uint64_t, int>& key);
+  void access_locked(shard& shard, entry& e,
+      const std::pair<uint64_t, int>& key);
+  ssize_t evict_locked(shard& shard, ssize_t target_bytes);
+
   size_t UsedBytes() const {
     return used_bytes_;
   }
 
+  // pinned nodes count against the cache size but can't be evicted
+  bool over_budget() const {
+    const size_t used = UsedBytes();
+    return used > cache_size_ && used > pinned_bytes_;
+  }
+
   std::list<std::vector<NodeAddress>> traces_;
 
+  // in-flight after image reads on the miss path
+  SingleFlight<uint64_t,
+    std::shared_ptr<cruzdb_proto::AfterImage>> afterimage_fetches_;
+
   lru_cache<uint64_t, uint64_t> imap_;
 
   SharedNodeRef deserialize_node(const cruzdb_proto::AfterImage& i,
@@ -18,8 +18,7 @@ void PersistentTree::UpdateLRU()
 // exist since its pointing at a new node, but that isn't always the case.
 void PersistentTree::infect_node_ptr(uint64_t intention, NodePtr& src, int maybe_offset)
 {
-  if (src.ref_notrace() != Node::Nil() &&
-      src.ref(trace_)->rid() == rid_) {
+  if (fresh_child(src)) {
     src.SetIntentionAddress(intention, maybe_offset);
   }
 }
@@ -33,15 +32,13 @@ void PersistentTree::infect_node(SharedNodeRef node,
 
 void PersistentTree::infect_after_image(SharedNodeRef node, uint64_t intention, int& field_index)
 {
-  assert(node != nullptr);
-
-  if (node == Node::Nil() || node->rid() != rid_)
+  if (!node || node == Node::Nil() || node->rid() != rid_)
     return;
 
-  infect_after_image(node->left.ref(trace_), intention, field_index);
+  infect_after_image(fresh_child(node->left), intention, field_index);
   auto maybe_left_offset = field_index - 1;
 
-  infect_after_image(node->right.ref(trace_), intention, field_index);
+  infect_after_image(fresh_child(node->right), intention, field_index);
   auto maybe_right_offset = field_index - 1;
 
   infect_node(node, intention, maybe_left_offset, maybe_right_offset);
@@ -94,6 +91,7 @@ boost::optional<int> PersistentTree::infect_self_pointers(uint64_t intention,
 
   if (root_ == nullptr) {
     root_ = Node::Copy(src_root_.ref_notrace(), db_, rid_);
+    UpdateSubtreeStats();
     return boost::none;
   }
 
@@ -103,6 +101,8 @@ boost::optional<int> PersistentTree::infect_self_pointers(uint64_t intention,
   int field_index = 0;
   infect_after_image(root_, intention, field_index);
 
+  UpdateSubtreeStats();
+
   assert(field_index > 0);
   return field_index - 1;
 }
@@ -110,10 +110,11 @@ boost::optional<int> PersistentTree::infect_self_pointers(uint64_t intention,
 void PersistentTree::serialize_node_ptr(cruzdb_proto::NodePtr *dst,
     NodePtr& src, int maybe_offset)
 {
-  if (src.ref(trace_) == Node::Nil()) {
+  const auto node = src.resident_ref();
+  if (node == Node::Nil()) {
     dst->set_nil(true);
     dst->set_self(false);
-  } else if (src.ref(trace_)->rid() == rid_) {
+  } else if (node && node->rid() == rid_) {
     dst->set_nil(false);
     dst->set_self(true);
     dst->set_off(maybe_offset);
@@ -124,7 +125,6 @@ void PersistentTree::serialize_node_ptr(cruzdb_proto::NodePtr *dst,
     auto address = src.Address();
     assert(address);
 
-    assert(src.ref(trace_) != nullptr);
     dst->set_nil(false);
     dst->set_self(false);
 
@@ -148,19 +148,76 @@ void PersistentTree::serialize_node(cruzdb_proto::Node *dst,
     SharedNodeRef node, int maybe_left_offset, int maybe_right_offset)
 {
   dst->set_red(node->red());
-  dst->set_key(node->key().ToString());
-  dst->set_val(node->val().ToString());
+  // copy straight from the node's buffers rather than through temporaries
+  const auto key = node->key();
+  const auto val = node->val();
+  dst->set_key(key.data(), key.size());
+  dst->set_val(val.data(), val.size());
 
   serialize_node_ptr(dst->mutable_left(), node->left, maybe_left_offset);
   serialize_node_ptr(dst->mutable_right(), node->right, maybe_right_offset);
+
+  if (node->has_subtree_stats()) {
+    dst->set_subtree_count(node->subtree_count());
+    dst->set_subtree_bytes(node->subtree_bytes());
+  }
+}
+
+// new nodes are exactly the nodes whose subtrees changed, so rather than
+// maintaining the statistics through each rotation they are computed once,
+// bottom up, after the tree has been built.
+void PersistentTree::UpdateSubtreeStats()
+{
+  assert(root_ != nullptr);
+  update_subtree_stats(root_);
+}
+
+void PersistentTree::update_subtree_stats(SharedNodeRef node)
+{
+  if (!node || node == Node::Nil() || node->rid() != rid_)
+    return;
+
+  uint64_t left_count, left_bytes, right_count, right_bytes;
+  const bool left = child_subtree_stats(node->left, &left_count, &left_bytes);
+  const bool right = child_subtree_stats(node->right, &right_count,
+      &right_bytes);
+
+  if (left && right) {
+    node->set_subtree_stats(1 + left_count + right_count,
+        node->key().size() + node->val().size() + left_bytes + right_bytes);
+  } else {
+    node->clear_subtree_stats();
+  }
+}
+
+// an unchanged child is usually no longer in memory, but its pointer was set
+// from the node when the parent was copied, so its statistics are known
+// without reading it from the log.
+bool PersistentTree::child_subtree_stats(NodePtr& ptr, uint64_t *count,
+    uint64_t *bytes)
+{
+  auto child = ptr.resident_ref();
+  if (!child) {
+    if (ptr.subtree_stats(count, bytes)) {
+      return true;
+    }
+    child = ptr.ref(trace_);
+  }
+
+  update_subtree_stats(child);
+
+  if (!child->has_subtree_stats()) {
+    return false;
+  }
+  *count = child->subtree_count();
+  *bytes = child->subtree_bytes();
+  return true;
 }
 
 void PersistentTree::serialize_intention(cruzdb_proto::AfterImage& i,
     SharedNodeRef node, int& field_index, std::vector<SharedNodeRef>& delta)
 {
-  assert(node != nullptr);
-
-  if (node == Node::Nil() || node->rid() != rid_)
+  if (!node || node == Node::Nil() || node->rid() != rid_)
     return;
 
   // serialize the left side of the tree. after the call returns,
@@ -168,10 +225,10 @@ void PersistentTree::serialize_intention(cruzdb_proto::AfterImage& i,
   // serialized. if the node is non-nil and is a new node in the afterimage,
   // then maybe_left_offset is valid (its validity is checked in
   // serialize_node_ptr).
-  serialize_intention(i, node->left.ref(trace_), field_index, delta);
+  serialize_intention(i, fresh_child(node->left), field_index, delta);
   auto maybe_left_offset = field_index - 1;
 
-  serialize_intention(i, node->right.ref(trace_), field_index, delta);
+  serialize_intention(i, fresh_child(node->right), field_index, delta);
   auto maybe_right_offset = field_index - 1;
 
   // new serialized node in the intention
@@ -219,7 +276,7 @@ SharedNodeRef PersistentTree::insert_recursive(std::deque<SharedNodeRef>& path,
   assert(node != nullptr);
 
   if (node == Node::Nil()) {
-    auto nn = std::make_shared<Node>(key, value, true, Node::Nil(),
+    auto nn = Node::Create(key, value, true, Node::Nil(),
         Node::Nil(), rid_, false, db_);
     path.push_back(nn);
     fresh_nodes_.push_back(nn);
@@ -644,20 +701,34 @@ void PersistentTree::Put(const zlog::Slice& prefixed_key,
   root_ = root;
 }
 
-int PersistentTree::Get(const zlog::Slice& key, std::string* val)
+int PersistentTree::get(const zlog::Slice& key, std::string* val,
+    PinnableSlice *pinned)
 {
   TraceApplier ta(this);
 
-  auto cur = root_ == nullptr ? src_root_.ref(trace_) : root_;
-  while (cur != Node::Nil()) {
+  // nodes below the transaction's own copies belong to the snapshot, and are
+  // visited without taking references.
+  Epoch::Guard guard;
+  NodePtr *link = nullptr;
+  auto cur = root_ == nullptr ? src_root_.get(trace_) : root_.get();
+  while (cur != Node::Nil().get()) {
     int cmp = key.compare(zlog::Slice(cur->key().data(),
           cur->key().size()));
     if (cmp == 0) {
-      val->assign(cur->val().data(), cur->val().size());
+      if (val) {
+        val->assign(cur->val().data(), cur->val().size());
+      } else if (!cur->read_only()) {
+        // the transaction's own copies may be changed by later writes
+        pinned->PinSelf(cur->val());
+      } else {
+        auto node = link ? link->pin() :
+          (root_ != nullptr ? root_ : src_root_.pin());
+        pinned->PinSlice(node->val(), node);
+      }
       return 0;
     }
-    cur = cmp < 0 ? cur->left.ref(trace_) :
-      cur->right.ref(trace_);
+    link = cmp < 0 ? &cur->left : &cur->right;
+    cur = link->get(trace_);
   }
   return -ENOENT;
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "node.h"
 #include "db/cruzdb.pb.h"
+#include "cruzdb/pinnable_slice.h"
 #include <deque>
 #include <sstream>
 #include <atomic>
@@ -82,6 +83,11 @@ class PersistentTree {
     return Get(prefix_string(prefix, key.ToString()), value);
   }
 
+  int Get(const std::string& prefix, const zlog::Slice& key,
+      PinnableSlice *value) {
+    return get(prefix_string(prefix, key.ToString()), nullptr, value);
+  }
+
   void Copy(const zlog::Slice& prefixed_key);
 
   bool ReadOnly() const {
@@ -120,6 +126,9 @@ class PersistentTree {
  public:
   boost::optional<int> infect_self_pointers(uint64_t intention,
       bool expect_intention_rid);
+  // compute the subtree statistics of the new nodes. this must happen before
+  // the tree is visible to readers, and is done by infect_self_pointers.
+  void UpdateSubtreeStats();
   void SerializeAfterImage(cruzdb_proto::AfterImage& i,
       uint64_t intention,
       std::vector<SharedNodeRef>& delta);
@@ -138,6 +147,19 @@ class PersistentTree {
   void serialize_intention(cruzdb_proto::AfterImage& i,
       SharedNodeRef node, int& field_index,
       std::vector<SharedNodeRef>& delta);
+  void update_subtree_stats(SharedNodeRef node);
+  bool child_subtree_stats(NodePtr& ptr, uint64_t *count, uint64_t *bytes);
+
+  // the child if it is a new node of this tree, and null otherwise. new nodes
+  // are held by the tree, so they are always in memory, and the unchanged
+  // children of new nodes don't have to be read to tell them apart.
+  SharedNodeRef fresh_child(NodePtr& ptr) const {
+    auto node = ptr.resident_ref();
+    if (node && node != Node::Nil() && node->rid() == rid_) {
+      return node;
+    }
+    return nullptr;
+  }
 
 
   // tree management
@@ -151,7 +173,12 @@ class PersistentTree {
   }
 
   void Delete(const zlog::Slice& key);
-  int Get(const zlog::Slice& key, std::string *value);
+  int Get(const zlog::Slice& key, std::string *value) {
+    return get(key, value, nullptr);
+  }
+
+  // the value is copied into value if it is set, and otherwise pinned
+  int get(const zlog::Slice& key, std::string *value, PinnableSlice *pinned);
 
   static inline NodePtr& left(SharedNodeRef n) { return n->left; };
   static inline NodePtr& right(SharedNodeRef n) { return n->right; };
@@ -0,0 +1,298 @@
+#include "db/secondary_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+namespace cruzdb {
+
+static const std::string SEGMENT_PREFIX = "ai-";
+static const std::string SEGMENT_SUFFIX = ".seg";
+
+// instance directories are created under a temporary name and renamed once
+// locked, so a directory with the instance prefix is unlocked only if its
+// owner is gone.
+static const std::string INSTANCE_PREFIX = "cache-";
+static const std::string INSTANCE_TEMP_PREFIX = ".tmp-";
+
+static bool has_prefix(const std::string& name, const std::string& prefix)
+{
+  return name.compare(0, prefix.size(), prefix) == 0;
+}
+
+static bool is_segment(const std::string& name)
+{
+  return name.size() > SEGMENT_PREFIX.size() + SEGMENT_SUFFIX.size() &&
+    has_prefix(name, SEGMENT_PREFIX) &&
+    name.compare(name.size() - SEGMENT_SUFFIX.size(),
+        SEGMENT_SUFFIX.size(), SEGMENT_SUFFIX) == 0;
+}
+
+static void remove_segments(const std::string& path)
+{
+  DIR *dir = opendir(path.c_str());
+  if (dir) {
+    while (auto *ent = readdir(dir)) {
+      const std::string name = ent->d_name;
+      if (is_segment(name)) {
+        unlink((path + "/" + name).c_str());
+      }
+    }
+    closedir(dir);
+  }
+}
+
+SecondaryCache::Segment::~Segment()
+{
+  close(fd);
+  unlink(path.c_str());
+}
+
+SecondaryCache::SecondaryCache(const std::string& path, size_t capacity,
+    size_t segment_size, Statistics *stats) :
+  path_(path),
+  instance_fd_(-1),
+  capacity_(capacity),
+  segment_size_(segment_size),
+  stats_(stats),
+  next_segment_id_(0),
+  used_bytes_(0)
+{
+  int ret = mkdir(path_.c_str(), 0755);
+  if (ret && errno != EEXIST) {
+    std::cerr << "secondary cache: failed to create " << path_
+      << ": " << strerror(errno) << std::endl;
+  }
+
+  remove_stale_instances();
+  create_instance();
+}
+
+SecondaryCache::~SecondaryCache()
+{
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    index_.clear();
+    segments_.clear();
+  }
+
+  if (instance_fd_ >= 0) {
+    rmdir(instance_path_.c_str());
+    close(instance_fd_);
+  }
+}
+
+// remove the segments of instances that exited without cleaning up. a live
+// instance holds the lock on its directory.
+void SecondaryCache::remove_stale_instances()
+{
+  DIR *dir = opendir(path_.c_str());
+  if (!dir) {
+    return;
+  }
+
+  while (auto *ent = readdir(dir)) {
+    const std::string name = ent->d_name;
+    if (!has_prefix(name, INSTANCE_PREFIX)) {
+      continue;
+    }
+
+    const auto instance_path = path_ + "/" + name;
+    int fd = open(instance_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      remove_segments(instance_path);
+      rmdir(instance_path.c_str());
+    }
+
+    close(fd);
+  }
+
+  closedir(dir);
+}
+
+// create and lock this instance's directory. if it can't be created segments
+// fail to open, and the cache is empty.
+void SecondaryCache::create_instance()
+{
+  std::string temp_path = path_ + "/" + INSTANCE_TEMP_PREFIX + "XXXXXX";
+  if (!mkdtemp(&temp_path[0])) {
+    std::cerr << "secondary cache: failed to create instance in " << path_
+      << ": " << strerror(errno) << std::endl;
+    return;
+  }
+
+  int fd = open(temp_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+    std::cerr << "secondary cache: failed to lock " << temp_path
+      << ": " << strerror(errno) << std::endl;
+    if (fd >= 0)
+      close(fd);
+    rmdir(temp_path.c_str());
+    return;
+  }
+
+  const auto suffix = temp_path.substr(temp_path.size() - 6);
+  const auto instance_path = path_ + "/" + INSTANCE_PREFIX + suffix;
+  if (rename(temp_path.c_str(), instance_path.c_str())) {
+    std::cerr << "secondary cache: failed to rename " << temp_path
+      << ": " << strerror(errno) << std::endl;
+    close(fd);
+    rmdir(temp_path.c_str());
+    return;
+  }
+
+  instance_path_ = instance_path;
+  instance_fd_ = fd;
+}
+
+std::shared_ptr<SecondaryCache::Segment> SecondaryCache::new_segment()
+{
+  if (instance_fd_ < 0) {
+    return nullptr;
+  }
+
+  std::stringstream name;
+  name << instance_path_ << "/" << SEGMENT_PREFIX << next_segment_id_++
+    << SEGMENT_SUFFIX;
+  const auto path = name.str();
+
+  int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "secondary cache: failed to open " << path
+      << ": " << strerror(errno) << std::endl;
+    return nullptr;
+  }
+
+  return std::make_shared<Segment>(fd, path);
+}
+
+// drop the oldest segments until the cache is within its budget. the segment
+// being filled is never dropped.
+void SecondaryCache::evict()
+{
+  while (used_bytes_ > capacity_ && segments_.size() > 1) {
+    auto segment = segments_.front();
+    segments_.pop_front();
+    used_bytes_ -= segment->size;
+    for (const auto pos : segment->positions) {
+      auto it = index_.find(pos);
+      if (it != index_.end() && it->second.segment == segment) {
+        index_.erase(it);
+      }
+    }
+    RecordTick(stats_, SECONDARY_CACHE_EVICT);
+  }
+}
+
+bool SecondaryCache::Lookup(uint64_t pos, std::string *data)
+{
+  Location loc;
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    auto it = index_.find(pos);
+    if (it == index_.end()) {
+      RecordTick(stats_, SECONDARY_CACHE_MISS);
+      return false;
+    }
+    loc = it->second;
+  }
+
+  // the location holds a reference to the segment, so its file remains valid
+  // even if the segment is evicted while reading.
+  data->resize(loc.size);
+  size_t done = 0;
+  while (done < loc.size) {
+    ssize_t ret = pread(loc.segment->fd, &(*data)[done],
+        loc.size - done, loc.offset + done);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR)
+        continue;
+      RecordTick(stats_, SECONDARY_CACHE_MISS);
+      return false;
+    }
+    done += ret;
+  }
+
+  RecordTick(stats_, SECONDARY_CACHE_HIT);
+  return true;
+}
+
+void SecondaryCache::Insert(uint64_t pos, const std::string& data)
+{
+  if (data.empty() || data.size() > segment_size_) {
+    return;
+  }
+
+  // reserve space in the active segment
+  std::shared_ptr<Segment> segment;
+  off_t offset;
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+
+    if (index_.find(pos) != index_.end()) {
+      return;
+    }
+
+    if (segments_.empty() ||
+        (segments_.back()->size + data.size()) > segment_size_) {
+      auto new_seg = new_segment();
+      if (!new_seg) {
+        return;
+      }
+      segments_.emplace_back(std::move(new_seg));
+    }
+
+    segment = segments_.back();
+    offset = segment->size;
+    segment->size += data.size();
+    used_bytes_ += data.size();
+
+    evict();
+  }
+
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t ret = pwrite(segment->fd, data.data() + done,
+        data.size() - done, offset + done);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    done += ret;
+  }
+
+  // the entry becomes visible only after it has been written
+  std::lock_guard<std::mutex> lk(lock_);
+  if (segments_.empty() || segments_.back() != segment) {
+    // only the active segment is written to, so if it is no longer at the back
+    // of the queue check that it wasn't evicted while the write was running.
+    bool found = false;
+    for (const auto& seg : segments_) {
+      if (seg == segment) {
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      return;
+    }
+  }
+
+  auto ret = index_.emplace(pos, Location{segment, offset, data.size()});
+  if (ret.second) {
+    segment->positions.emplace_back(pos);
+    RecordTick(stats_, SECONDARY_CACHE_INSERT);
+  }
+}
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "monitoring/statistics.h"
+
+namespace cruzdb {
+
+// A cache of raw log entries stored on local storage. It sits below the
+// in-memory caches and in front of the log, which for distributed backends
+// costs a network round-trip per read.
+//
+// Entries are appended to fixed-size segment files and located by an
+// in-memory index from log position to (segment, offset, length). Log entries
+// are immutable once written, so entries never need to be invalidated. When
+// the byte budget is exceeded the oldest segment is dropped as a whole.
+//
+// Several caches may share a path. Each instance keeps its segments in its
+// own subdirectory, and holds a lock on it for as long as the cache exists.
+// The index isn't persisted, so subdirectories left behind by instances that
+// no longer hold their lock are removed when a cache is created.
+//
+// I/O errors are never fatal: a failed write drops the entry, and a failed
+// read is reported as a miss.
+class SecondaryCache {
+ public:
+  SecondaryCache(const std::string& path, size_t capacity,
+      size_t segment_size, Statistics *stats);
+
+  ~SecondaryCache();
+
+  SecondaryCache(const SecondaryCache& other) = delete;
+  SecondaryCache& operator=(const SecondaryCache& other) = delete;
+
+  // read the entry at the log position into data. returns false on a miss.
+  bool Lookup(uint64_t pos, std::string *data);
+
+  // add the entry at the log position
+  void Insert(uint64_t pos, const std::string& data);
+
+ private:
+  struct Segment {
+    Segment(int fd, const std::string& path) :
+      fd(fd), path(path), size(0)
+    {}
+
+    // the file is removed once the segment is evicted and no reader is still
+    // using it.
+    ~Segment();
+
+    const int fd;
+    const std::string path;
+    size_t size;
+    std::vector<uint64_t> positions;
+  };
+
+  struct Location {
+    std::shared_ptr<Segment> segment;
+    off_t offset;
+    size_t size;
+  };
+
+  std::shared_ptr<Segment> new_segment();
+  void evict();
+
+  void remove_stale_instances();
+  void create_instance();
+
+  const std::string path_;
+  std::string instance_path_;
+  int instance_fd_;
+  const size_t capacity_;
+  const size_t segment_size_;
+  Statistics *stats_;
+
+  std::mutex lock_;
+  uint64_t next_segment_id_;
+  size_t used_bytes_;
+  std::unordered_map<uint64_t, Location> index_;
+  std::deque<std::shared_ptr<Segment>> segments_; // oldest first
+};
+
+}
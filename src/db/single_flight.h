@@ -0,0 +1,85 @@
+#pragma once
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace cruzdb {
+
+// Coalesces concurrent calls that produce the same value. The first caller for
+// a key runs the call, and callers arriving while it is in flight wait for
+// and share its result instead of repeating the work. Once the call completes
+// the key is forgotten, so later callers start a new call. If the call throws,
+// the exception is rethrown to each of its callers.
+template <typename Key, typename Value>
+class SingleFlight {
+ public:
+  // return the result of fn() for key. if shared is non-null it is set to true
+  // when the result was produced by another caller's in-flight call.
+  template <typename Fn>
+  Value Do(const Key& key, Fn&& fn, bool *shared = nullptr) {
+    std::unique_lock<std::mutex> lk(lock_);
+
+    auto it = calls_.find(key);
+    if (it != calls_.end()) {
+      auto call = it->second;
+      call->cond.wait(lk, [&] { return call->done; });
+      if (shared)
+        *shared = true;
+      if (call->error)
+        std::rethrow_exception(call->error);
+      return call->value;
+    }
+
+    auto call = std::make_shared<Call>();
+    calls_.emplace(key, call);
+    lk.unlock();
+
+    // the key is cleared and waiters are woken even if fn throws
+    Completion completion(this, key, call);
+    try {
+      call->value = fn();
+    } catch (...) {
+      call->error = std::current_exception();
+      throw;
+    }
+
+    if (shared)
+      *shared = false;
+    return call->value;
+  }
+
+ private:
+  struct Call {
+    std::condition_variable cond;
+    bool done = false;
+    Value value;
+    std::exception_ptr error;
+  };
+
+  class Completion {
+   public:
+    Completion(SingleFlight *sf, const Key& key, std::shared_ptr<Call> call) :
+      sf_(sf), key_(key), call_(std::move(call))
+    {}
+
+    ~Completion() {
+      std::unique_lock<std::mutex> lk(sf_->lock_);
+      call_->done = true;
+      sf_->calls_.erase(key_);
+      lk.unlock();
+      call_->cond.notify_all();
+    }
+
+   private:
+    SingleFlight *sf_;
+    const Key key_;
+    std::shared_ptr<Call> call_;
+  };
+
+  std::mutex lock_;
+  std::unordered_map<Key, std::shared_ptr<Call>> calls_;
+};
+
+}
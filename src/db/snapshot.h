@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -6,14 +7,29 @@
 
 namespace cruzdb {
 
+// Snapshots are reference counted. The reference returned by the database is
+// dropped by DB::ReleaseSnapshot, and each iterator holds its own, so a
+// snapshot may be released while iterators reading it are still open.
 class Snapshot {
  public:
   Snapshot(DBImpl *db, const NodePtr root) :
-    db(db), root(root)
+    db(db), root(root), refs_(1)
   {}
 
+  void Ref() {
+    refs_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // returns true when the last reference was dropped
+  bool Unref() {
+    return refs_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
   DBImpl *db;
   NodePtr root;
+
+ private:
+  std::atomic<int> refs_;
 };
 
 }
@@ -1,12 +1,28 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <sstream>
+#include <stdexcept>
 #include <random>
+#include <thread>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <spdlog/spdlog.h>
 #include "cruzdb/db.h"
+#include "cruzdb/statistics.h"
+#include "db/db_impl.h"
+#include "db/entry_cache.h"
+#include "db/entry_service.h"
+#include "db/epoch.h"
+#include "db/secondary_cache.h"
+#include "db/single_flight.h"
 #include <zlog/log.h>
 #include "port/stack_trace.h"
 
@@ -39,6 +55,90 @@ static inline std::string tostr(int value)
   return ss.str();
 }
 
+// delegates to another log, with knobs for injecting the conditions that the
+// log i/o paths have to handle
+class FaultyLog : public zlog::Log {
+ public:
+  explicit FaultyLog(zlog::Log *log) :
+    log_(log)
+  {}
+
+  ~FaultyLog() {
+    for (auto& thread : delayed_reads_) {
+      thread.join();
+    }
+  }
+
+  // report the tail this many positions past the last written position, as
+  // if those positions had been handed out to appenders that haven't written
+  std::atomic<uint64_t> unwritten_tail{0};
+
+  // asynchronous reads of even positions are issued after a delay, so that
+  // they complete after reads issued later
+  std::atomic<bool> delay_even_reads{false};
+  std::atomic<uint64_t> delayed_reads{0};
+
+  // asynchronous appends fail to be issued
+  std::atomic<bool> fail_aio_appends{false};
+  std::atomic<uint64_t> failed_aio_appends{0};
+  std::atomic<uint64_t> sync_appends{0};
+
+  int CheckTail(uint64_t *pposition) override {
+    int ret = log_->CheckTail(pposition);
+    if (ret == 0) {
+      *pposition += unwritten_tail;
+    }
+    return ret;
+  }
+
+  int Read(uint64_t position, std::string *data) override {
+    return log_->Read(position, data);
+  }
+
+  int Append(const zlog::Slice& data, uint64_t *pposition) override {
+    sync_appends++;
+    return log_->Append(data, pposition);
+  }
+
+  int Fill(uint64_t position) override {
+    return log_->Fill(position);
+  }
+
+  int Trim(uint64_t position) override {
+    return log_->Trim(position);
+  }
+
+  int AioAppend(zlog::AioCompletion *c, const zlog::Slice& data,
+      uint64_t *pposition) override {
+    if (fail_aio_appends) {
+      failed_aio_appends++;
+      return -EIO;
+    }
+    return log_->AioAppend(c, data, pposition);
+  }
+
+  int AioRead(uint64_t position, zlog::AioCompletion *c,
+      std::string *datap) override {
+    if (delay_even_reads && position % 2 == 0) {
+      delayed_reads++;
+      std::lock_guard<std::mutex> lk(lock_);
+      delayed_reads_.emplace_back([this, position, c, datap] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        int ret = log_->AioRead(position, c, datap);
+        assert(ret == 0);
+        (void)ret;
+      });
+      return 0;
+    }
+    return log_->AioRead(position, c, datap);
+  }
+
+ private:
+  zlog::Log *log_;
+  std::mutex lock_;
+  std::vector<std::thread> delayed_reads_;
+};
+
 static std::map<std::string, std::string> get_map(cruzdb::DB *db,
     cruzdb::Snapshot *snapshot, bool forward, size_t split)
 {
@@ -295,7 +395,7 @@ TEST(DB, Iterator) {
   delete log;
 }
 
-TEST(DB, Get) {
+TEST(DB, IteratorNoFillCache) {
   TempDir tdir;
 
   zlog::Log *log;
@@ -307,105 +407,220 @@ TEST(DB, Get) {
   ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
 
-  std::vector<std::string> strs{"a", "b", ""};
-  for (auto s : strs) {
+  std::map<std::string, std::string> truth;
+  for (int i = 0; i < 100; i++) {
     auto txn = db->BeginTransaction();
-    txn->Put(s, s.empty() ? "Empty key" : s);
+    auto key = tostr(i);
+    txn->Put(key, key);
+    truth[key] = key;
     txn->Commit();
+    delete txn;
   }
 
-  auto txn = db->BeginTransaction();
-  std::string val;
+  cruzdb::ReadOptions read_options;
+  read_options.fill_cache = false;
 
-  // empty key
-  ret = txn->Get("", &val);
+  std::map<std::string, std::string> found;
+  auto it = db->NewIterator(read_options);
+  it->SeekToFirst();
+  while (it->Valid()) {
+    found[it->key().ToString()] = it->value().ToString();
+    it->Next();
+  }
+  delete it;
+
+  ASSERT_EQ(found, truth);
+
+  delete db;
+
+  // with a cold cache a scan that doesn't fill it reads each after image once,
+  // like a scan that does.
+  auto stats = cruzdb::CreateDBStatistics();
+  options.statistics = stats;
+  ret = cruzdb::DB::Open(options, log, false, &db);
   ASSERT_EQ(ret, 0);
-  ASSERT_EQ(val, "Empty key");
 
-  // c does not exist
-  ret = txn->Get("c", &val);
-  ASSERT_EQ(ret, -ENOENT);
+  read_options.snapshot = db->GetSnapshot();
 
-  // a exists
-  ret = txn->Get("a", &val);
+  auto scan = [&](bool fill_cache) {
+    read_options.fill_cache = fill_cache;
+    const auto reads = stats->getTickerCount(cruzdb::LOG_READS);
+    std::map<std::string, std::string> found;
+    auto it = db->NewIterator(read_options);
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      found[it->key().ToString()] = it->value().ToString();
+    }
+    delete it;
+    EXPECT_EQ(found, truth);
+    return stats->getTickerCount(cruzdb::LOG_READS) - reads;
+  };
+
+  const auto nodes_read = stats->getTickerCount(cruzdb::NODE_CACHE_NODES_READ);
+  const auto uncached_reads = scan(false);
+  ASSERT_GT(uncached_reads, 0u);
+  ASSERT_LT(uncached_reads,
+      stats->getTickerCount(cruzdb::NODE_CACHE_NODES_READ) - nodes_read);
+
+  // nothing was cached, so the after images are all read again
+  ASSERT_EQ(scan(false), uncached_reads);
+  ASSERT_EQ(scan(true), uncached_reads);
+
+  db->ReleaseSnapshot(read_options.snapshot);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, IteratorReadAhead) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
   ASSERT_EQ(ret, 0);
-  ASSERT_EQ(val, "a");
 
-  // b exists
-  ret = txn->Get("b", &val);
+  // most of the tree is read from the log by the scans
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.node_cache_size = 64*1024;
+  options.node_cache_pinned_levels = 0;
+  ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
-  ASSERT_EQ(val, "b");
 
-  txn->Commit();
+  std::map<std::string, std::string> truth;
+  for (int i = 0; i < 500; i++) {
+    auto txn = db->BeginTransaction();
+    auto key = tostr(i);
+    txn->Put(key, key);
+    truth[key] = key;
+    txn->Commit();
+    delete txn;
+  }
+
+  cruzdb::ReadOptions read_options;
+  read_options.readahead_size = 64*1024;
+
+  std::map<std::string, std::string> found;
+  auto it = db->NewIterator(read_options);
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    found[it->key().ToString()] = it->value().ToString();
+  }
+  ASSERT_EQ(found, truth);
+
+  found.clear();
+  for (it->SeekToLast(); it->Valid(); it->Prev()) {
+    found[it->key().ToString()] = it->value().ToString();
+  }
+  ASSERT_EQ(found, truth);
+  delete it;
 
   delete db;
   delete log;
 }
 
-TEST(DB, ReOpen) {
+TEST(DB, IteratorReadAheadInBackground) {
   TempDir tdir;
 
-  // populate a database and close it
-  std::map<std::string, std::string> prev_db;
-  {
-    zlog::Log *log;
-    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
-    ASSERT_EQ(ret, 0);
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
 
-    cruzdb::DB *db;
-    cruzdb::Options options;
-    ret = cruzdb::DB::Open(options, log, true, &db);
-    ASSERT_EQ(0, ret);
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
 
-    for (int i = 0; i < 150; i++) {
-      std::stringstream ss;
-      ss << "key-" << i;
-      std::string key = ss.str();
-      ss << "-val";
-      std::string val = ss.str();
+  for (int i = 0; i < 300; i++) {
+    auto *txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
 
-      auto *txn = db->BeginTransaction();
+  delete db;
 
-      std::string val_out;
-      ret = txn->Get(key, &val_out);
-      ASSERT_EQ(-ENOENT, ret);
+  // after reopening, most of the tree is only in the log
+  auto stats = cruzdb::CreateDBStatistics();
+  options.statistics = stats;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(0, ret);
 
-      txn->Put(key, val);
-      prev_db[key] = val;
+  cruzdb::ReadOptions read_options;
+  read_options.readahead_size = 1 << 16;
 
-      txn->Commit();
-      delete txn;
-    }
+  int i = 0;
+  auto it = db->NewIterator(read_options);
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    ASSERT_EQ(it->key().ToString(), tostr(i));
+    i++;
+  }
+  ASSERT_EQ(i, 300);
+  delete it;
+
+  // iterators are closed without waiting for their read-ahead
+  for (int j = 0; j < 100; j++) {
+    it = db->NewIterator(read_options);
+    it->Seek(tostr(j));
+    ASSERT_TRUE(it->Valid());
+    it->Next();
+    delete it;
+  }
 
-    delete db;
-    delete log;
+  while (stats->getTickerCount(cruzdb::ITERATOR_READAHEAD_AFTER_IMAGES) == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
   }
+  ASSERT_GT(stats->getTickerCount(cruzdb::ITERATOR_READAHEAD_BYTES), 0u);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, IteratorPinnedBytes) {
+  TempDir tdir;
 
-  // re-open the database and verify the previous inserts
   zlog::Log *log;
-  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
   ASSERT_EQ(ret, 0);
 
+  auto stats = cruzdb::CreateDBStatistics();
   cruzdb::DB *db;
   cruzdb::Options options;
-  ret = cruzdb::DB::Open(options, log, false, &db);
+  options.statistics = stats;
+  ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
 
-  std::map<std::string, std::string> curr_db;
-  auto *it = db->NewIterator();
-  it->SeekToFirst();
-  while (it->Valid()) {
-    curr_db[it->key().ToString()] = it->value().ToString();
-    it->Next();
+  for (int i = 0; i < 100; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
   }
 
-  ASSERT_EQ(curr_db, prev_db);
+  // small changes aren't reported while the iterator moves
+  auto it = db->NewIterator();
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    ASSERT_EQ(stats->getTickerCount(cruzdb::ITERATOR_PINNED_BYTES), 0u);
+  }
+  delete it;
+  ASSERT_EQ(stats->getTickerCount(cruzdb::ITERATOR_PINNED_BYTES), 0u);
+
+  auto txn = db->BeginTransaction();
+  txn->Put("big", std::string(1 << 20, 'x'));
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  // a large change is reported right away, and everything on close
+  it = db->NewIterator();
+  it->Seek("big");
+  ASSERT_TRUE(it->Valid());
+  ASSERT_GT(stats->getTickerCount(cruzdb::ITERATOR_PINNED_BYTES), 1u << 20);
+  delete it;
+  ASSERT_EQ(stats->getTickerCount(cruzdb::ITERATOR_PINNED_BYTES), 0u);
 
   delete db;
   delete log;
 }
 
-TEST(Txn, WriteWriteConflict) {
+TEST(DB, IteratorBounds) {
   TempDir tdir;
 
   zlog::Log *log;
@@ -417,28 +632,59 @@ TEST(Txn, WriteWriteConflict) {
   ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
 
-  // note this txn+commit causes the next two transactions created to have
-  // snapshots > 0. the initialization case is handled below in the *SnapInit
-  // variants.
-  auto txn0 = db->BeginTransaction();
-  txn0->Put("foo", "foo");
-  txn0->Commit();
+  for (int i = 0; i < 10; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
 
-  auto txn1 = db->BeginTransaction();
-  auto txn2 = db->BeginTransaction();
-  // TODO: assert snapshot property
+  const zlog::Slice lower("003");
+  const zlog::Slice upper("007");
+  cruzdb::ReadOptions read_options;
+  read_options.iterate_lower_bound = &lower;
+  read_options.iterate_upper_bound = &upper;
 
-  txn1->Put("bar", "bar");
-  txn2->Put("bar", "baz");
+  std::vector<std::string> keys;
+  auto it = db->NewIterator(read_options);
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    keys.push_back(it->key().ToString());
+  }
+  ASSERT_EQ(keys, (std::vector<std::string>{"003", "004", "005", "006"}));
 
-  ASSERT_TRUE(txn1->Commit());
-  ASSERT_FALSE(txn2->Commit());
+  keys.clear();
+  for (it->SeekToLast(); it->Valid(); it->Prev()) {
+    keys.push_back(it->key().ToString());
+  }
+  ASSERT_EQ(keys, (std::vector<std::string>{"006", "005", "004", "003"}));
+
+  it->Seek("001");
+  ASSERT_TRUE(it->Valid());
+  ASSERT_EQ(it->key().ToString(), "003");
+  it->Seek("008");
+  ASSERT_FALSE(it->Valid());
+  delete it;
+
+  // reads from a snapshot don't see later commits
+  auto snapshot = db->GetSnapshot();
+  auto txn = db->BeginTransaction();
+  txn->Put("010", "010");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  std::string val;
+  cruzdb::ReadOptions snapshot_options;
+  snapshot_options.snapshot = snapshot;
+  ASSERT_EQ(db->Get(snapshot_options, "010", &val), -ENOENT);
+  ASSERT_EQ(db->Get(snapshot_options, "009", &val), 0);
+  ASSERT_EQ(db->Get("010", &val), 0);
+  db->ReleaseSnapshot(snapshot);
 
   delete db;
   delete log;
 }
 
-TEST(Txn, WriteWriteNoConflict) {
+TEST(DB, PartitionedIterators) {
   TempDir tdir;
 
   zlog::Log *log;
@@ -447,33 +693,67 @@ TEST(Txn, WriteWriteNoConflict) {
 
   cruzdb::DB *db;
   cruzdb::Options options;
-  ret = cruzdb::DB::Open(options, log, true, &db, logger);
+  ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
 
-  // note this txn+commit causes the next two transactions created to have
-  // snapshots > 0. the initialization case is handled below in the *SnapInit
-  // variants.
-  auto txn0 = db->BeginTransaction();
-  txn0->Put("foo", "foo");
-  txn0->Commit();
-
-  auto txn1 = db->BeginTransaction();
-  auto txn2 = db->BeginTransaction();
-  // TODO: assert snapshot property
+  std::vector<std::string> truth;
+  for (int i = 0; i < 300; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+    truth.push_back(tostr(i));
+  }
 
-  txn1->Put("bar", "bar");
-  txn2->Put("baz", "baz");
+  auto iterators = db->NewPartitionedIterators(cruzdb::ReadOptions(), 4);
+  ASSERT_GT(iterators.size(), 1u);
+  ASSERT_LE(iterators.size(), 4u);
+
+  // scan the partitions concurrently
+  std::vector<std::vector<std::string>> partitions(iterators.size());
+  std::vector<std::thread> scanners;
+  for (size_t i = 0; i < iterators.size(); i++) {
+    scanners.emplace_back([&, i] {
+      auto it = iterators[i];
+      for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        partitions[i].push_back(it->key().ToString());
+      }
+    });
+  }
+  for (auto& scanner : scanners) {
+    scanner.join();
+  }
 
-  ASSERT_TRUE(txn2->Commit());
-  ASSERT_TRUE(txn1->Commit());
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < partitions.size(); i++) {
+    ASSERT_FALSE(partitions[i].empty());
+    keys.insert(keys.end(), partitions[i].begin(), partitions[i].end());
+    delete iterators[i];
+  }
+  ASSERT_EQ(keys, truth);
+
+  // bounds of the iteration apply to the partitions
+  const zlog::Slice lower("100");
+  const zlog::Slice upper("200");
+  cruzdb::ReadOptions read_options;
+  read_options.iterate_lower_bound = &lower;
+  read_options.iterate_upper_bound = &upper;
+
+  keys.clear();
+  for (auto it : db->NewPartitionedIterators(read_options, 3)) {
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      keys.push_back(it->key().ToString());
+    }
+    delete it;
+  }
+  ASSERT_EQ(keys, std::vector<std::string>(truth.begin() + 100,
+        truth.begin() + 200));
 
   delete db;
   delete log;
 }
 
-// the two transactions created will both have intention zero as their snapshot,
-// exercising initialization edge cases.
-TEST(Txn, WriteWriteConflictSnapInit) {
+TEST(DB, CountAndRank) {
   TempDir tdir;
 
   zlog::Log *log;
@@ -485,23 +765,58 @@ TEST(Txn, WriteWriteConflictSnapInit) {
   ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
 
-  auto txn1 = db->BeginTransaction();
-  auto txn2 = db->BeginTransaction();
-  // TODO: assert snapshot property
+  for (int i = 0; i < 100; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
 
-  txn1->Put("bar", "bar");
-  txn2->Put("bar", "baz");
+  ASSERT_EQ(db->Count(cruzdb::ReadOptions()), 100u);
 
-  ASSERT_TRUE(txn1->Commit());
-  ASSERT_FALSE(txn2->Commit());
+  const zlog::Slice lower("010");
+  const zlog::Slice upper("020");
+  cruzdb::ReadOptions read_options;
+  read_options.iterate_lower_bound = &lower;
+  read_options.iterate_upper_bound = &upper;
+  ASSERT_EQ(db->Count(read_options), 10u);
+
+  // keys are stored with a two byte prefix
+  ASSERT_EQ(db->GetApproximateSize(read_options), 10u * (2 + 3 + 3));
+
+  for (int i = 10; i < 20; i += 2) {
+    auto txn = db->BeginTransaction();
+    txn->Delete(tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+  ASSERT_EQ(db->Count(read_options), 5u);
+  ASSERT_EQ(db->Count(cruzdb::ReadOptions()), 95u);
+
+  auto it = db->NewIterator();
+  it->SeekToRank(42);
+  ASSERT_TRUE(it->Valid());
+  ASSERT_EQ(it->key().ToString(), "047");
+  it->Next();
+  ASSERT_EQ(it->key().ToString(), "048");
+  it->SeekToRank(95);
+  ASSERT_FALSE(it->Valid());
+  delete it;
+
+  // ranks are relative to the lower bound
+  it = db->NewIterator(read_options);
+  it->SeekToRank(2);
+  ASSERT_TRUE(it->Valid());
+  ASSERT_EQ(it->key().ToString(), "015");
+  it->SeekToRank(5);
+  ASSERT_FALSE(it->Valid());
+  delete it;
 
   delete db;
   delete log;
 }
 
-// the two transactions created will both have intention zero as their snapshot,
-// exercising initialization edge cases.
-TEST(Txn, WriteWriteNoConflictSnapInit) {
+TEST(DB, CountMatchesSnapshot) {
   TempDir tdir;
 
   zlog::Log *log;
@@ -510,23 +825,1895 @@ TEST(Txn, WriteWriteNoConflictSnapInit) {
 
   cruzdb::DB *db;
   cruzdb::Options options;
-  ret = cruzdb::DB::Open(options, log, true, &db, logger);
+  ret = cruzdb::DB::Open(options, log, true, &db);
   ASSERT_EQ(ret, 0);
 
-  auto txn1 = db->BeginTransaction();
-  auto txn2 = db->BeginTransaction();
-  // TODO: assert snapshot property
+  // the statistics of a snapshot are complete as soon as it is visible, while
+  // the writer keeps changing the tree
+  std::atomic<bool> stop(false);
+  std::thread writer([&] {
+    for (int i = 0; i < 300; i++) {
+      auto txn = db->BeginTransaction();
+      txn->Put(tostr(i), tostr(i));
+      if (i % 3 == 0) {
+        txn->Delete(tostr(i / 2));
+      }
+      EXPECT_TRUE(txn->Commit());
+      delete txn;
+    }
+    stop = true;
+  });
 
-  txn1->Put("bar", "bar");
-  txn2->Put("baz", "baz");
+  while (!stop) {
+    auto snapshot = db->GetSnapshot();
+    cruzdb::ReadOptions read_options;
+    read_options.snapshot = snapshot;
 
-  ASSERT_TRUE(txn2->Commit());
-  ASSERT_TRUE(txn1->Commit());
+    uint64_t count = 0;
+    auto it = db->NewIterator(snapshot);
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      count++;
+    }
+    delete it;
+
+    EXPECT_EQ(db->Count(read_options), count);
+    db->ReleaseSnapshot(snapshot);
+  }
+
+  writer.join();
 
   delete db;
   delete log;
 }
 
+TEST(DB, CountWithEvictedSiblings) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  // most of the unchanged siblings of each transaction's path have been
+  // evicted by the time its statistics are computed
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = stats;
+  options.node_cache_size = 64*1024;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  for (int i = 0; i < 300; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    if (i % 3 == 0) {
+      txn->Delete(tostr(i / 2));
+    }
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  auto impl = static_cast<cruzdb::DBImpl*>(db);
+
+  // the count only reads the paths to the ends of the range, which it can
+  // only do if the statistics are complete
+  impl->ClearCaches();
+  auto reads = stats->getTickerCount(cruzdb::LOG_READS);
+  const auto count = db->Count(cruzdb::ReadOptions());
+  const auto count_reads = stats->getTickerCount(cruzdb::LOG_READS) - reads;
+
+  impl->ClearCaches();
+  reads = stats->getTickerCount(cruzdb::LOG_READS);
+  uint64_t scanned = 0;
+  auto it = db->NewIterator();
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    scanned++;
+  }
+  delete it;
+  const auto scan_reads = stats->getTickerCount(cruzdb::LOG_READS) - reads;
+
+  ASSERT_EQ(count, scanned);
+  ASSERT_LT(count_reads * 4, scan_reads);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, PinnedGet) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn = db->BeginTransaction();
+  txn->Put("a", "1");
+  txn->Put("b", "2");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  cruzdb::PinnableSlice value;
+  ASSERT_EQ(db->Get("z", &value), -ENOENT);
+  ASSERT_EQ(db->Get("a", &value), 0);
+  ASSERT_TRUE(value.IsPinned());
+  ASSERT_EQ(value.ToString(), "1");
+
+  // the pinned value outlives the version of the tree it was read from
+  txn = db->BeginTransaction();
+  txn->Put("a", "3");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  ASSERT_EQ(value.ToString(), "1");
+  ASSERT_EQ(db->Get("a", &value), 0);
+  ASSERT_EQ(value.ToString(), "3");
+
+  // a transaction's own writes are copied, and snapshot values are pinned
+  txn = db->BeginTransaction();
+  txn->Put("c", "c");
+  cruzdb::PinnableSlice own, snap;
+  ASSERT_EQ(txn->Get("c", &own), 0);
+  ASSERT_FALSE(own.IsPinned());
+  txn->Put("c", "d");
+  ASSERT_EQ(own.ToString(), "c");
+  ASSERT_EQ(txn->Get("b", &snap), 0);
+  ASSERT_TRUE(snap.IsPinned());
+  ASSERT_EQ(snap.ToString(), "2");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  auto it = db->NewIterator();
+  it->Seek("b");
+  ASSERT_TRUE(it->Valid());
+  it->value(&value);
+  delete it;
+  ASSERT_EQ(value.ToString(), "2");
+
+  value.Reset();
+  own.Reset();
+  snap.Reset();
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, PinnedGetNoFillCache) {
+  TempDir tdir;
+
+  // populate a database and close it, so its nodes are read from the log
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    cruzdb::Options options;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(ret, 0);
+
+    for (int i = 0; i < 100; i++) {
+      auto key = tostr(i);
+      auto txn = db->BeginTransaction();
+      txn->Put(key, key + "-val");
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+    }
+
+    delete db;
+    delete log;
+  }
+
+  zlog::Log *log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::Options options;
+  options.statistics = stats;
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::ReadOptions read_options;
+  read_options.fill_cache = false;
+
+  // nothing is cached, so both lookups read the same nodes. the pinned node
+  // isn't read a second time to take the reference.
+  for (int i = 0; i < 100; i += 7) {
+    const auto key = tostr(i);
+
+    auto fetches = stats->getTickerCount(cruzdb::NODE_CACHE_FETCHES);
+    std::string value;
+    ASSERT_EQ(db->Get(read_options, key, &value), 0);
+    ASSERT_EQ(value, key + "-val");
+    const auto copy_fetches =
+      stats->getTickerCount(cruzdb::NODE_CACHE_FETCHES) - fetches;
+
+    fetches = stats->getTickerCount(cruzdb::NODE_CACHE_FETCHES);
+    cruzdb::PinnableSlice pinned;
+    ASSERT_EQ(db->Get(read_options, key, &pinned), 0);
+    ASSERT_TRUE(pinned.IsPinned());
+    ASSERT_EQ(pinned.ToString(), key + "-val");
+    ASSERT_EQ(stats->getTickerCount(cruzdb::NODE_CACHE_FETCHES) - fetches,
+        copy_fetches);
+  }
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, IteratorOwnsSnapshot) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn = db->BeginTransaction();
+  txn->Put("a", "a");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  // the iterator keeps the snapshot alive after it is released
+  auto snapshot = db->GetSnapshot();
+  auto it = db->NewIterator(snapshot);
+  db->ReleaseSnapshot(snapshot);
+
+  txn = db->BeginTransaction();
+  txn->Put("b", "b");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid());
+  ASSERT_EQ(it->key().ToString(), "a");
+  it->Next();
+  ASSERT_FALSE(it->Valid());
+  delete it;
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, IteratorRebase) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  for (auto key : {"a", "c", "e"}) {
+    auto txn = db->BeginTransaction();
+    txn->Put(key, key);
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  cruzdb::ReadOptions read_options;
+  read_options.rebase_interval = 1;
+  auto it = db->NewIterator(read_options);
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid());
+  ASSERT_EQ(it->key().ToString(), "a");
+
+  // the scan moves onto the latest state as it goes
+  auto txn = db->BeginTransaction();
+  txn->Put("d", "d");
+  txn->Delete("c");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  std::vector<std::string> keys;
+  for (it->Next(); it->Valid(); it->Next()) {
+    keys.push_back(it->key().ToString());
+  }
+  delete it;
+
+  ASSERT_EQ(keys, (std::vector<std::string>{"d", "e"}));
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, Get) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  std::vector<std::string> strs{"a", "b", ""};
+  for (auto s : strs) {
+    auto txn = db->BeginTransaction();
+    txn->Put(s, s.empty() ? "Empty key" : s);
+    txn->Commit();
+  }
+
+  auto txn = db->BeginTransaction();
+  std::string val;
+
+  // empty key
+  ret = txn->Get("", &val);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(val, "Empty key");
+
+  // c does not exist
+  ret = txn->Get("c", &val);
+  ASSERT_EQ(ret, -ENOENT);
+
+  // a exists
+  ret = txn->Get("a", &val);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(val, "a");
+
+  // b exists
+  ret = txn->Get("b", &val);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(val, "b");
+
+  txn->Commit();
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, ConcurrentGet) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  // a small node cache, so that readers race with nodes being evicted
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.node_cache_size = 64*1024;
+  options.node_cache_pinned_levels = 0;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  for (int i = 0; i < 200; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&, t] {
+      std::mt19937 gen(t);
+      std::uniform_int_distribution<int> dis(0, 199);
+      while (!stop) {
+        const auto key = tostr(dis(gen));
+        std::string val;
+        EXPECT_EQ(db->Get(key, &val), 0);
+        EXPECT_EQ(val, key);
+      }
+    });
+  }
+
+  for (int i = 200; i < 400; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  stop = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, PinnedRegionStats) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  auto stats = cruzdb::CreateDBStatistics();
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = stats;
+  options.node_cache_pinned_levels = 3;
+  options.node_cache_pinned_markers = 0;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  for (int i = 0; i < 100; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  // the top three levels of a tree this size are full
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (stats->getTickerCount(cruzdb::NODE_CACHE_PINNED_NODES) != 7) {
+    ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_GT(stats->getTickerCount(cruzdb::NODE_CACHE_PINNED_BYTES), 0u);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, PinnedRegionSurvivesClearCaches) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  auto stats = cruzdb::CreateDBStatistics();
+
+  // every level of the tree is pinned
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = stats;
+  options.node_cache_pinned_levels = 64;
+  options.node_cache_pinned_markers = 0;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  for (int i = 0; i < 100; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  // the last root is pinned once its after image is finalized, and the
+  // pinned region stops changing once it has been pinned
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (stats->getTickerCount(cruzdb::AFTER_IMAGES_FINALIZED) < 100) {
+    ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  uint64_t pinned = 0;
+  while (true) {
+    ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const auto curr = stats->getTickerCount(cruzdb::NODE_CACHE_PINNED_NODES);
+    if (curr >= 100 && curr == pinned) {
+      break;
+    }
+    pinned = curr;
+  }
+
+  static_cast<cruzdb::DBImpl*>(db)->ClearCaches();
+
+  const auto reads = stats->getTickerCount(cruzdb::LOG_READS);
+  for (int i = 0; i < 100; i++) {
+    std::string val;
+    ASSERT_EQ(db->Get(tostr(i), &val), 0);
+    ASSERT_EQ(val, tostr(i));
+  }
+  ASSERT_EQ(stats->getTickerCount(cruzdb::LOG_READS), reads);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, GetSnapshotAt) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  auto *txn = db->BeginTransaction();
+  txn->Put("a", "1");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  // position 0 is filled, and far beyond the tail isn't processed
+  ASSERT_EQ(db->GetSnapshotAt(0), nullptr);
+  ASSERT_EQ(db->GetSnapshotAt(1000000), nullptr);
+
+  // the database as of the initial intention is empty
+  auto *snapshot = db->GetSnapshotAt(1);
+  ASSERT_NE(snapshot, nullptr);
+
+  auto *it = db->NewIterator(snapshot);
+  it->SeekToFirst();
+  ASSERT_FALSE(it->Valid());
+  delete it;
+
+  it = db->NewIterator();
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid());
+  ASSERT_EQ(it->key().ToString(), "a");
+  delete it;
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReOpen) {
+  TempDir tdir;
+
+  // populate a database and close it
+  std::map<std::string, std::string> prev_db;
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    cruzdb::Options options;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 150; i++) {
+      std::stringstream ss;
+      ss << "key-" << i;
+      std::string key = ss.str();
+      ss << "-val";
+      std::string val = ss.str();
+
+      auto *txn = db->BeginTransaction();
+
+      std::string val_out;
+      ret = txn->Get(key, &val_out);
+      ASSERT_EQ(-ENOENT, ret);
+
+      txn->Put(key, val);
+      prev_db[key] = val;
+
+      txn->Commit();
+      delete txn;
+    }
+
+    delete db;
+    delete log;
+  }
+
+  // re-open the database and verify the previous inserts
+  zlog::Log *log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  std::map<std::string, std::string> curr_db;
+  auto *it = db->NewIterator();
+  it->SeekToFirst();
+  while (it->Valid()) {
+    curr_db[it->key().ToString()] = it->value().ToString();
+    it->Next();
+  }
+
+  ASSERT_EQ(curr_db, prev_db);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReOpenHotSet) {
+  TempDir tdir;
+
+  cruzdb::Options options;
+  options.hot_set_path = std::string(tdir.path) + "/hot_set";
+
+  // populate a database and close it, which saves the hot set
+  std::map<std::string, std::string> prev_db;
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 150; i++) {
+      auto key = tostr(i);
+      auto *txn = db->BeginTransaction();
+      txn->Put(key, key);
+      prev_db[key] = key;
+      txn->Commit();
+      delete txn;
+    }
+
+    delete db;
+    delete log;
+  }
+
+  std::ifstream hot_set(options.hot_set_path);
+  uint64_t pos;
+  ASSERT_TRUE(hot_set >> pos);
+
+  // re-open the database, which warms the cache from the hot set
+  zlog::Log *log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  auto stats = cruzdb::CreateDBStatistics();
+  options.statistics = stats;
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  // warmup runs in the background
+  for (int i = 0; i < 1000; i++) {
+    const auto total = stats->getTickerCount(cruzdb::NODE_CACHE_WARMUP_TOTAL);
+    if (total > 0 && stats->getTickerCount(
+          cruzdb::NODE_CACHE_WARMUP_PROGRESS) >= total) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_GT(stats->getTickerCount(cruzdb::NODE_CACHE_WARMUP_TOTAL), 0u);
+  ASSERT_EQ(stats->getTickerCount(cruzdb::NODE_CACHE_WARMUP_PROGRESS),
+      stats->getTickerCount(cruzdb::NODE_CACHE_WARMUP_TOTAL));
+  ASSERT_GT(stats->getTickerCount(cruzdb::NODE_CACHE_WARMUP_LOADED), 0u);
+
+  std::map<std::string, std::string> curr_db;
+  auto *it = db->NewIterator();
+  it->SeekToFirst();
+  while (it->Valid()) {
+    curr_db[it->key().ToString()] = it->value().ToString();
+    it->Next();
+  }
+
+  ASSERT_EQ(curr_db, prev_db);
+
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReOpenCheckpoint) {
+  TempDir tdir;
+
+  cruzdb::Options options;
+  options.checkpoint_interval = 10;
+
+  std::map<std::string, std::string> prev_db;
+  {
+    zlog::Log *log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 150; i++) {
+      std::stringstream ss;
+      ss << "key-" << i;
+      std::string key = ss.str();
+      ss << "-val";
+      std::string val = ss.str();
+
+      auto *txn = db->BeginTransaction();
+      txn->Put(key, val);
+      prev_db[key] = val;
+      txn->Commit();
+      delete txn;
+    }
+
+    delete db;
+    delete log;
+  }
+
+  zlog::Log *log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  std::map<std::string, std::string> curr_db;
+  auto *it = db->NewIterator();
+  it->SeekToFirst();
+  while (it->Valid()) {
+    curr_db[it->key().ToString()] = it->value().ToString();
+    it->Next();
+  }
+
+  ASSERT_EQ(curr_db, prev_db);
+
+  delete it;
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReOpenSeparateAfterImageLog) {
+  TempDir tdir;
+
+  std::map<std::string, std::string> prev_db;
+  {
+    zlog::Log *log, *ai_log;
+    int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+    ret = zlog::Log::Create("lmdb", "ailog", {{"path", tdir.path}}, "", "", &ai_log);
+    ASSERT_EQ(ret, 0);
+
+    cruzdb::DB *db;
+    cruzdb::Options options;
+    ret = cruzdb::DB::Open(options, log, ai_log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 150; i++) {
+      std::stringstream ss;
+      ss << "key-" << i;
+      std::string key = ss.str();
+      ss << "-val";
+      std::string val = ss.str();
+
+      auto *txn = db->BeginTransaction();
+      txn->Put(key, val);
+      prev_db[key] = val;
+      txn->Commit();
+      delete txn;
+    }
+
+    delete db;
+    delete ai_log;
+    delete log;
+  }
+
+  zlog::Log *log, *ai_log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+  ret = zlog::Log::Open("lmdb", "ailog", {{"path", tdir.path}}, "", "", &ai_log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, ai_log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  std::map<std::string, std::string> curr_db;
+  auto *it = db->NewIterator();
+  it->SeekToFirst();
+  while (it->Valid()) {
+    curr_db[it->key().ToString()] = it->value().ToString();
+    it->Next();
+  }
+
+  ASSERT_EQ(curr_db, prev_db);
+
+  delete it;
+  delete db;
+  delete ai_log;
+  delete log;
+}
+
+// the after image log is rolled back to an early copy, so on reopen every
+// later intention is replayed
+TEST(DB, RecoveryPrefetch) {
+  TempDir tdir, ai_dir, ai_copy;
+
+  std::map<std::string, std::string> truth;
+  auto write = [&](const char *ai_path, int begin, int end, bool create) {
+    zlog::Log *log, *ai_log;
+    int ret = create ?
+      zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log) :
+      zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+    ASSERT_EQ(ret, 0);
+    ret = create ?
+      zlog::Log::Create("lmdb", "ailog", {{"path", ai_path}}, "", "", &ai_log) :
+      zlog::Log::Open("lmdb", "ailog", {{"path", ai_path}}, "", "", &ai_log);
+    ASSERT_EQ(ret, 0);
+
+    auto stats = cruzdb::CreateDBStatistics();
+    cruzdb::Options options;
+    options.statistics = stats;
+    options.checkpoint_interval = 0;
+    cruzdb::DB *db;
+    ret = cruzdb::DB::Open(options, log, ai_log, create, &db);
+    ASSERT_EQ(ret, 0);
+
+    for (int i = begin; i < end; i++) {
+      auto txn = db->BeginTransaction();
+      txn->Put(tostr(i), tostr(i));
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+      truth[tostr(i)] = tostr(i);
+    }
+
+    const auto count = static_cast<uint64_t>(end - begin);
+    while (stats->getTickerCount(cruzdb::AFTER_IMAGES_FINALIZED) < count) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    delete db;
+    delete ai_log;
+    delete log;
+  };
+
+  ASSERT_NO_FATAL_FAILURE(write(ai_dir.path, 0, 10, true));
+  const auto cmd = std::string("cp -a ") + ai_dir.path + "/. " + ai_copy.path;
+  ASSERT_EQ(system(cmd.c_str()), 0);
+  ASSERT_NO_FATAL_FAILURE(write(ai_dir.path, 10, 500, false));
+
+  zlog::Log *log, *ai_log;
+  int ret = zlog::Log::Open("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+  ret = zlog::Log::Open("lmdb", "ailog", {{"path", ai_copy.path}}, "", "", &ai_log);
+  ASSERT_EQ(ret, 0);
+
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::Options options;
+  options.statistics = stats;
+  options.checkpoint_interval = 0;
+  options.adopt_after_images = false;
+  options.log_readahead_window = 8;
+  options.recovery_readahead_window = 64;
+  options.recovery_prefetch_threads = 4;
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, ai_log, false, &db);
+  ASSERT_EQ(ret, 0);
+
+  ASSERT_GE(stats->getTickerCount(cruzdb::RECOVERY_POSITIONS_TOTAL), 490u);
+  ASSERT_EQ(stats->getTickerCount(cruzdb::RECOVERY_POSITIONS_DONE),
+      stats->getTickerCount(cruzdb::RECOVERY_POSITIONS_TOTAL));
+  ASSERT_GT(stats->getTickerCount(cruzdb::RECOVERY_INTENTIONS_PREFETCHED), 0u);
+  ASSERT_EQ(stats->getTickerCount(cruzdb::LOG_READAHEAD_WINDOW), 8u);
+
+  std::map<std::string, std::string> found;
+  auto it = db->NewIterator();
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    found[it->key().ToString()] = it->value().ToString();
+  }
+  delete it;
+  ASSERT_EQ(found, truth);
+
+  delete db;
+  delete ai_log;
+  delete log;
+}
+
+TEST(DB, SeparateAfterImageLogFinalize) {
+  TempDir tdir;
+
+  zlog::Log *log, *ai_log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+  ret = zlog::Log::Create("lmdb", "ailog", {{"path", tdir.path}}, "", "", &ai_log);
+  ASSERT_EQ(ret, 0);
+
+  // evicted nodes that are still addressed by their intention are resolved
+  // by searching the after image log, rather than from the intention map.
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::Options options;
+  options.statistics = stats;
+  options.imap_cache_size = 1;
+  options.node_cache_size = 64*1024;
+  options.node_cache_pinned_levels = 0;
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, ai_log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  const int num_txns = 200;
+  for (int i = 0; i < num_txns; i++) {
+    auto key = tostr(i);
+    auto *txn = db->BeginTransaction();
+    txn->Put(key, key);
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+
+    for (int j = 0; j <= i; j += 13) {
+      std::string value;
+      ASSERT_EQ(db->Get(tostr(j), &value), 0);
+      ASSERT_EQ(value, tostr(j));
+    }
+  }
+
+  // every committed intention is matched with its after image, even those
+  // whose after images were read by a lookup before the log reader got to
+  // them.
+  for (int i = 0; i < 1000; i++) {
+    if (stats->getTickerCount(cruzdb::AFTER_IMAGES_FINALIZED) >=
+        (uint64_t)num_txns) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ(stats->getTickerCount(cruzdb::AFTER_IMAGES_FINALIZED),
+      (uint64_t)num_txns);
+
+  delete db;
+  delete ai_log;
+  delete log;
+}
+
+TEST(DB, FollowerAdoptsAfterImages) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::Options options;
+  options.statistics = stats;
+  options.checkpoint_interval = 200;
+
+  cruzdb::DB *db;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  const int num_txns = 450;
+  std::map<std::string, std::string> expected;
+  for (int i = 0; i < num_txns; i++) {
+    auto key = tostr(i);
+    auto *txn = db->BeginTransaction();
+    txn->Put(key, key + "-val");
+    expected[key] = key + "-val";
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  // every after image is in the log before the follower is opened
+  for (int i = 0; i < 1000; i++) {
+    if (stats->getTickerCount(cruzdb::AFTER_IMAGES_FINALIZED) >=
+        (uint64_t)num_txns) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ(stats->getTickerCount(cruzdb::AFTER_IMAGES_FINALIZED),
+      (uint64_t)num_txns);
+
+  // the follower restores from the newest checkpoint and rolls forward
+  // through the intentions after it, taking their trees from the primary's
+  // after images.
+  auto follower_stats = cruzdb::CreateDBStatistics();
+  cruzdb::Options follower_options;
+  follower_options.statistics = follower_stats;
+
+  cruzdb::DB *follower;
+  ret = cruzdb::DB::OpenReadOnly(follower_options, log, &follower);
+  ASSERT_EQ(ret, 0);
+
+  ASSERT_GT(follower_stats->getTickerCount(cruzdb::AFTER_IMAGES_ADOPTED), 0u);
+
+  std::map<std::string, std::string> found;
+  auto it = follower->NewIterator();
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    found[it->key().ToString()] = it->value().ToString();
+  }
+  delete it;
+  ASSERT_EQ(found, expected);
+
+  for (const auto& kv : expected) {
+    std::string value;
+    ASSERT_EQ(follower->Get(kv.first, &value), 0);
+    ASSERT_EQ(value, kv.second);
+  }
+
+  delete follower;
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReadOnlyFollower) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  auto *txn = db->BeginTransaction();
+  txn->Put("a", "1");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  cruzdb::DB *follower;
+  cruzdb::Options follower_options;
+  follower_options.max_staleness_ms = 1;
+  ret = cruzdb::DB::OpenReadOnly(follower_options, log, &follower);
+  ASSERT_EQ(0, ret);
+
+  ASSERT_EQ(follower->BeginTransaction(), nullptr);
+
+  std::string val;
+  ret = follower->Get("a", &val);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(val, "1");
+
+  txn = db->BeginTransaction();
+  txn->Put("b", "2");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  // the follower catches up with the tail before serving the read
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  ret = follower->Get("b", &val);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(val, "2");
+
+  delete follower;
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReadOnlyFollowerConcurrentReads) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  // every read waits for the follower to catch up with the tail, so
+  // concurrent readers wait on the same intention.
+  cruzdb::DB *follower;
+  cruzdb::Options follower_options;
+  follower_options.max_staleness_ms = 1;
+  ret = cruzdb::DB::OpenReadOnly(follower_options, log, &follower);
+  ASSERT_EQ(0, ret);
+
+  const int num_txns = 100;
+  std::atomic<bool> done(false);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.emplace_back([&] {
+      while (!done) {
+        std::string val;
+        follower->Get(tostr(0), &val);
+      }
+    });
+  }
+
+  for (int i = 0; i < num_txns; i++) {
+    auto *txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  std::string val;
+  ret = follower->Get(tostr(num_txns - 1), &val);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(val, tostr(num_txns - 1));
+
+  delete follower;
+  delete db;
+  delete log;
+}
+
+TEST(DB, ReadOnlyFollowerWritesNothing) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  {
+    cruzdb::DB *db;
+    cruzdb::Options options;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 50; i++) {
+      auto *txn = db->BeginTransaction();
+      txn->Put(tostr(i), tostr(i));
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+    }
+
+    delete db;
+  }
+
+  uint64_t tail;
+  ASSERT_EQ(log->CheckTail(&tail), 0);
+
+  cruzdb::DB *follower;
+  cruzdb::Options options;
+  options.max_staleness_positions = 10;
+  options.max_staleness_ms = 10;
+  ret = cruzdb::DB::OpenReadOnly(options, log, &follower);
+  ASSERT_EQ(0, ret);
+
+  for (int i = 0; i < 50; i++) {
+    std::string val;
+    ASSERT_EQ(follower->Get(tostr(i), &val), 0);
+    ASSERT_EQ(val, tostr(i));
+  }
+
+  auto it = follower->NewIterator();
+  int count = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    count++;
+  }
+  delete it;
+  ASSERT_EQ(count, 50);
+
+  delete follower;
+
+  uint64_t after;
+  ASSERT_EQ(log->CheckTail(&after), 0);
+  ASSERT_EQ(after, tail);
+
+  delete log;
+}
+
+TEST(DB, ReadOnlyFollowerBothBounds) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  auto primary_stats = cruzdb::CreateDBStatistics();
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = primary_stats;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  for (int i = 0; i < 10; i++) {
+    auto *txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  // let the primary finish writing after images so the log stops growing
+  while (primary_stats->getTickerCount(cruzdb::AFTER_IMAGES_FINALIZED) < 10) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::DB *follower;
+  cruzdb::Options follower_options;
+  follower_options.statistics = stats;
+  follower_options.max_staleness_positions = 1000;
+  follower_options.max_staleness_ms = 60000;
+  ret = cruzdb::DB::OpenReadOnly(follower_options, log, &follower);
+  ASSERT_EQ(0, ret);
+
+  // the first read finds the follower caught up, which restarts the time
+  // bound. later reads are served without looking at the log.
+  std::string val;
+  ASSERT_EQ(follower->Get(tostr(9), &val), 0);
+  ASSERT_EQ(val, tostr(9));
+
+  // wait for the follower's log reader to go idle
+  auto log_reads = [&] {
+    return stats->getTickerCount(cruzdb::LOG_READS) +
+      stats->getTickerCount(cruzdb::LOG_READ_CACHE_HIT);
+  };
+  auto reads = log_reads();
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const auto now = log_reads();
+    if (now == reads)
+      break;
+    reads = now;
+  }
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(follower->Get(tostr(i % 10), &val), 0);
+  }
+  ASSERT_EQ(log_reads(), reads);
+
+  delete follower;
+  delete db;
+  delete log;
+}
+
+TEST(DB, CloseReclaimsRetired) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = stats;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  for (int i = 0; i < 200; i++) {
+    auto *txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+
+    auto *it = db->NewIterator();
+    it->SeekToFirst();
+    ASSERT_TRUE(it->Valid());
+    delete it;
+  }
+
+  delete db;
+
+  // everything retired while the database was open is freed on close
+  ASSERT_GT(stats->getTickerCount(cruzdb::EPOCH_OBJECTS_RECLAIMED), 0u);
+  ASSERT_EQ(stats->getTickerCount(cruzdb::EPOCH_OBJECTS_PENDING), 0u);
+
+  delete log;
+}
+
+TEST(DB, LogReaderRetriesHole) {
+  TempDir tdir;
+
+  zlog::Log *base_log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &base_log);
+  ASSERT_EQ(ret, 0);
+  auto log = new FaultyLog(base_log);
+
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.statistics = stats;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  // the next position is below the tail but hasn't been written
+  log->unwritten_tail = 1;
+  while (stats->getTickerCount(cruzdb::LOG_READS_UNWRITTEN) == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // the reader picks up the entry once it is written
+  for (int i = 0; i < 10; i++) {
+    auto txn = db->BeginTransaction();
+    txn->Put(tostr(i), tostr(i));
+    ASSERT_TRUE(txn->Commit());
+    delete txn;
+  }
+
+  for (int i = 0; i < 10; i++) {
+    std::string val;
+    ASSERT_EQ(db->Get(tostr(i), &val), 0);
+    ASSERT_EQ(val, tostr(i));
+  }
+
+  delete db;
+  delete log;
+  delete base_log;
+}
+
+TEST(DB, LogReadsCompleteOutOfOrder) {
+  TempDir tdir;
+
+  zlog::Log *base_log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &base_log);
+  ASSERT_EQ(ret, 0);
+  auto log = new FaultyLog(base_log);
+
+  std::map<std::string, std::string> truth;
+  {
+    cruzdb::DB *db;
+    cruzdb::Options options;
+    ret = cruzdb::DB::Open(options, log, true, &db);
+    ASSERT_EQ(0, ret);
+
+    for (int i = 0; i < 100; i++) {
+      auto txn = db->BeginTransaction();
+      txn->Put(tostr(i), tostr(i));
+      ASSERT_TRUE(txn->Commit());
+      delete txn;
+      truth[tostr(i)] = tostr(i);
+    }
+
+    delete db;
+  }
+
+  // replay reads the log with many reads outstanding, which complete out of
+  // order, and entries must still be applied in log order
+  log->delay_even_reads = true;
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  options.log_readahead_window = 16;
+  options.log_parse_threads = 4;
+  ret = cruzdb::DB::Open(options, log, false, &db);
+  ASSERT_EQ(0, ret);
+
+  ASSERT_GT(log->delayed_reads, 0u);
+
+  std::map<std::string, std::string> found;
+  auto it = db->NewIterator();
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    found[it->key().ToString()] = it->value().ToString();
+  }
+  delete it;
+  ASSERT_EQ(found, truth);
+
+  auto txn = db->BeginTransaction();
+  txn->Put("new", "new");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  std::string val;
+  ASSERT_EQ(db->Get("new", &val), 0);
+  ASSERT_EQ(val, "new");
+
+  delete db;
+  delete log;
+  delete base_log;
+}
+
+TEST(DB, FailedAsyncAppendRetried) {
+  TempDir tdir;
+
+  zlog::Log *base_log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &base_log);
+  ASSERT_EQ(ret, 0);
+  auto log = new FaultyLog(base_log);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(0, ret);
+
+  // appends that can't be issued asynchronously are made synchronously, in
+  // order, and their transactions commit as usual
+  log->fail_aio_appends = true;
+  const auto sync_appends = log->sync_appends.load();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([db, t] {
+      for (int i = 0; i < 25; i++) {
+        const auto key = tostr(t * 25 + i);
+        auto txn = db->BeginTransaction();
+        txn->Put(key, key);
+        EXPECT_TRUE(txn->Commit());
+        delete txn;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_GT(log->failed_aio_appends, 0u);
+  ASSERT_GT(log->sync_appends, sync_appends);
+
+  for (int i = 0; i < 100; i++) {
+    std::string val;
+    ASSERT_EQ(db->Get(tostr(i), &val), 0);
+    ASSERT_EQ(val, tostr(i));
+  }
+
+  log->fail_aio_appends = false;
+  auto txn = db->BeginTransaction();
+  txn->Put("after", "after");
+  ASSERT_TRUE(txn->Commit());
+  delete txn;
+
+  delete db;
+  delete log;
+  delete base_log;
+}
+
+TEST(Txn, WriteWriteConflict) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  // note this txn+commit causes the next two transactions created to have
+  // snapshots > 0. the initialization case is handled below in the *SnapInit
+  // variants.
+  auto txn0 = db->BeginTransaction();
+  txn0->Put("foo", "foo");
+  txn0->Commit();
+
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  // TODO: assert snapshot property
+
+  txn1->Put("bar", "bar");
+  txn2->Put("bar", "baz");
+
+  ASSERT_TRUE(txn1->Commit());
+  ASSERT_FALSE(txn2->Commit());
+
+  delete db;
+  delete log;
+}
+
+TEST(Txn, WriteWriteNoConflict) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db, logger);
+  ASSERT_EQ(ret, 0);
+
+  // note this txn+commit causes the next two transactions created to have
+  // snapshots > 0. the initialization case is handled below in the *SnapInit
+  // variants.
+  auto txn0 = db->BeginTransaction();
+  txn0->Put("foo", "foo");
+  txn0->Commit();
+
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  // TODO: assert snapshot property
+
+  txn1->Put("bar", "bar");
+  txn2->Put("baz", "baz");
+
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_TRUE(txn1->Commit());
+
+  delete db;
+  delete log;
+}
+
+// the two transactions created will both have intention zero as their snapshot,
+// exercising initialization edge cases.
+TEST(Txn, WriteWriteConflictSnapInit) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db);
+  ASSERT_EQ(ret, 0);
+
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  // TODO: assert snapshot property
+
+  txn1->Put("bar", "bar");
+  txn2->Put("bar", "baz");
+
+  ASSERT_TRUE(txn1->Commit());
+  ASSERT_FALSE(txn2->Commit());
+
+  delete db;
+  delete log;
+}
+
+// the two transactions created will both have intention zero as their snapshot,
+// exercising initialization edge cases.
+TEST(Txn, WriteWriteNoConflictSnapInit) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::DB *db;
+  cruzdb::Options options;
+  ret = cruzdb::DB::Open(options, log, true, &db, logger);
+  ASSERT_EQ(ret, 0);
+
+  auto txn1 = db->BeginTransaction();
+  auto txn2 = db->BeginTransaction();
+  // TODO: assert snapshot property
+
+  txn1->Put("bar", "bar");
+  txn2->Put("baz", "baz");
+
+  ASSERT_TRUE(txn2->Commit());
+  ASSERT_TRUE(txn1->Commit());
+
+  delete db;
+  delete log;
+}
+
+static cruzdb::EntryCache::Entry filled_entry()
+{
+  cruzdb::EntryCache::Entry entry;
+  entry.type = cruzdb::EntryCache::Entry::EntryType::FILLED;
+  return entry;
+}
+
+// the number of filled entries that fit in one shard of a cache
+static size_t filled_entry_capacity(size_t intention_bytes)
+{
+  cruzdb::EntryCache cache(intention_bytes, 0);
+  for (size_t i = 0;; i++) {
+    // positions that are a multiple of the shard count map to the same shard
+    cache.Insert(i * 16, filled_entry());
+    if (!cache.Contains(0)) {
+      return i;
+    }
+  }
+}
+
+TEST(EntryService, ReadWakesAtTarget) {
+  TempDir tdir;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create("lmdb", "log", {{"path", tdir.path}}, "", "", &log);
+  ASSERT_EQ(ret, 0);
+
+  cruzdb::Options options;
+  auto stats = cruzdb::CreateDBStatistics();
+  cruzdb::EntryService entry_service(options, stats.get(), log);
+  entry_service.Start(0);
+
+  cruzdb_proto::AfterImage after_image;
+  after_image.set_intention(1);
+  const auto first = entry_service.Append(after_image);
+
+  // each reader returns once its own position has been read from the log,
+  // and not when earlier positions become available
+  std::atomic<uint64_t> woke_near(0), woke_far(0);
+  std::thread near_reader([&] {
+    EXPECT_TRUE(entry_service.Read(first + 2));
+    woke_near = first + 2;
+  });
+  std::thread far_reader([&] {
+    EXPECT_TRUE(entry_service.Read(first + 5));
+    woke_far = first + 5;
+  });
+
+  for (uint64_t pos = first + 1; pos <= first + 5; pos++) {
+    after_image.set_intention(pos + 1);
+    EXPECT_EQ(entry_service.Append(after_image), pos);
+    EXPECT_TRUE(entry_service.Read(pos));
+
+    if (pos == first + 2) {
+      near_reader.join();
+    }
+    EXPECT_EQ(woke_near != 0, pos >= first + 2);
+    if (pos < first + 5) {
+      EXPECT_EQ(woke_far, 0u);
+    }
+  }
+
+  far_reader.join();
+  EXPECT_EQ(woke_far, first + 5);
+
+  entry_service.Stop();
+  delete log;
+}
+
+TEST(EntryService, PeekEntryType) {
+  cruzdb_proto::LogEntry::EntryType type;
+
+  cruzdb_proto::LogEntry entry;
+  entry.set_type(cruzdb_proto::LogEntry::AFTER_IMAGE);
+  entry.mutable_after_image()->set_intention(7);
+  std::string blob;
+  ASSERT_TRUE(entry.SerializeToString(&blob));
+  ASSERT_TRUE(cruzdb::EntryService::PeekEntryType(blob, &type));
+  ASSERT_EQ(type, cruzdb_proto::LogEntry::AFTER_IMAGE);
+
+  // fields before the type are skipped
+  cruzdb_proto::LogEntry body;
+  body.mutable_after_image()->set_intention(7);
+  cruzdb_proto::LogEntry header;
+  header.set_type(cruzdb_proto::LogEntry::CHECKPOINT);
+  std::string reordered;
+  ASSERT_TRUE(body.SerializePartialToString(&reordered));
+  std::string type_field;
+  ASSERT_TRUE(header.SerializePartialToString(&type_field));
+  reordered += type_field;
+  ASSERT_TRUE(cruzdb::EntryService::PeekEntryType(reordered, &type));
+  ASSERT_EQ(type, cruzdb_proto::LogEntry::CHECKPOINT);
+
+  // malformed entries
+  ASSERT_FALSE(cruzdb::EntryService::PeekEntryType("", &type));
+  ASSERT_FALSE(cruzdb::EntryService::PeekEntryType(
+        blob.substr(2, blob.size() / 2), &type));
+  std::string missing_type;
+  ASSERT_TRUE(body.SerializePartialToString(&missing_type));
+  ASSERT_FALSE(cruzdb::EntryService::PeekEntryType(missing_type, &type));
+}
+
+TEST(EntryCache, IntentionSecondChance) {
+  const size_t budget = 16 * 4096;
+  const auto capacity = filled_entry_capacity(budget);
+  ASSERT_GT(capacity, 2u);
+
+  cruzdb::EntryCache cache(budget, 0);
+  for (size_t i = 0; i < capacity; i++) {
+    cache.Insert(i * 16, filled_entry());
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    ASSERT_TRUE(cache.Contains(i * 16));
+  }
+
+  // the oldest intention was read, so the next oldest is evicted instead
+  ASSERT_TRUE(cache.Find(0));
+  cache.Insert(capacity * 16, filled_entry());
+  ASSERT_TRUE(cache.Contains(0));
+  ASSERT_FALSE(cache.Contains(16));
+  ASSERT_TRUE(cache.Contains(capacity * 16));
+}
+
+TEST(EntryCache, SeparateBudgets) {
+  const size_t budget = 16 * 4096;
+  const auto capacity = filled_entry_capacity(budget);
+
+  cruzdb::EntryCache cache(budget, budget);
+  for (size_t i = 0; i < capacity; i++) {
+    cache.Insert(i * 16, filled_entry());
+  }
+
+  // after images larger than their budget are evicted without touching the
+  // intentions
+  const uint64_t base = capacity * 16;
+  for (uint64_t i = 0; i < 8; i++) {
+    auto after_image = std::make_shared<cruzdb_proto::AfterImage>();
+    after_image->set_intention(i);
+    auto node = after_image->add_tree();
+    node->set_val(std::string(2048, 'x'));
+    cruzdb::EntryCache::Entry entry;
+    entry.type = cruzdb::EntryCache::Entry::EntryType::AFTERIMAGE;
+    entry.after_image = after_image;
+    cache.Insert(base + i * 16, entry);
+  }
+
+  ASSERT_FALSE(cache.Contains(base));
+  ASSERT_TRUE(cache.Contains(base + 7 * 16));
+  for (size_t i = 0; i < capacity; i++) {
+    ASSERT_TRUE(cache.Contains(i * 16));
+  }
+}
+
+TEST(SecondaryCache, LookupInsert) {
+  TempDir tdir;
+  cruzdb::SecondaryCache cache(tdir.path, 1 << 20, 4096, nullptr);
+
+  std::string data;
+  ASSERT_FALSE(cache.Lookup(1, &data));
+
+  cache.Insert(1, "a");
+  cache.Insert(2, "bb");
+  ASSERT_TRUE(cache.Lookup(1, &data));
+  ASSERT_EQ(data, "a");
+  ASSERT_TRUE(cache.Lookup(2, &data));
+  ASSERT_EQ(data, "bb");
+
+  // entries are immutable, so a second insert is ignored
+  cache.Insert(1, "c");
+  ASSERT_TRUE(cache.Lookup(1, &data));
+  ASSERT_EQ(data, "a");
+
+  ASSERT_FALSE(cache.Lookup(3, &data));
+}
+
+TEST(SecondaryCache, Eviction) {
+  TempDir tdir;
+
+  // two entries per segment
+  cruzdb::SecondaryCache cache(tdir.path, 3000, 1000, nullptr);
+  const std::string value(500, 'x');
+  for (uint64_t pos = 0; pos < 10; pos++) {
+    cache.Insert(pos, value);
+  }
+
+  // the oldest segments are dropped until the cache fits its budget
+  std::string data;
+  for (uint64_t pos = 0; pos < 4; pos++) {
+    ASSERT_FALSE(cache.Lookup(pos, &data));
+  }
+  for (uint64_t pos = 4; pos < 10; pos++) {
+    ASSERT_TRUE(cache.Lookup(pos, &data));
+    ASSERT_EQ(data, value);
+  }
+}
+
+TEST(SecondaryCache, LargeEntry) {
+  TempDir tdir;
+  cruzdb::SecondaryCache cache(tdir.path, 1 << 20, 1000, nullptr);
+
+  std::string data;
+  cache.Insert(1, std::string(1001, 'x'));
+  ASSERT_FALSE(cache.Lookup(1, &data));
+
+  cache.Insert(2, std::string(1000, 'y'));
+  ASSERT_TRUE(cache.Lookup(2, &data));
+  ASSERT_EQ(data, std::string(1000, 'y'));
+}
+
+TEST(SecondaryCache, SharedPath) {
+  TempDir tdir;
+
+  // segments left by an instance that is gone
+  const auto stale = std::string(tdir.path) + "/cache-stale";
+  ASSERT_EQ(mkdir(stale.c_str(), 0755), 0);
+  std::ofstream(stale + "/ai-0.seg") << "x";
+
+  std::string data;
+  cruzdb::SecondaryCache cache1(tdir.path, 1 << 20, 4096, nullptr);
+  ASSERT_NE(access(stale.c_str(), F_OK), 0);
+  cache1.Insert(1, "a");
+
+  // a second instance doesn't remove the first's segments
+  {
+    cruzdb::SecondaryCache cache2(tdir.path, 1 << 20, 4096, nullptr);
+    cache2.Insert(1, "b");
+    ASSERT_TRUE(cache2.Lookup(1, &data));
+    ASSERT_EQ(data, "b");
+    ASSERT_TRUE(cache1.Lookup(1, &data));
+    ASSERT_EQ(data, "a");
+  }
+
+  ASSERT_TRUE(cache1.Lookup(1, &data));
+  ASSERT_EQ(data, "a");
+  cache1.Insert(2, "c");
+  ASSERT_TRUE(cache1.Lookup(2, &data));
+  ASSERT_EQ(data, "c");
+}
+
+TEST(SingleFlight, CallThrows) {
+  cruzdb::SingleFlight<uint64_t, int> calls;
+
+  std::thread waiter;
+  bool waiter_done = false;
+  auto fn = [&] {
+    // another caller arrives while the call is in flight
+    waiter = std::thread([&] {
+      try {
+        calls.Do(1, [] { return 2; });
+      } catch (const std::runtime_error&) {
+      }
+      waiter_done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    throw std::runtime_error("fail");
+    return 1;
+  };
+
+  ASSERT_THROW(calls.Do(1, fn), std::runtime_error);
+  waiter.join();
+  ASSERT_TRUE(waiter_done);
+
+  // the failed call is forgotten
+  bool shared = true;
+  ASSERT_EQ(calls.Do(1, [] { return 3; }, &shared), 3);
+  ASSERT_FALSE(shared);
+}
+
+// counts its destruction, to see when a retired object is freed
+struct EpochTracked {
+  explicit EpochTracked(std::atomic<int> *freed) : freed(freed) {}
+  ~EpochTracked() { (*freed)++; }
+  std::atomic<int> *freed;
+};
+
+TEST(Epoch, NestedGuards) {
+  std::atomic<int> freed(0);
+  {
+    cruzdb::Epoch::Guard outer;
+    {
+      cruzdb::Epoch::Guard inner;
+      cruzdb::Epoch::Retire(new EpochTracked(&freed));
+    }
+
+    // the critical section lasts until the outer guard ends
+    cruzdb::Epoch::Reclaim();
+    ASSERT_EQ(freed, 0);
+
+    cruzdb::Epoch::Retire(new EpochTracked(&freed));
+    cruzdb::Epoch::Reclaim();
+    ASSERT_EQ(freed, 0);
+  }
+
+  cruzdb::Epoch::Reclaim();
+  ASSERT_EQ(freed, 2);
+}
+
+TEST(Epoch, GuardOnAnotherThread) {
+  std::atomic<int> freed(0);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  bool entered = false;
+  bool release = false;
+
+  std::thread reader([&] {
+    cruzdb::Epoch::Guard guard;
+    std::unique_lock<std::mutex> lk(lock);
+    entered = true;
+    cond.notify_all();
+    cond.wait(lk, [&] { return release; });
+  });
+
+  {
+    std::unique_lock<std::mutex> lk(lock);
+    cond.wait(lk, [&] { return entered; });
+  }
+
+  // more than fill a batch
+  for (int i = 0; i < 200; i++) {
+    cruzdb::Epoch::Retire(new EpochTracked(&freed));
+  }
+
+  cruzdb::Epoch::Reclaim();
+  EXPECT_EQ(freed, 0);
+
+  {
+    std::lock_guard<std::mutex> lk(lock);
+    release = true;
+  }
+  cond.notify_all();
+  reader.join();
+
+  cruzdb::Epoch::Reclaim();
+  ASSERT_EQ(freed, 200);
+}
+
+TEST(Epoch, ThreadExitPublishesBatch) {
+  std::atomic<int> freed(0);
+
+  std::thread([&] {
+    cruzdb::Epoch::Retire(new EpochTracked(&freed));
+  }).join();
+
+  ASSERT_EQ(freed, 0);
+  ASSERT_GT(cruzdb::Epoch::Pending(), 0u);
+
+  cruzdb::Epoch::Reclaim();
+  ASSERT_EQ(freed, 1);
+}
+
 int main(int argc, char **argv)
 {
   logger = spdlog::stdout_color_mt("cruzdb");
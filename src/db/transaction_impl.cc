@@ -38,6 +38,16 @@ int TransactionImpl::Get(const zlog::Slice& key, std::string *value)
   return tree_->Get(PREFIX_USER, key, value);
 }
 
+int TransactionImpl::Get(const zlog::Slice& key, PinnableSlice *value)
+{
+  assert(tree_);
+  assert(intention_);
+  assert(!committed_);
+
+  intention_->Get(key);
+  return tree_->Get(PREFIX_USER, key, value);
+}
+
 void TransactionImpl::Put(const zlog::Slice& key, const zlog::Slice& value)
 {
   return Put(PREFIX_USER, key, value);
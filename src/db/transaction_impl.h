@@ -18,6 +18,7 @@ class TransactionImpl : public Transaction {
   // exported transaction api
  public:
   virtual int Get(const zlog::Slice& key, std::string *value) override;
+  virtual int Get(const zlog::Slice& key, PinnableSlice *value) override;
   virtual void Put(const zlog::Slice& key, const zlog::Slice& value) override;
   virtual void Delete(const zlog::Slice& key) override;
   virtual bool Commit() override;
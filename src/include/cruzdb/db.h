@@ -3,6 +3,7 @@
 #include <memory>
 #include <zlog/log.h>
 #include "iterator.h"
+#include "pinnable_slice.h"
 #include "transaction.h"
 #include "options.h"
 
@@ -31,6 +32,23 @@ class DB {
       bool create_if_empty, DB **db,
       std::shared_ptr<spdlog::logger> logger);
 
+  // Store after images in ai_log instead of the intention log. The same pair
+  // of logs must be used each time the database is opened.
+  static int Open(const Options& options, zlog::Log *log,
+      zlog::Log *ai_log, bool create_if_empty, DB **db,
+      std::shared_ptr<spdlog::logger> logger = nullptr);
+
+  // Open a read-only follower of a database. The follower tails the log and
+  // serves reads within the staleness bounds in Options, but never writes to
+  // the log. BeginTransaction returns nullptr. Pass the after image log if
+  // the database was created with one.
+  static int OpenReadOnly(const Options& options, zlog::Log *log, DB **db,
+      std::shared_ptr<spdlog::logger> logger = nullptr);
+
+  static int OpenReadOnly(const Options& options, zlog::Log *log,
+      zlog::Log *ai_log, DB **db,
+      std::shared_ptr<spdlog::logger> logger = nullptr);
+
   /*
    *
    */
@@ -42,23 +60,81 @@ class DB {
   virtual Snapshot *GetSnapshot() = 0;
 
   /*
-   *
+   * Snapshot of the committed state produced by the intention at the log
+   * position. Returns nullptr if the intention aborted, hasn't been
+   * processed yet, or its after image can't be found. The snapshot is read
+   * lazily from the log.
+   */
+  virtual Snapshot *GetSnapshotAt(uint64_t intention_pos) = 0;
+
+  /*
+   * Drop the reference returned by GetSnapshot or GetSnapshotAt. Iterators
+   * hold their own reference, so the snapshot may be released before
+   * iterators reading it are deleted.
    */
   virtual void ReleaseSnapshot(Snapshot *snapshot) = 0;
 
   /*
    *
    */
-  virtual Iterator *NewIterator(Snapshot *snapshot) = 0;
+  virtual Iterator *NewIterator(const ReadOptions& options,
+      Snapshot *snapshot) = 0;
+
+  /*
+   * Iterate over options.snapshot, or the latest committed state if it is
+   * null, in which case the snapshot is released when the iterator is
+   * deleted.
+   */
+  virtual Iterator *NewIterator(const ReadOptions& options) = 0;
+
+  /*
+   * Split the range of an iteration into at most partitions ranges holding
+   * roughly the same number of keys, and return an iterator for each, in key
+   * order. The iterators read the same snapshot and are independent, so they
+   * may be used concurrently from different threads. Fewer iterators are
+   * returned when the range is too small to split.
+   */
+  virtual std::vector<Iterator*> NewPartitionedIterators(
+      const ReadOptions& options, size_t partitions) = 0;
+
+  /*
+   * The number of keys in the range of an iteration, and the total size of
+   * their keys and values. These are computed from statistics kept for each
+   * subtree, in time logarithmic in the size of the database. Trees written
+   * before the statistics were recorded are scanned instead.
+   */
+  virtual uint64_t Count(const ReadOptions& options) = 0;
+  virtual uint64_t GetApproximateSize(const ReadOptions& options) = 0;
+
+  Iterator *NewIterator(Snapshot *snapshot) {
+    return NewIterator(ReadOptions(), snapshot);
+  }
 
   Iterator *NewIterator() {
-    return NewIterator(GetSnapshot());
+    return NewIterator(ReadOptions());
   }
 
   /*
-   * Lookup a key in the latest committed database snapshot.
+   * Lookup a key in options.snapshot, or the latest committed database
+   * snapshot if it is null.
    */
-  virtual int Get(const zlog::Slice& key, std::string *value) = 0;
+  virtual int Get(const ReadOptions& options, const zlog::Slice& key,
+      std::string *value) = 0;
+
+  int Get(const zlog::Slice& key, std::string *value) {
+    return Get(ReadOptions(), key, value);
+  }
+
+  /*
+   * Like Get, but the value isn't copied. The value refers to the database's
+   * copy, which is kept in memory until the value is reset or destroyed.
+   */
+  virtual int Get(const ReadOptions& options, const zlog::Slice& key,
+      PinnableSlice *value) = 0;
+
+  int Get(const zlog::Slice& key, PinnableSlice *value) {
+    return Get(ReadOptions(), key, value);
+  }
 };
 
 }
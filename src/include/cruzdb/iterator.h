@@ -1,5 +1,7 @@
 #pragma once
+#include <cstdint>
 #include <zlog/slice.h>
+#include "pinnable_slice.h"
 
 namespace cruzdb {
 
@@ -24,6 +26,11 @@ class Iterator {
   // an entry that comes at or past target.
   virtual void Seek(const zlog::Slice& target) = 0;
 
+  // Position at the key with the given zero-based rank among the keys in
+  // the source. The iterator is Valid() after this call iff the source
+  // contains more than rank keys.
+  virtual void SeekToRank(uint64_t rank) = 0;
+
   // Moves to the next entry in the source.  After this call, Valid() is
   // true iff the iterator was not positioned at the last entry in the source.
   // REQUIRES: Valid()
@@ -45,6 +52,12 @@ class Iterator {
   // the iterator.
   // REQUIRES: !AtEnd() && !AtStart()
   virtual zlog::Slice value() const = 0;
+
+  // Return the value for the current entry without copying it. Unlike
+  // value(), the returned value remains valid after the iterator is moved or
+  // destroyed, until it is reset.
+  // REQUIRES: Valid()
+  virtual void value(PinnableSlice *value) const = 0;
 };
 
 }
@@ -1,15 +1,136 @@
 #pragma once
 #include <memory>
+#include <string>
+#include <zlog/slice.h>
 
 namespace cruzdb {
 
+class Snapshot;
 class Statistics;
 
 struct Options {
   std::shared_ptr<Statistics> statistics = nullptr;
   size_t node_cache_size = 512*1024*1024;
   size_t imap_cache_size = 100000;
-  size_t entry_cache_size = 1000;
+
+  // memory budgets for parsed log entries. intentions and after images are
+  // each evicted by a CLOCK approximation of lru.
+  size_t entry_cache_intention_size = 64*1024*1024;
+  size_t entry_cache_after_image_size = 64*1024*1024;
+
+  // deprecated: use entry_cache_intention_size. when non-zero, it replaces the
+  // intention budget, and is a size in bytes rather than a number of entries.
+  size_t entry_cache_size = 0;
+
+  // number of log reads kept in flight ahead of the log reader, and the number
+  // of threads used to decode them.
+  size_t log_readahead_window = 64;
+  size_t log_parse_threads = 2;
+
+  // number of finalized after images between checkpoint records. when opened,
+  // the database restores from the checkpoint nearest the tail of the log, so
+  // this bounds how far back the log is scanned. set to zero to disable.
+  size_t checkpoint_interval = 1000;
+
+  // while rolling the log forward on open, the read-ahead window is widened
+  // and recovery_prefetch_threads read upcoming intentions in parallel and
+  // walk the tree to the keys they modify, so the after images needed to
+  // replay them are cached before they are processed. prefetching stays
+  // within recovery_readahead_window positions of the transaction processor.
+  size_t recovery_readahead_window = 1024;
+  size_t recovery_prefetch_threads = 4;
+
+  // when an after image for an intention has already been read from the log,
+  // take the committed tree from it instead of replaying the intention. the
+  // existence of the after image implies that the intention committed, so
+  // conflict checking is skipped too. this lets a lagging or recovering
+  // instance catch up with about one read per intention.
+  bool adopt_after_images = true;
+
+  // staleness bounds for read-only instances (DB::OpenReadOnly). a snapshot
+  // is served if the instance caught up with the log tail within the last
+  // max_staleness_ms milliseconds, or if it is at most
+  // max_staleness_positions positions behind the tail. otherwise the read
+  // first waits for the instance to catch up. the position bound is measured
+  // from the newest tail seen by the log reader, so checking it doesn't touch
+  // the log. once the time bound has expired, a read checks the log tail.
+  // reads are never delayed when both are zero.
+  uint64_t max_staleness_positions = 0;
+  uint64_t max_staleness_ms = 0;
+
+  // nodes and other objects shared with lock-free readers are freed by a
+  // background reclaimer rather than the thread dropping the last reference.
+  // this is the most it frees before checking for more work, which bounds
+  // the time it holds the allocator busy.
+  size_t reclaim_batch_size = 1024;
+
+  // maximum number of asynchronous log appends in flight. set to zero to make
+  // all appends synchronous.
+  size_t log_max_inflight_appends = 32;
+
+  // fraction of the node cache reserved for nodes that have been accessed more
+  // than once. new nodes enter the remaining probationary space and are only
+  // promoted after a second access, which keeps large scans from flushing the
+  // nodes that point lookups depend on.
+  double node_cache_protected_ratio = 0.8;
+
+  // number of levels at the top of the latest committed tree that are pinned
+  // in memory and never evicted. every operation passes through these nodes.
+  // the newest committed intention markers, which the transaction processor
+  // scans when checking for conflicts, are pinned along with the paths to
+  // them. only nodes that are already in memory are pinned. pinned nodes count
+  // against node_cache_size, but they are not evicted or dropped by clearing
+  // the caches. pinning is disabled when the levels are zero.
+  size_t node_cache_pinned_levels = 0;
+  size_t node_cache_pinned_markers = 1024;
+
+  // directory on local storage used to cache after images read from the log.
+  // after images evicted from memory are read back from here instead of the
+  // log. the cache is rebuilt from scratch each time the database is opened.
+  // leave empty to disable.
+  std::string secondary_cache_path;
+  size_t secondary_cache_size = 4ULL*1024*1024*1024;
+  size_t secondary_cache_segment_size = 64*1024*1024;
+
+  // local file used to remember the after images backing the node cache's
+  // working set. the file is rewritten periodically while the database is
+  // open, and on open the listed after images are read back into the node
+  // cache in the background while requests are served. leave empty to disable.
+  std::string hot_set_path;
+  size_t hot_set_max_positions = 10000;
+  size_t hot_set_persist_interval_secs = 60;
+};
+
+struct ReadOptions {
+  // read from this snapshot rather than the latest committed state. the
+  // snapshot must not be released before the read completes, but iterators
+  // hold their own reference.
+  Snapshot *snapshot = nullptr;
+
+  // when set, an iterator stops at the first key at or past the upper bound
+  // (exclusive), and before the lower bound (inclusive). the slices must
+  // remain valid while the iterator is in use.
+  const zlog::Slice *iterate_lower_bound = nullptr;
+  const zlog::Slice *iterate_upper_bound = nullptr;
+
+  // when false, nodes read from the log to satisfy this read are not inserted
+  // into the node cache and the read does not affect cache replacement. use
+  // this for large scans that would otherwise evict the working set.
+  bool fill_cache = true;
+
+  // an iterator pins the nodes on the path to its current position, and for
+  // a long scan those belong to an increasingly old version of the tree. when
+  // non-zero, every rebase_interval steps the iterator moves to the latest
+  // committed state, continuing from its current key. the scan then no longer
+  // reads a single consistent snapshot.
+  size_t rebase_interval = 0;
+
+  // when non-zero, an iterator reads ahead the after images holding the
+  // nodes it will visit next, while the caller consumes the current position.
+  // up to readahead_size bytes of after images are read in parallel into the
+  // entry cache. only nodes reachable from nodes already in memory are known,
+  // so each batch looks a few levels ahead of the iterator.
+  size_t readahead_size = 0;
 };
 
 }
@@ -0,0 +1,80 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <zlog/slice.h>
+
+namespace cruzdb {
+
+// A value returned without copying it out of the database. The slice points
+// into a tree node, and the node is kept in memory for as long as the value is
+// pinned, even after the snapshot or iterator it was read from is released.
+// Values that can't be pinned (e.g. those written by the reading transaction
+// itself) are copied into a buffer owned by the slice.
+//
+// Pinning a node prevents it from being freed, but not from being counted
+// against the node cache, so large numbers of long-lived pins should be
+// avoided. Reset releases the pin.
+class PinnableSlice {
+ public:
+  PinnableSlice() {}
+
+  PinnableSlice(const PinnableSlice& other) = delete;
+  PinnableSlice& operator=(const PinnableSlice& other) = delete;
+
+  PinnableSlice(PinnableSlice&& other) {
+    *this = std::move(other);
+  }
+
+  PinnableSlice& operator=(PinnableSlice&& other) {
+    if (this != &other) {
+      pin_ = std::move(other.pin_);
+      buf_ = std::move(other.buf_);
+      slice_ = pin_ ? other.slice_ : zlog::Slice(buf_);
+      other.Reset();
+    }
+    return *this;
+  }
+
+  // point at data, which remains valid while pin is held
+  void PinSlice(const zlog::Slice& data, std::shared_ptr<const void> pin) {
+    buf_.clear();
+    pin_ = std::move(pin);
+    slice_ = data;
+  }
+
+  // copy data into the slice's own buffer
+  void PinSelf(const zlog::Slice& data) {
+    pin_.reset();
+    buf_.assign(data.data(), data.size());
+    slice_ = zlog::Slice(buf_);
+  }
+
+  void Reset() {
+    pin_.reset();
+    buf_.clear();
+    slice_ = zlog::Slice();
+  }
+
+  bool IsPinned() const {
+    return pin_ != nullptr;
+  }
+
+  const char *data() const { return slice_.data(); }
+  size_t size() const { return slice_.size(); }
+  bool empty() const { return slice_.empty(); }
+
+  std::string ToString() const {
+    return slice_.ToString();
+  }
+
+  operator zlog::Slice() const {
+    return slice_;
+  }
+
+ private:
+  std::shared_ptr<const void> pin_;
+  std::string buf_;
+  zlog::Slice slice_;
+};
+
+}
@@ -17,6 +17,33 @@ enum Tickers : uint32_t {
   NODE_CACHE_NODES_READ,
   NODE_CACHE_FETCHES,
   NODE_CACHE_FREE,
+  NODE_CACHE_PROMOTE,
+  NODE_CACHE_PINNED_NODES,
+  NODE_CACHE_PINNED_BYTES,
+  SECONDARY_CACHE_HIT,
+  SECONDARY_CACHE_MISS,
+  SECONDARY_CACHE_INSERT,
+  SECONDARY_CACHE_EVICT,
+  NODE_CACHE_WARMUP_TOTAL,
+  NODE_CACHE_WARMUP_PROGRESS,
+  NODE_CACHE_WARMUP_LOADED,
+  NODE_CACHE_FETCHES_COALESCED,
+  LOG_READS_COALESCED,
+  LOG_CHECKPOINTS,
+  AFTER_IMAGE_APPENDS_SKIPPED,
+  AFTER_IMAGES_ADOPTED,
+  RECOVERY_POSITIONS_TOTAL,
+  RECOVERY_POSITIONS_DONE,
+  RECOVERY_INTENTIONS_PREFETCHED,
+  EPOCH_OBJECTS_RECLAIMED,
+  EPOCH_OBJECTS_PENDING,
+  SNAPSHOTS_OPEN,
+  ITERATORS_OPEN,
+  ITERATOR_PINNED_BYTES,
+  ITERATOR_READAHEAD_AFTER_IMAGES,
+  ITERATOR_READAHEAD_BYTES,
+  AFTER_IMAGES_FINALIZED,
+  LOG_READAHEAD_WINDOW,
   BYTES_WRITTEN,
   BYTES_READ,
   TICKER_ENUM_MAX
@@ -32,6 +59,33 @@ const std::vector<std::pair<Tickers, std::string>> TickersNameMap = {
   {NODE_CACHE_NODES_READ, "cruzdb.node_cache.nodes.read"},
   {NODE_CACHE_FETCHES, "cruzdb.node_cache.fetches"},
   {NODE_CACHE_FREE, "cruzdb.node_cache.free"},
+  {NODE_CACHE_PROMOTE, "cruzdb.node_cache.promote"},
+  {NODE_CACHE_PINNED_NODES, "cruzdb.node_cache.pinned.nodes"},
+  {NODE_CACHE_PINNED_BYTES, "cruzdb.node_cache.pinned.bytes"},
+  {SECONDARY_CACHE_HIT, "cruzdb.secondary_cache.hit"},
+  {SECONDARY_CACHE_MISS, "cruzdb.secondary_cache.miss"},
+  {SECONDARY_CACHE_INSERT, "cruzdb.secondary_cache.insert"},
+  {SECONDARY_CACHE_EVICT, "cruzdb.secondary_cache.evict"},
+  {NODE_CACHE_WARMUP_TOTAL, "cruzdb.node_cache.warmup.total"},
+  {NODE_CACHE_WARMUP_PROGRESS, "cruzdb.node_cache.warmup.progress"},
+  {NODE_CACHE_WARMUP_LOADED, "cruzdb.node_cache.warmup.loaded"},
+  {NODE_CACHE_FETCHES_COALESCED, "cruzdb.node_cache.fetches.coalesced"},
+  {LOG_READS_COALESCED, "cruzdb.log.reads_coalesced"},
+  {LOG_CHECKPOINTS, "cruzdb.log.checkpoints"},
+  {AFTER_IMAGE_APPENDS_SKIPPED, "cruzdb.after_image.appends_skipped"},
+  {AFTER_IMAGES_ADOPTED, "cruzdb.after_image.adopted"},
+  {RECOVERY_POSITIONS_TOTAL, "cruzdb.recovery.positions.total"},
+  {RECOVERY_POSITIONS_DONE, "cruzdb.recovery.positions.done"},
+  {RECOVERY_INTENTIONS_PREFETCHED, "cruzdb.recovery.intentions_prefetched"},
+  {EPOCH_OBJECTS_RECLAIMED, "cruzdb.epoch.objects_reclaimed"},
+  {EPOCH_OBJECTS_PENDING, "cruzdb.epoch.objects_pending"},
+  {SNAPSHOTS_OPEN, "cruzdb.snapshots.open"},
+  {ITERATORS_OPEN, "cruzdb.iterators.open"},
+  {ITERATOR_PINNED_BYTES, "cruzdb.iterators.pinned_bytes"},
+  {ITERATOR_READAHEAD_AFTER_IMAGES, "cruzdb.iterators.readahead.after_images"},
+  {ITERATOR_READAHEAD_BYTES, "cruzdb.iterators.readahead.bytes"},
+  {AFTER_IMAGES_FINALIZED, "cruzdb.after_image.finalized"},
+  {LOG_READAHEAD_WINDOW, "cruzdb.log.readahead_window"},
   {BYTES_WRITTEN, "cruzdb.bytes.written"},
   {BYTES_READ, "cruzdb.bytes.read"},
 };
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <zlog/slice.h>
+#include "pinnable_slice.h"
 
 namespace cruzdb {
 
@@ -13,6 +14,7 @@ class Transaction {
   virtual ~Transaction() {}
 
   virtual int Get(const zlog::Slice& key, std::string *value) = 0;
+  virtual int Get(const zlog::Slice& key, PinnableSlice *value) = 0;
   virtual void Put(const zlog::Slice& key, const zlog::Slice& value) = 0;
   virtual void Delete(const zlog::Slice& key) = 0;
 
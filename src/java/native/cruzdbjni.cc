@@ -5,7 +5,7 @@
 #include "org_cruzdb_CruzDB.h"
 #include "portal.h"
 
-static jbyteArray copyBytes(JNIEnv* env, std::string bytes) {
+static jbyteArray copyBytes(JNIEnv* env, const zlog::Slice& bytes) {
   const jsize jlen = static_cast<jsize>(bytes.size());
 
   jbyteArray jbytes = env->NewByteArray(jlen);
@@ -15,7 +15,7 @@ static jbyteArray copyBytes(JNIEnv* env, std::string bytes) {
   }
 
   env->SetByteArrayRegion(jbytes, 0, jlen,
-      const_cast<jbyte*>(reinterpret_cast<const jbyte*>(bytes.c_str())));
+      const_cast<jbyte*>(reinterpret_cast<const jbyte*>(bytes.data())));
   if(env->ExceptionCheck()) {
     // exception thrown: ArrayIndexOutOfBoundsException
     env->DeleteLocalRef(jbytes);
@@ -96,7 +96,7 @@ jint Java_org_cruzdb_CruzDB_get(JNIEnv *env, jobject jdb, jlong jdbHandle,
 
   zlog::Slice key_slice(reinterpret_cast<char*>(key), jkeyLength);
 
-  std::string value;
+  cruzdb::PinnableSlice value;
   int ret = db->Get(key_slice, &value);
 
   delete [] key;
@@ -107,7 +107,7 @@ jint Java_org_cruzdb_CruzDB_get(JNIEnv *env, jobject jdb, jlong jdbHandle,
   const jint value_length = static_cast<jint>(value.size());
   const jint length = std::min(jvalLength, value_length);
   env->SetByteArrayRegion(jval, jvalOffset, length,
-      const_cast<jbyte*>(reinterpret_cast<const jbyte*>(value.c_str())));
+      const_cast<jbyte*>(reinterpret_cast<const jbyte*>(value.data())));
   if (env->ExceptionCheck()) {
     return -2;
   }
@@ -130,7 +130,7 @@ jbyteArray Java_org_cruzdb_CruzDB_get__J_3BII
 
   zlog::Slice key_slice(reinterpret_cast<char*>(key), jkeyLength);
 
-  std::string value;
+  cruzdb::PinnableSlice value;
   int ret = db->Get(key_slice, &value);
 
   delete [] key;
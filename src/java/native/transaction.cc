@@ -7,7 +7,7 @@
 #include "portal.h"
 
 // TODO: put in common location
-static jbyteArray copyBytes(JNIEnv* env, std::string bytes) {
+static jbyteArray copyBytes(JNIEnv* env, const zlog::Slice& bytes) {
   const jsize jlen = static_cast<jsize>(bytes.size());
 
   jbyteArray jbytes = env->NewByteArray(jlen);
@@ -17,7 +17,7 @@ static jbyteArray copyBytes(JNIEnv* env, std::string bytes) {
   }
 
   env->SetByteArrayRegion(jbytes, 0, jlen,
-      const_cast<jbyte*>(reinterpret_cast<const jbyte*>(bytes.c_str())));
+      const_cast<jbyte*>(reinterpret_cast<const jbyte*>(bytes.data())));
   if(env->ExceptionCheck()) {
     // exception thrown: ArrayIndexOutOfBoundsException
     env->DeleteLocalRef(jbytes);
@@ -77,7 +77,7 @@ jbyteArray Java_org_cruzdb_Transaction_get(JNIEnv *env, jobject jtxn,
 
   zlog::Slice key_slice(reinterpret_cast<char*>(key), jkeyLength);
 
-  std::string value;
+  cruzdb::PinnableSlice value;
   int ret = txn->Get(key_slice, &value);
 
   delete [] key;